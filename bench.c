@@ -0,0 +1,116 @@
+/**
+ * "Listening to" daemon benchmarks harness.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+/* Normally defined in music.c */
+volatile sig_atomic_t music_running = 1;
+int sleep_pipe_fd;
+
+
+/** Core's configuration. */
+static struct config bench_cfg = {
+	PTHREAD_MUTEX_INITIALIZER,
+	0, LOG_NOTICE, 0,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	0, 0, 0,
+	0, 0, 0,
+	0, 0, 0, 0, 0
+};
+
+/** Core module. */
+static struct music_module bench_core = {
+	-1,
+	0, 0, 0,
+	0,
+	{ 0 }, 0, 0,
+	0, 0,
+	{ -1, -1 }, 0,
+	(char*)"bench",
+	LOG_NOTICE,
+	0
+};
+
+/** Iterations scale factor. */
+static double bench_scale = 1.0;
+
+
+
+struct music_module *bench_init(int argc, char **argv) {
+	int pipe_fds[2], fd;
+
+	if (argc > 1 && (bench_scale = atof(argv[1])) <= 0) {
+		fprintf(stderr, "usage: %s [ scale ]\n", argv[0]);
+		exit(1);
+	}
+
+	if (pipe(pipe_fds)) {
+		perror("pipe");
+		exit(1);
+	}
+	sleep_pipe_fd = pipe_fds[0];
+
+	/* Logs go nowhere so that we measure formatting, not terminal */
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+		dup2(fd, 2);
+		close(fd);
+	}
+
+	bench_core.core = &bench_core;
+	bench_core.data = &bench_cfg;
+	return &bench_core;
+}
+
+
+
+unsigned long bench_n(unsigned long n) {
+	n = n * bench_scale;
+	return n ? n : 1;
+}
+
+
+
+unsigned long long bench_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+
+void bench_report(const char *restrict name, unsigned long long ops,
+                  unsigned long long ns, unsigned long long bytes) {
+	const double sec = ns ? ns / 1e9 : 1e-9;
+	printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns\":%llu,"
+	       "\"ns_per_op\":%.2f,\"ops_per_sec\":%.1f",
+	       name, ops, ns, ops ? (double)ns / ops : 0.0, ops / sec);
+	if (bytes) {
+		printf(",\"mb_per_sec\":%.2f", bytes / sec / 1e6);
+	}
+	puts("}");
+	fflush(stdout);
+}
@@ -0,0 +1,74 @@
+/**
+ * "Listening to" daemon benchmarks harness.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MUSIC_BENCH_H
+#define MUSIC_BENCH_H
+
+#include "music-int.h"
+
+
+/**
+ * Initialises benchmark: creates a core module (with log level set
+ * to LOG_NOTICE and log going to /dev/null), sleep pipe and parses
+ * arguments.  The only argument a benchmark accepts is a scale
+ * factor by which number of iterations is multiplied.
+ *
+ * @param argc main()'s argc.
+ * @param argv main()'s argv.
+ * @return core module.
+ */
+struct music_module *bench_init(int argc, char **argv)
+	__attribute__((nonnull));
+
+
+/**
+ * Scales number of iterations by the factor given on command line.
+ *
+ * @param n default number of iterations.
+ * @return scaled number of iterations (at least one).
+ */
+unsigned long bench_n(unsigned long n);
+
+
+/**
+ * Returns monotonic time in nanoseconds.
+ *
+ * @return monotonic time in nanoseconds.
+ */
+unsigned long long bench_ns(void);
+
+
+/**
+ * Prints benchmark's result as a single line JSON object on standard
+ * output, ie.:
+ *
+ * \code
+ * {"bench":"sha1/1024","ops":100000,"ns":81234567,"ns_per_op":812.35,"ops_per_sec":1231006.2,"mb_per_sec":1202.15}
+ * \endcode
+ *
+ * @param name benchmark's name.
+ * @param ops number of operations performed.
+ * @param ns time it took in nanoseconds.
+ * @param bytes number of bytes processed or zero if not applicable.
+ */
+void bench_report(const char *restrict name, unsigned long long ops,
+                  unsigned long long ns, unsigned long long bytes)
+	__attribute__((nonnull));
+
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * "Listening to" daemon song dispatcher benchmarks.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Producers submit songs with music_song() or music_songs() and
+ * a dummy output module counts them.  Time is measured from starting
+ * producers till output module has seen all songs.
+ */
+
+#include "bench.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+
+/** Number of songs passed to a single music_songs() call. */
+#define BATCH 64
+
+
+/** Number of songs output module has received. */
+static unsigned long sent_count;
+
+/** Number of songs each producer submits. */
+static unsigned long songs_per_producer;
+
+/** Whether producers use music_songs(). */
+static int use_batch;
+
+
+struct music_module *dispatcher_init();
+
+
+
+/**
+ * Dummy output module's send method.  Counts songs.
+ *
+ * @param m output module.
+ * @param songs a NULL terminated array of pointers to songs.
+ * @param errorPositions ignored.
+ * @return zero.
+ */
+static int   out_send(const struct music_module *restrict m,
+                      const struct music_song *restrict const *songs,
+                      size_t *restrict errorPositions) {
+	unsigned long n = 0;
+	(void)m;
+	(void)errorPositions;
+	while (*songs++) ++n;
+	__atomic_add_fetch(&sent_count, n, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+
+/**
+ * Producer thread.  Submits songs_per_producer songs.
+ *
+ * @param ptr core module.
+ * @return return value shall be ignored.
+ */
+static void *producer(void *ptr) {
+	const struct music_module *const core = ptr;
+	struct music_song songs[BATCH];
+	unsigned long i;
+
+	for (i = 0; i < BATCH; ++i) {
+		songs[i].title   = "Title";
+		songs[i].artist  = "Artist";
+		songs[i].album   = "Album";
+		songs[i].genre   = "Genre";
+		songs[i].length  = 240;
+		songs[i].time    = 0;
+		songs[i].endTime = 0;
+		songs[i].ingest  = 0;
+	}
+
+	if (use_batch) {
+		for (i = songs_per_producer; i; ) {
+			const unsigned long n = i < BATCH ? i : BATCH;
+			music_songs(core, songs, n);
+			i -= n;
+		}
+	} else {
+		for (i = songs_per_producer; i; --i) {
+			music_song(core, songs);
+		}
+	}
+	return 0;
+}
+
+
+
+/**
+ * Runs single benchmark.
+ *
+ * @param core core module.
+ * @param out dummy output module.
+ * @param producers number of producer threads.
+ * @param batch whether to use music_songs().
+ */
+static void run(struct music_module *restrict core,
+                struct music_module *restrict out,
+                unsigned producers, int batch) {
+	const unsigned long total = songs_per_producer * producers;
+	struct music_module *const d = dispatcher_init();
+	pthread_t threads[16];
+	unsigned long long start, ns;
+	char name[48];
+	unsigned i;
+
+	d->core = core;
+	d->next = out;
+	d->name = (char*)"dispatcher";
+	d->loglevel = core->loglevel;
+	core->next = d;
+
+	music_running = 1;
+	sent_count = 0;
+	use_batch = batch;
+	if (!d->start(d)) {
+		exit(1);
+	}
+
+	start = bench_ns();
+	for (i = 0; i < producers; ++i) {
+		pthread_create(threads + i, 0, producer, core);
+	}
+	for (i = 0; i < producers; ++i) {
+		pthread_join(threads[i], 0);
+	}
+	while (__atomic_load_n(&sent_count, __ATOMIC_ACQUIRE) < total) {
+		sched_yield();
+	}
+	ns = bench_ns() - start;
+
+	music_running = 0;
+	d->stop(d);
+	free(d);
+	core->next = 0;
+
+	sprintf(name, "dispatcher/%s/%u", batch ? "songs" : "song", producers);
+	bench_report(name, total, ns, 0);
+}
+
+
+
+int main(int argc, char **argv) {
+	struct music_module *const core = bench_init(argc, argv);
+	struct music_module *const out = music_init(MUSIC_OUT, 0);
+	static const unsigned producers[] = { 1, 2, 4, 8 };
+	unsigned i;
+
+	out->song.send = out_send;
+	out->core = core;
+	out->name = (char*)"out";
+	out->loglevel = core->loglevel;
+
+	for (i = 0; i < sizeof producers / sizeof *producers; ++i) {
+		songs_per_producer = bench_n(400000) / producers[i];
+		run(core, out, producers[i], 0);
+		run(core, out, producers[i], 1);
+	}
+
+	free(out);
+	return 0;
+}
@@ -0,0 +1,396 @@
+/**
+ * "Listening to" daemon end-to-end throughput harness.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Starts mock_server, then runs music daemon with in_dummy and
+ * out_http pointed at it.  After a warm up, daemon's stats socket is
+ * sampled twice and differences are reported as a single JSON object,
+ * ie.:
+ *
+ * \code
+ * {"bench":"e2e","seconds":10.00,"songs_per_sec":51234.5,...,
+ *  "ack_p50_us":2048,"ack_p90_us":4096,"ack_p99_us":8192,...,
+ *  "server":{"requests":5123,"songs":512345,...}}
+ * \endcode
+ *
+ * Songs per second are songs acknowledged by the server as reported
+ * by out_http while songs_sent is updated by the dispatcher only after
+ * whole batch was sent.  Percentiles come from daemon's histograms whose buckets are powers
+ * of two so reported values are buckets' upper bounds.  Must be run
+ * from directory containing music, mock_server and modules.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+/** Number of histogram buckets; must match music-metrics.c. */
+#define BUCKETS 41
+
+
+/**
+ * A histogram sample.
+ */
+struct histogram {
+	unsigned long long buckets[BUCKETS]; /**< Cumulative bucket counts. */
+	unsigned long long count;            /**< Number of observations. */
+};
+
+
+/**
+ * Sample of daemon's metrics.  Counters are summed over all modules.
+ */
+struct sample {
+	double time;                  /**< Moment sample was taken. */
+	unsigned long long sent;      /**< songs_sent */
+	unsigned long long failed;    /**< songs_failed */
+	unsigned long long requests;  /**< requests */
+	unsigned long long errors;    /**< request_errors */
+	struct histogram ack;         /**< latency_ack_us */
+	struct histogram request;     /**< request_duration_us */
+	struct histogram queue;       /**< latency_queue_us */
+};
+
+
+
+/**
+ * Takes sample of metrics from daemon's stats socket.
+ *
+ * @param path stats socket's path.
+ * @param s sample to fill.
+ * @return whether sampling succeed.
+ */
+static int  sample(const char *restrict path, struct sample *restrict s)
+	__attribute__((nonnull));
+
+
+/**
+ * Prints percentiles of difference of two histograms as JSON fields.
+ *
+ * @param name fields' prefix.
+ * @param a earlier sample.
+ * @param b later sample.
+ */
+static void print_percentiles(const char *restrict name,
+                              const struct histogram *restrict a,
+                              const struct histogram *restrict b)
+	__attribute__((nonnull));
+
+
+/**
+ * Reads a PID from file.
+ *
+ * @param path file's path.
+ * @return PID or zero if file does not exist or is invalid.
+ */
+static pid_t read_pid(const char *restrict path) __attribute__((nonnull));
+
+
+/**
+ * Returns monotonic time in seconds.
+ *
+ * @return monotonic time in seconds.
+ */
+static double now(void);
+
+
+
+int main(int argc, char **argv) {
+	const char *mockArgv[32] = { "./mock_server" };
+	double duration = 10, warmup = 1;
+	unsigned long rate = 0, threads = 1;
+	char dir[] = "/tmp/music-e2e.XXXXXX";
+	char path[4][64], line[1024];
+	struct sample a, b;
+	pid_t mock, daemon = 0;
+	unsigned port = 0;
+	int opt, pipeFds[2], i, ret = 1;
+	FILE *fp, *mockOut;
+
+	while ((opt = getopt(argc, argv, "d:w:r:t:h")) != -1) {
+		switch (opt) {
+		case 'd': duration = atof(optarg); break;
+		case 'w': warmup   = atof(optarg); break;
+		case 'r': rate     = strtoul(optarg, 0, 0); break;
+		case 't': threads  = strtoul(optarg, 0, 0); break;
+		default:
+			fputs("usage: bench_e2e [ -d sec ] [ -w sec ] [ -r rate ]"
+			      " [ -t threads ] [ -- mock_server-options ]\n"
+			      " -d  measurement duration in seconds (default 10)\n"
+			      " -w  warm up in seconds (default 1)\n"
+			      " -r  in_dummy's rate; 0 means as fast as possible\n"
+			      " -t  in_dummy's threads\n", stdout);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	for (i = 1; optind < argc && i < 31; ) {
+		mockArgv[i++] = argv[optind++];
+	}
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return 1;
+	}
+	sprintf(path[0], "%s/config", dir);
+	sprintf(path[1], "%s/log", dir);
+	sprintf(path[2], "%s/stats", dir);
+	sprintf(path[3], "%s/pid", dir);
+
+
+	/***** Start mock server *****/
+	if (pipe(pipeFds) || (mock = fork()) < 0) {
+		perror("fork");
+		goto cleanDir;
+	}
+	if (!mock) {
+		dup2(pipeFds[1], 1);
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		execv(mockArgv[0], (char **)mockArgv);
+		perror(mockArgv[0]);
+		_exit(1);
+	}
+	close(pipeFds[1]);
+	mockOut = fdopen(pipeFds[0], "r");
+	if (!fgets(line, sizeof line, mockOut) ||
+	    sscanf(line, "port %u", &port) != 1) {
+		fputs("mock_server did not start\n", stderr);
+		goto killMock;
+	}
+
+
+	/***** Start daemon *****/
+	if (!(fp = fopen(path[0], "w"))) {
+		perror(path[0]);
+		goto killMock;
+	}
+	/* in_dummy repeats songs so duplicates must not be dropped */
+	fprintf(fp, "logfile %s\nloglevel 8\nstats %s\npidfile %s\n"
+	        "dedupwindow 0\n"
+	        "module in_dummy\nrate %lu\nthreads %lu\n"
+	        "module out_http\nurl http://127.0.0.1:%u/\n",
+	        path[1], path[2], path[3], rate, threads, port);
+	fclose(fp);
+
+	switch ((daemon = fork())) {
+	case -1:
+		perror("fork");
+		goto killMock;
+	case 0:
+		execl("./music", "music", path[0], (char*)0);
+		perror("./music");
+		_exit(1);
+	}
+	if (waitpid(daemon, &i, 0) != daemon || !WIFEXITED(i) || WEXITSTATUS(i)) {
+		fprintf(stderr, "music did not start; see %s\n", path[1]);
+		daemon = 0;
+		goto killMock;
+	}
+
+	for (daemon = 0, i = 0; i < 100 && !(daemon = read_pid(path[3])); ++i) {
+		usleep(50000);
+	}
+	if (!daemon) {
+		fprintf(stderr, "music did not start; see %s\n", path[1]);
+		goto killMock;
+	}
+
+
+	/***** Measure *****/
+	usleep(warmup * 1e6);
+	if (!sample(path[2], &a)) {
+		fprintf(stderr, "%s: could not read stats\n", path[2]);
+		goto killDaemon;
+	}
+	usleep(duration * 1e6);
+	if (!sample(path[2], &b)) {
+		fprintf(stderr, "%s: could not read stats\n", path[2]);
+		goto killDaemon;
+	}
+
+	duration = b.time - a.time;
+	printf("{\"bench\":\"e2e\",\"seconds\":%.2f,"
+	       "\"songs_per_sec\":%.1f,\"requests_per_sec\":%.1f,"
+	       "\"songs_sent\":%llu,\"songs_failed\":%llu,"
+	       "\"requests\":%llu,\"request_errors\":%llu",
+	       duration, (b.ack.count - a.ack.count) / duration,
+	       (b.requests - a.requests) / duration,
+	       b.sent - a.sent, b.failed - a.failed,
+	       b.requests - a.requests, b.errors - a.errors);
+	print_percentiles("ack", &a.ack, &b.ack);
+	print_percentiles("request", &a.request, &b.request);
+	print_percentiles("queue", &a.queue, &b.queue);
+	ret = 0;
+
+
+	/***** Clean up *****/
+ killDaemon:
+	kill(daemon, SIGINT);
+	for (i = 0; i < 200 && !kill(daemon, 0); ++i) {
+		usleep(50000);
+	}
+
+ killMock:
+	kill(mock, SIGINT);
+	if (!ret) {
+		if (fgets(line, sizeof line, mockOut)) {
+			line[strcspn(line, "\n")] = 0;
+			printf(",\"server\":%s", line);
+		}
+		puts("}");
+	}
+	fclose(mockOut);
+	waitpid(mock, 0, 0);
+
+ cleanDir:
+	if (ret) {
+		fprintf(stderr, "files left in %s\n", dir);
+	} else {
+		for (i = 0; i < 4; ++i) unlink(path[i]);
+		rmdir(dir);
+	}
+	return ret;
+}
+
+
+
+static int  sample(const char *restrict path, struct sample *restrict s) {
+	struct sockaddr_un addr;
+	char line[256], name[64], le[32];
+	unsigned long long value;
+	FILE *fp;
+	int fd;
+
+	memset(s, 0, sizeof *s);
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return 0;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) ||
+	    !(fp = fdopen(fd, "r"))) {
+		close(fd);
+		return 0;
+	}
+
+	s->time = now();
+	while (fgets(line, sizeof line, fp)) {
+		struct histogram *h = 0;
+		char *ch;
+
+		if (*line == '#' || sscanf(line, "music_%63[^{]", name) != 1 ||
+		    !(ch = strrchr(line, ' ')) || sscanf(ch, "%llu", &value) != 1) {
+			continue;
+		}
+
+		if (!strcmp(name, "songs_sent")) {
+			s->sent += value;
+		} else if (!strcmp(name, "songs_failed")) {
+			s->failed += value;
+		} else if (!strcmp(name, "requests")) {
+			s->requests += value;
+		} else if (!strcmp(name, "request_errors")) {
+			s->errors += value;
+		} else if (!strncmp(name, "latency_ack_us_", 15)) {
+			h = &s->ack;
+		} else if (!strncmp(name, "request_duration_us_", 20)) {
+			h = &s->request;
+		} else if (!strncmp(name, "latency_queue_us_", 17)) {
+			h = &s->queue;
+		}
+
+		if (!h || strcmp(strrchr(name, '_'), "_bucket")) {
+			continue;
+		}
+		if (!(ch = strstr(line, ",le=\"")) ||
+		    sscanf(ch + 5, "%31[^\"]", le) != 1) {
+			continue;
+		}
+		if (!strcmp(le, "+Inf")) {
+			h->buckets[BUCKETS - 1] += value;
+			h->count += value;
+		} else {
+			unsigned i = 0;
+			unsigned long long bound = strtoull(le, 0, 10);
+			while (i < BUCKETS - 1 && (1ull << i) < bound) ++i;
+			h->buckets[i] += value;
+		}
+	}
+
+	fclose(fp);
+	return 1;
+}
+
+
+
+static void print_percentiles(const char *restrict name,
+                              const struct histogram *restrict a,
+                              const struct histogram *restrict b) {
+	static const unsigned percentiles[] = { 50, 90, 99 };
+	const unsigned long long count = b->count - a->count;
+	unsigned p, i = 0;
+
+	printf(",\"%s_count\":%llu", name, count);
+	for (p = 0; p < sizeof percentiles / sizeof *percentiles; ++p) {
+		const unsigned long long rank =
+			(count * percentiles[p] + 99) / 100;
+		if (!count) {
+			printf(",\"%s_p%u_us\":null", name, percentiles[p]);
+			continue;
+		}
+		while (i < BUCKETS - 1 && b->buckets[i] - a->buckets[i] < rank) ++i;
+		if (i == BUCKETS - 1) {
+			printf(",\"%s_p%u_us\":\"+Inf\"", name, percentiles[p]);
+		} else {
+			printf(",\"%s_p%u_us\":%llu", name, percentiles[p], 1ull << i);
+		}
+	}
+}
+
+
+
+static pid_t read_pid(const char *restrict path) {
+	FILE *const fp = fopen(path, "r");
+	long pid = 0;
+	if (fp) {
+		if (fscanf(fp, "%ld", &pid) != 1) pid = 0;
+		fclose(fp);
+	}
+	return pid;
+}
+
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,103 @@
+/**
+ * "Listening to" daemon logging benchmarks.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Standard error is redirected to /dev/null by bench_init() so this
+ * measures formatting, locking and queueing rather then the terminal.
+ * Asynchronous results include time needed to drain the queue.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+
+
+
+/** Number of messages each thread logs. */
+static unsigned long messages;
+
+
+
+/**
+ * Logging thread.
+ *
+ * @param ptr core module.
+ * @return return value shall be ignored.
+ */
+static void *logger(void *ptr) {
+	const struct music_module *const m = ptr;
+	unsigned long i;
+	for (i = 0; i < messages; ++i) {
+		music_log(m, LOG_NOTICE, "got song: %s <%s> %s [%u sec]",
+		          "Artist", "Album", "Title", 240u);
+	}
+	return 0;
+}
+
+
+
+/**
+ * Runs single benchmark.
+ *
+ * @param core core module.
+ * @param threads number of logging threads.
+ * @param slots asynchronous log's queue size or zero for synchronous
+ *        logging.
+ */
+static void run(struct music_module *restrict core, unsigned threads,
+                unsigned slots) {
+	struct config *const cfg = core->data;
+	unsigned long long start, ns;
+	pthread_t tids[16];
+	char name[32];
+	unsigned i;
+
+	start = bench_ns();
+	if (slots && !(cfg->logasync = log_async_start(slots, 0))) {
+		return;
+	}
+	for (i = 0; i < threads; ++i) {
+		pthread_create(tids + i, 0, logger, core);
+	}
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tids[i], 0);
+	}
+	if (slots) {
+		log_async_stop(cfg->logasync);
+		cfg->logasync = 0;
+	}
+	ns = bench_ns() - start;
+
+	sprintf(name, "log/%s/%u", slots ? "async" : "sync", threads);
+	bench_report(name, messages * threads, ns, 0);
+}
+
+
+
+int main(int argc, char **argv) {
+	struct music_module *const core = bench_init(argc, argv);
+	static const unsigned threads[] = { 1, 4 };
+	unsigned i;
+
+	for (i = 0; i < sizeof threads / sizeof *threads; ++i) {
+		messages = bench_n(400000) / threads[i];
+		run(core, threads[i], 0);
+		run(core, threads[i], 4096);
+	}
+	return 0;
+}
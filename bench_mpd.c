@@ -0,0 +1,154 @@
+/**
+ * "Listening to" daemon libmpdclient benchmarks.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A fake MPD server thread answers every command with a playlist of
+ * SONGS songs and the client parses it with mpd_getNextInfoEntity().
+ * This measures libmpdclient's line reading and parsing which is
+ * what in_mpd spends its time on.
+ */
+
+#include "bench.h"
+#include "libmpdclient.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+
+/** Number of songs in a playlist. */
+#define SONGS 100
+
+
+/** Server's response to a command. */
+static char *response;
+
+/** Server's response length. */
+static size_t responseLength;
+
+
+
+/**
+ * Fake MPD server thread.  Accepts a single connection and answers
+ * each line with response.
+ *
+ * @param ptr pointer to listening socket.
+ * @return return value shall be ignored.
+ */
+static void *server(void *ptr) {
+	char buf[4096];
+	ssize_t r;
+	int fd;
+
+	if ((fd = accept(*(int*)ptr, 0, 0)) < 0) {
+		return 0;
+	}
+	if (write(fd, "OK MPD 0.13.0\n", 14) != 14) {
+		goto done;
+	}
+	while ((r = read(fd, buf, sizeof buf)) > 0) {
+		const char *ch = buf, *const end = buf + r;
+		for (; (ch = memchr(ch, '\n', end - ch)); ++ch) {
+			size_t off = 0;
+			while (off < responseLength) {
+				ssize_t w = write(fd, response + off, responseLength - off);
+				if (w <= 0) goto done;
+				off += w;
+			}
+		}
+	}
+ done:
+	close(fd);
+	return 0;
+}
+
+
+
+int main(int argc, char **argv) {
+	char path[64];
+	struct sockaddr_un addr;
+	unsigned long long start, ns, entities = 0;
+	mpd_Connection *conn;
+	pthread_t thread;
+	unsigned long i, n;
+	FILE *fp;
+	int fd;
+
+	bench_init(argc, argv);
+	n = bench_n(20000);
+
+	fp = open_memstream(&response, &responseLength);
+	for (i = 0; i < SONGS; ++i) {
+		fprintf(fp, "file: music/Artist %lu/Album/%02lu - Title.ogg\n"
+		        "Time: %lu\nArtist: Artist %lu\nTitle: Title %lu\n"
+		        "Album: Album\nTrack: %lu\nGenre: Rock\nPos: %lu\nId: %lu\n",
+		        i, i % 20, 180 + i, i, i, i % 20, i, i);
+	}
+	fputs("OK\n", fp);
+	fclose(fp);
+
+	sprintf(path, "/tmp/music-bench-mpd.%ld", (long)getpid());
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof addr) || listen(fd, 1)) {
+		perror(path);
+		return 1;
+	}
+	pthread_create(&thread, 0, server, &fd);
+
+	conn = mpd_newConnection(path, 0, 10);
+	if (conn->error) {
+		fprintf(stdout, "mpd: %s\n", conn->errorStr);
+		unlink(path);
+		return 1;
+	}
+
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		mpd_InfoEntity *entity;
+		mpd_sendPlaylistInfoCommand(conn, -1);
+		while ((entity = mpd_getNextInfoEntity(conn))) {
+			++entities;
+			mpd_freeInfoEntity(entity);
+		}
+		mpd_finishCommand(conn);
+	}
+	ns = bench_ns() - start;
+
+	if (conn->error || entities != (unsigned long long)n * SONGS) {
+		fprintf(stdout, "mpd: parsing failed\n");
+		unlink(path);
+		return 1;
+	}
+	bench_report("mpd/playlistinfo", entities, ns,
+	             (unsigned long long)n * responseLength);
+
+	mpd_closeConnection(conn);
+	pthread_join(thread, 0);
+	close(fd);
+	unlink(path);
+	free(response);
+	return 0;
+}
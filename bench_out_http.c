@@ -0,0 +1,218 @@
+/**
+ * "Listening to" daemon out_http module benchmarks.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Module is included directly so that static functions such as
+ * escape() can be benchmarked.  Response parsing is benchmarked by
+ * feeding request_gotHead() and request_gotBody() the same way CURL
+ * does, without any network traffic.
+ */
+
+#include "bench.h"
+#include "out_http.c"
+
+
+
+/** Number of songs in a single parsed response. */
+#define SONGS 100
+
+
+/**
+ * Benchmarks escape().
+ *
+ * @param n number of iterations.
+ */
+static void bench_escape(unsigned long n) {
+	static const char *const strings[] = {
+		"Plain", "Song Title With Spaces", "Zażółć gęślą jaźń",
+		"AC/DC & Friends (Live at 100% [remastered])"
+	};
+	unsigned long long start, ns, bytes = 0;
+	char buf[256];
+	unsigned long i;
+
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		const char *const str = strings[i & 3];
+		bytes += strlen(str);
+		escape(buf, str, sizeof buf);
+	}
+	ns = bench_ns() - start;
+	bench_report("out_http/escape", n, ns, bytes);
+}
+
+
+
+/**
+ * Benchmarks request_addSong().
+ *
+ * @param m out_http module.
+ * @param n number of iterations.
+ * @param compact whether to build compact batches.
+ */
+static void bench_addSong(const struct music_module *restrict m,
+                          unsigned long n, int compact) {
+	struct music_song song = {
+		"Song Title", "Artist Name", "Album Name", "Genre",
+		0, 1190000000, 240, 0
+	};
+	struct request *const r = malloc(sizeof *r);
+	unsigned long long start, ns;
+	unsigned long i;
+
+	r->m = m;
+	r->post.length = r->post.start = 0;
+	r->request.count = 0;
+	r->request.limit = SIZE_MAX;
+	r->compact = compact;
+	request_dictClear(r);
+
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		if (!request_addSong(r, &song)) {
+			r->post.length = r->request.count = 0;
+			if (compact) request_dictClear(r);
+			request_addSong(r, &song);
+		}
+	}
+	ns = bench_ns() - start;
+	bench_report(compact ? "out_http/request_addCompact"
+	                     : "out_http/request_addSong", n, ns, 0);
+	free(r);
+}
+
+
+
+/**
+ * Benchmarks request_addAuth().
+ *
+ * @param m out_http module.
+ * @param n number of iterations.
+ */
+static void bench_addAuth(const struct music_module *restrict m,
+                          unsigned long n) {
+	struct module_config *const cfg = m->data;
+	struct request *const r = malloc(sizeof *r);
+	unsigned long long start, ns;
+	unsigned long i;
+
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		request_addAuth(r, cfg->auth);
+	}
+	ns = bench_ns() - start;
+	bench_report("out_http/request_addAuth", n, ns, 0);
+	free(r);
+}
+
+
+
+/**
+ * Benchmarks parsing server's response.  Each operation is
+ * a response acknowledging SONGS songs.
+ *
+ * @param m out_http module.
+ * @param n number of iterations.
+ */
+static void bench_response(const struct music_module *restrict m,
+                           unsigned long n) {
+	static const char *const head[] = {
+		"HTTP/1.1 200 OK\r\n", "Content-Type: text/x-music\r\n",
+		"Content-Length: 1234\r\n", "\r\n"
+	};
+	struct music_song song = {
+		"Song Title", "Artist Name", "Album Name", "Genre",
+		0, 1190000000, 240, 0
+	};
+	const struct music_song *songs[SONGS + 1];
+	struct request *const r = malloc(sizeof *r);
+	unsigned long long start, ns;
+	char body[SONGS * 16 + 32], *p = body;
+	size_t bodyLength;
+	unsigned long i;
+
+	for (i = 0; i < SONGS; ++i) {
+		songs[i] = &song;
+	}
+	songs[SONGS] = 0;
+
+	p += sprintf(p, "MUSIC 100 OK\n");
+	for (i = 0; i < SONGS; ++i) {
+		p += sprintf(p, "SONG %lu OK\n", i);
+	}
+	p += sprintf(p, "END\n");
+	bodyLength = p - body;
+
+	r->m = m;
+	r->songs = songs;
+	r->error.positions = 0;
+	r->buffer.data = 0;
+	r->buffer.capacity = 0;
+
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		unsigned j;
+		r->handled = r->error.count = 0;
+		r->request.count = SONGS;
+		r->request.handled = 0;
+		r->buffer.length = 0;
+		r->state = ST_HEADER_HTTP;
+		r->exitCode = RT_OK;
+		for (j = 0; j < sizeof head / sizeof *head; ++j) {
+			request_gotHead(head[j], 1, strlen(head[j]), r);
+		}
+		request_gotBody(body, 1, bodyLength, r);
+	}
+	ns = bench_ns() - start;
+
+	if (r->exitCode != RT_OK || r->request.handled != SONGS) {
+		fprintf(stdout, "out_http/response: parsing failed\n");
+		exit(1);
+	}
+	bench_report("out_http/response", n, ns,
+	             (unsigned long long)n * bodyLength);
+	free(r->buffer.data);
+	free(r);
+}
+
+
+
+int main(int argc, char **argv) {
+	struct music_module *const core = bench_init(argc, argv);
+	struct music_module *const m = init("out_http", "");
+
+	m->core = core;
+	m->name = (char*)"out_http";
+	m->loglevel = core->loglevel;
+	m->config(m, "url", "http://localhost/music.php");
+	m->config(m, "username", "bench");
+	m->config(m, "password", "bench");
+	if (!m->config(m, 0, 0) || !m->start(m)) {
+		return 1;
+	}
+
+	bench_escape(bench_n(4000000));
+	bench_addSong(m, bench_n(2000000), 0);
+	bench_addSong(m, bench_n(2000000), 1);
+	bench_addAuth(m, bench_n(2000000));
+	bench_response(m, bench_n(50000));
+
+	m->free(m);
+	free(m);
+	return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * "Listening to" daemon SHA-1 benchmarks.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "sha1.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+/**
+ * Benchmarks sha1() on messages of given length.
+ *
+ * @param len message's length.
+ * @param n number of iterations.
+ */
+static void bench_sha1(size_t len, unsigned long n) {
+	unsigned char *const msg = malloc(len), hash[20];
+	unsigned long long start, ns;
+	unsigned long i;
+	char name[32];
+
+	memset(msg, 'x', len);
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		msg[0] = i;
+		sha1(hash, msg, len);
+	}
+	ns = bench_ns() - start;
+
+	sprintf(name, "sha1/%lu", (unsigned long)len);
+	bench_report(name, n, ns, (unsigned long long)n * len);
+	free(msg);
+}
+
+
+
+int main(int argc, char **argv) {
+	/* Layout used by out_http's request_addAuth(): 20 bytes of
+	   password's hash followed by a hexadecimal time stamp. */
+	unsigned char msg[30] = "01234567890123456789" "47a1b2c3";
+	unsigned long long start, ns;
+	unsigned long i, n;
+	char hash[29];
+
+	bench_init(argc, argv);
+
+	bench_sha1(64, bench_n(1000000));
+	bench_sha1(1024, bench_n(200000));
+	bench_sha1(65536, bench_n(4000));
+
+	n = bench_n(1000000);
+	start = bench_ns();
+	for (i = 0; i < n; ++i) {
+		msg[27] = '0' + (i & 7);
+		sha1_b64(hash, msg, 28);
+	}
+	ns = bench_ns() - start;
+	bench_report("sha1_b64/auth", n, ns, (unsigned long long)n * 28);
+
+	return 0;
+}
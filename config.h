@@ -26,6 +26,13 @@
 #define HAVE_OPENSSL_H 0  /**< Defined as 1 when we have OpenSSL. */
 #define HAVE_ENDIAN_H  1  /**< Defined as 1 when we have endian.h. */
 
+#ifndef MUSIC_LOG_MAX_LEVEL
+/** Messages with greater level are compiled out.  Define as 15 (eg.
+    with "make NODEBUG=1") to remove debug messages from production
+    builds. */
+#  define MUSIC_LOG_MAX_LEVEL 19
+#endif
+
 
 #if __STDC_VERSION__ < 199901L
 #  if defined __GNUC__
@@ -19,9 +19,12 @@
 #include "music-int.h"
 
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <unistd.h>
+
 
 /**
  * Starts module.  See music_module::start.
@@ -47,10 +50,9 @@ static void  module_stop (const struct music_module *restrict m)
  * behaves a bit differently.  In particular -- modules is
  * ignored.
  *
- * @param m dispatcher module to stop.
- * @param song the song songs.
+ * @param m dispatcher module.
+ * @param song the song.
  * @param modules ignored.
- * @return undefined value.
  */
 static void  module_cache(const struct music_module *restrict m,
                           const struct music_song *restrict song,
@@ -80,15 +82,49 @@ static void *module_run_no_cache(void *restrict ptr) __attribute__((nonnull));
 
 
 /**
- * A linked list element used to store songs.
+ * A linked list element used to store songs.  Once queued the song
+ * is immutable and shared with output and cache modules which may
+ * keep it with music_song_ref().  It is freed when the last reference
+ * is released.
  */
 struct slist {
 	struct slist *next;      /**< Next element. */
+	size_t refs;             /**< Number of references. */
 	struct music_song song;  /**< Song. */
 };
 
 
 
+/**
+ * An entry of set of recently seen songs.
+ */
+struct dedup_entry {
+	uint64_t hash;               /**< Song's hash; zero if slot is empty. */
+	unsigned long long expires;  /**< Time entry expires at as returned
+	                                  by music_time_us(). */
+};
+
+/**
+ * Song an input module is now playing waiting to be passed to output
+ * modules.  There is at most one such entry for each input module.
+ */
+struct now_entry {
+	struct now_entry *next;           /**< Next entry. */
+	const struct music_module *in;    /**< Input module. */
+	struct slist *song;               /**< Song or NULL if nothing is
+	                                       played. */
+};
+
+
+
+/** Initial (and minimal) number of slots of recently seen songs set. */
+#define DEDUP_MIN_SLOTS 1024
+
+/** Maximal number of slots of recently seen songs set. */
+#define DEDUP_MAX_SLOTS (1 << 20)
+
+
+
 /**
  * Configuration for songs disptcher.
  */
@@ -99,29 +135,207 @@ struct dispatcher_config {
 	struct slist *first;    /**< First song on songs queue. */
 	size_t count;           /**< Number of songs in queue. */
 	size_t outCount;        /**< Number of otput modules. */
+	int run;                /**< Whether thread should keep running;
+	                             cleared when pausing. */
+	struct now_entry *now;  /**< Pending now playing updates. */
+
+	/**
+	 * Set of songs reported during last dedup window used to drop
+	 * duplicates.  It is an open addressing hash table with linear
+	 * probing.  Expired entries are skipped when looking up, reused
+	 * when inserting and dropped when table is rebuilt.
+	 */
+	struct dedup_entry *dedup;
+	size_t dedupMask;       /**< Number of slots minus one. */
+	size_t dedupUsed;       /**< Number of non-empty slots. */
+	pthread_mutex_t dedupMutex; /**< Mutex protecting the set. */
+
+	struct music_metric *queueLength;  /**< Songs in queue. */
+	struct music_metric *songsQueued;  /**< Songs put on queue. */
+	struct music_metric *songsDuplicate; /**< Duplicates dropped. */
+	struct music_metric *songsCached;  /**< Songs passed to cache. */
+	struct music_metric *nowUpdates;   /**< Now playing updates. */
+	struct music_metric *nowSuperseded; /**< Now playing updates dropped
+	                                         because of newer ones. */
+	struct music_metric *queueLatency; /**< Time from ingest to dequeue. */
+	struct music_metric *cacheLatency; /**< Time from ingest to being
+	                                        written to cache. */
+	/** Per output module metrics (OUT_METRICS*outCount elements):
+	    songs submitted, songs failed to submit, time from ingest to
+	    send start and time from ingest to successful submission. */
+	struct music_metric **outMetrics;
 };
 
+/** Number of per output module metrics. */
+#define OUT_METRICS 4
+
+
+/**
+ * Records time elapsed since each song's ingest in a histogram.
+ *
+ * @param metric histogram to record latency in.
+ * @param songs NULL terminated array of songs.
+ * @param mask bit mask of songs (at most 32 first ones) to skip.
+ * @param now current time as returned by music_time_us().
+ */
+static void observe_latency(struct music_metric *restrict metric,
+                            const struct music_song *restrict const *songs,
+                            uint_least32_t mask, unsigned long long now)
+	__attribute__((nonnull));
+static void observe_latency(struct music_metric *restrict metric,
+                            const struct music_song *restrict const *songs,
+                            uint_least32_t mask, unsigned long long now) {
+	for (; *songs; ++songs, mask >>= 1) {
+		if (!(mask & 1)) {
+			music_metric_observe(metric, now - (*songs)->ingest);
+		}
+	}
+}
+
+
 
 /**
- * Frees a single linked list and all song's data.
+ * Releases dispatcher's references to songs on a single linked list.
+ * Songs nobody else holds are freed.
  *
  * @param first linked list first element or NULL.
  */
-static void slist_free(struct slist *first) __attribute__((nonnull));
+static void slist_free(struct slist *first);
 static void slist_free(struct slist *first) {
 	struct slist *tmp;
 	for (; first; first = tmp) {
 		tmp = first->next;
-		free((char*)first->song.title );
-		free((char*)first->song.artist);
-		free((char*)first->song.album );
-		free((char*)first->song.genre );
-		free(first);
+		music_song_release(&first->song);
+	}
+}
+
+
+
+const struct music_song *music_song_ref(const struct music_song *restrict song) {
+	struct slist *const el = (struct slist *)
+		((const char *)song - offsetof(struct slist, song));
+	__atomic_add_fetch(&el->refs, 1, __ATOMIC_RELAXED);
+	return song;
+}
+
+
+
+void music_song_release(const struct music_song *restrict song) {
+	struct slist *const el = song ? (struct slist *)
+		((const char *)song - offsetof(struct slist, song)) : 0;
+	if (el && !__atomic_sub_fetch(&el->refs, 1, __ATOMIC_ACQ_REL)) {
+		music_intern_release(el->song.title );
+		music_intern_release(el->song.artist);
+		music_intern_release(el->song.album );
+		music_intern_release(el->song.genre );
+		free(el);
 	}
 }
 
 
 
+/**
+ * Copies a song into a new list element with reference count of one.
+ *
+ * @param song song to copy.
+ * @param now current time as returned by music_time_us().
+ * @return new element or NULL on error.
+ */
+static struct slist *slist_new(const struct music_song *restrict song,
+                               unsigned long long now)
+	__attribute__((nonnull, malloc));
+static struct slist *slist_new(const struct music_song *restrict song,
+                               unsigned long long now) {
+	struct slist *const el = malloc(sizeof *el);
+	if (!el) {
+		return 0;
+	}
+
+	/* Metadata repeats a lot so share it among queued songs */
+#define DUP(x) ((x) ? music_intern(x) : 0)
+	el->song.title   = DUP(song->title  );
+	el->song.artist  = DUP(song->artist );
+	el->song.album   = DUP(song->album  );
+	el->song.genre   = DUP(song->genre  );
+#undef DUP
+	el->song.time    = song->time   ;
+	el->song.endTime = song->endTime;
+	el->song.length  = song->length ;
+	el->song.ingest  = now;
+	el->refs         = 1;
+	el->next         = 0;
+
+	if ((song->title  && !el->song.title ) ||
+	    (song->artist && !el->song.artist) ||
+	    (song->album  && !el->song.album ) ||
+	    (song->genre  && !el->song.genre )) {
+		slist_free(el);
+		return 0;
+	}
+	return el;
+}
+
+
+
+/**
+ * Frees list of now playing updates.
+ *
+ * @param now first entry or NULL.
+ */
+static void now_free(struct now_entry *now);
+static void now_free(struct now_entry *now) {
+	struct now_entry *tmp;
+	for (; now; now = tmp) {
+		tmp = now->next;
+		slist_free(now->song);
+		free(now);
+	}
+}
+
+
+
+/**
+ * Passes now playing updates to output modules which implement
+ * nowPlaying method.  If flush is non-zero calls their song.send
+ * method with an empty array so the updates are submitted right away
+ * rather then with next songs.  Frees the list.
+ *
+ * @param m dispatcher module.
+ * @param now first entry or NULL.
+ * @param flush whether there are no songs to send.
+ */
+static void now_deliver(const struct music_module *restrict m,
+                        struct now_entry *now, int flush)
+	__attribute__((nonnull(1)));
+static void now_deliver(const struct music_module *restrict m,
+                        struct now_entry *now, int flush) {
+	struct dispatcher_config *const cfg = m->data;
+	const struct music_song *empty = 0;
+	const struct music_module *o;
+	struct now_entry *e;
+	size_t i;
+
+	if (!now) {
+		return;
+	}
+
+	for (o = m->next, i = cfg->outCount; i; o = o->next) {
+		if (!o->song.send) continue;
+		--i;
+		if (!o->nowPlaying) continue;
+		for (e = now; e; e = e->next) {
+			o->nowPlaying(o, e->song ? &e->song->song : 0);
+		}
+		if (flush) {
+			o->song.send(o, &empty, 0);
+		}
+	}
+
+	now_free(now);
+}
+
+
+
 /**
  * Initialises dispatcher module.
  *
@@ -139,7 +353,14 @@ struct music_module *dispatcher_init() {
 	cfg->first     = 0;
 	cfg->count     = 0;
 	cfg->outCount  = 0;
+	cfg->outMetrics = 0;
+	cfg->run       = 0;
+	cfg->now       = 0;
+	cfg->dedup     = 0;
+	cfg->dedupMask = 0;
+	cfg->dedupUsed = 0;
 	pthread_mutex_init(&cfg->mutex, 0);
+	pthread_mutex_init(&cfg->dedupMutex, 0);
 	pthread_cond_init (&cfg->cond, 0);
 
 	return m;
@@ -149,6 +370,28 @@ struct music_module *dispatcher_init() {
 
 static int   module_start(const struct music_module *restrict m) {
 	struct dispatcher_config *const cfg = m->data;
+
+	cfg->queueLength  = music_metric(m, "queue_length", MUSIC_GAUGE);
+	cfg->songsQueued  = music_metric(m, "songs_queued", MUSIC_COUNTER);
+	cfg->songsDuplicate = music_metric(m, "songs_duplicate", MUSIC_COUNTER);
+	cfg->nowUpdates   = music_metric(m, "now_playing", MUSIC_COUNTER);
+	cfg->nowSuperseded = music_metric(m, "now_playing_superseded",
+	                                  MUSIC_COUNTER);
+	cfg->queueLatency = music_metric(m, "latency_queue_us", MUSIC_HISTOGRAM);
+	if (m->core->next!=m) {
+		cfg->songsCached  = music_metric(m->core->next, "songs_cached",
+		                                 MUSIC_COUNTER);
+		cfg->cacheLatency = music_metric(m->core->next, "latency_cache_us",
+		                                 MUSIC_HISTOGRAM);
+	}
+
+	return dispatcher_resume(m);
+}
+
+
+
+int   dispatcher_resume(const struct music_module *restrict m) {
+	struct dispatcher_config *const cfg = m->data;
 	struct music_module *o = m->next;
 	size_t i = 0;
 	int ret;
@@ -166,6 +409,23 @@ static int   module_start(const struct music_module *restrict m) {
 		return 0;
 	}
 
+	free(cfg->outMetrics);
+	if (!(cfg->outMetrics = malloc(OUT_METRICS * i *
+	                               sizeof *cfg->outMetrics))) {
+		music_log(m, LOG_FATAL, "not enough memory");
+		return 0;
+	}
+	for (i = 0, o = m->next; o && o->type==MUSIC_OUT; o = o->next) {
+		if (!o->song.send) continue;
+		cfg->outMetrics[i++] = music_metric(o, "songs_sent", MUSIC_COUNTER);
+		cfg->outMetrics[i++] = music_metric(o, "songs_failed", MUSIC_COUNTER);
+		cfg->outMetrics[i++] = music_metric(o, "latency_send_start_us",
+		                                    MUSIC_HISTOGRAM);
+		cfg->outMetrics[i++] = music_metric(o, "latency_sent_us",
+		                                    MUSIC_HISTOGRAM);
+	}
+
+	cfg->run = 1;
 	if (m->core->next!=m) {
 		ret = pthread_create(&cfg->thread, 0, module_run_cache, (void*)m);
 	} else {
@@ -174,6 +434,9 @@ static int   module_start(const struct music_module *restrict m) {
 
 	if (ret) {
 		music_log_errno(m, LOG_FATAL, "pthread_create");
+		cfg->run = 0;
+		free(cfg->outMetrics);
+		cfg->outMetrics = 0;
 		return 0;
 	}
 	return 1;
@@ -181,16 +444,174 @@ static int   module_start(const struct music_module *restrict m) {
 
 
 
-static void  module_stop (const struct music_module *restrict m) {
+void  dispatcher_pause(const struct music_module *restrict m) {
 	struct dispatcher_config *cfg = m->data;
+	const struct music_module *o;
+	char ch;
+
 	pthread_mutex_lock(&cfg->mutex);
+	cfg->run = 0;
 	pthread_cond_signal(&cfg->cond);
 	pthread_mutex_unlock(&cfg->mutex);
+
+	/* Output module may be sleeping in music_sleep(); wake it up */
+	for (o = m->next; o && o->type==MUSIC_OUT; o = o->next) {
+		if (o->stopPipe[1] >= 0) write(o->stopPipe[1], "P", 1);
+	}
+
 	pthread_join(cfg->thread, 0);
+
+	for (o = m->next; o && o->type==MUSIC_OUT; o = o->next) {
+		if (o->stopPipe[0] >= 0) read(o->stopPipe[0], &ch, 1);
+	}
+}
+
+
+
+static void  module_stop (const struct music_module *restrict m) {
+	struct dispatcher_config *cfg = m->data;
+	dispatcher_pause(m);
 	pthread_mutex_destroy(&cfg->mutex);
 	pthread_cond_destroy(&cfg->cond);
+	pthread_mutex_destroy(&cfg->dedupMutex);
 
 	slist_free(cfg->first);
+	now_free(cfg->now);
+	free(cfg->outMetrics);
+	free(cfg->dedup);
+}
+
+
+
+/**
+ * Calculates 64-bit FNV-1a hash of song's artist, album, title and
+ * time.
+ *
+ * @param song song to calculate hash of.
+ * @return song's hash; never zero.
+ */
+static uint64_t song_hash(const struct music_song *restrict song)
+	__attribute__((nonnull, pure));
+static uint64_t song_hash(const struct music_song *restrict song) {
+	const char *const strings[3] = { song->artist, song->album, song->title };
+	uint64_t hash = 14695981039346656037ull, t = song->time;
+	const char *ch;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		for (ch = strings[i]; ch && *ch; ++ch) {
+			hash = (hash ^ (unsigned char)*ch) * 1099511628211ull;
+		}
+		hash = (hash ^ 0xff) * 1099511628211ull;  /* separator */
+	}
+	for (i = 0; i < 8; ++i, t >>= 8) {
+		hash = (hash ^ (t & 0xff)) * 1099511628211ull;
+	}
+	return hash ? hash : 1;
+}
+
+
+
+/**
+ * Rebuilds set of recently seen songs dropping expired entries.  Set
+ * grows if it is more then half full after that or shrinks if it is
+ * mostly empty.  If it would have to grow past DEDUP_MAX_SLOTS, entries
+ * which expire first are dropped.  Must be called with dedupMutex
+ * locked.
+ *
+ * @param cfg dispatcher's configuration.
+ * @param now current time as returned by music_time_us().
+ */
+static void dedup_rebuild(struct dispatcher_config *restrict cfg,
+                          unsigned long long now)
+	__attribute__((nonnull));
+static void dedup_rebuild(struct dispatcher_config *restrict cfg,
+                          unsigned long long now) {
+	struct dedup_entry *const old = cfg->dedup, *entries;
+	const size_t oldSlots = old ? cfg->dedupMask + 1 : 0;
+	unsigned long long cutoff = now, last = now;
+	size_t slots = oldSlots ? oldSlots : DEDUP_MIN_SLOTS, live, i, j;
+
+	for (;;) {
+		for (live = i = 0; i < oldSlots; ++i) {
+			if (old[i].hash && old[i].expires > cutoff) {
+				++live;
+				if (old[i].expires > last) last = old[i].expires;
+			}
+		}
+		while (slots < DEDUP_MAX_SLOTS && live * 2 > slots) slots *= 2;
+		while (slots > DEDUP_MIN_SLOTS && live * 8 < slots) slots /= 2;
+		if (live * 2 <= slots) break;
+		/* Set is full; drop entries which expire first */
+		cutoff += (last - cutoff) / 2 + 1;
+	}
+
+	if (!(entries = calloc(slots, sizeof *entries))) {
+		return;
+	}
+	for (i = 0; i < oldSlots; ++i) {
+		if (old[i].hash && old[i].expires > cutoff) {
+			for (j = old[i].hash & (slots - 1); entries[j].hash;
+			     j = (j + 1) & (slots - 1));
+			entries[j] = old[i];
+		}
+	}
+
+	free(old);
+	cfg->dedup     = entries;
+	cfg->dedupMask = slots - 1;
+	cfg->dedupUsed = live;
+}
+
+
+
+/**
+ * Checks whether song was seen during dedup window and if not adds it
+ * to set of recently seen songs.  Must be called with dedupMutex
+ * locked.
+ *
+ * @param cfg dispatcher's configuration.
+ * @param hash song's hash as returned by song_hash().
+ * @param now current time as returned by music_time_us().
+ * @param window dedup window in microseconds.
+ * @return whether song is a duplicate.
+ */
+static int  dedup_check(struct dispatcher_config *restrict cfg, uint64_t hash,
+                        unsigned long long now, unsigned long long window)
+	__attribute__((nonnull));
+static int  dedup_check(struct dispatcher_config *restrict cfg, uint64_t hash,
+                        unsigned long long now, unsigned long long window) {
+	struct dedup_entry *e, *reuse = 0;
+	size_t i;
+
+	/* Keep at most three quarters of slots used.  If set could not be
+	   rebuilt (no memory) song is not checked rather than risking
+	   probing a full set forever. */
+	if (!cfg->dedup || cfg->dedupUsed >= (cfg->dedupMask + 1) / 4 * 3) {
+		dedup_rebuild(cfg, now);
+		if (!cfg->dedup ||
+		    cfg->dedupUsed >= (cfg->dedupMask + 1) / 4 * 3) {
+			return 0;
+		}
+	}
+
+	for (i = hash & cfg->dedupMask; (e = cfg->dedup + i)->hash;
+	     i = (i + 1) & cfg->dedupMask) {
+		if (e->expires <= now) {
+			if (!reuse) reuse = e;
+		} else if (e->hash == hash) {
+			return 1;
+		}
+	}
+
+	if (reuse) {
+		e = reuse;
+	} else {
+		++cfg->dedupUsed;
+	}
+	e->hash    = hash;
+	e->expires = now + window;
+	return 0;
 }
 
 
@@ -198,30 +619,139 @@ static void  module_stop (const struct music_module *restrict m) {
 static void  module_cache(const struct music_module *restrict m,
                           const struct music_song *restrict song,
                           const struct music_module *restrict const *restrict modules){
-	struct dispatcher_config *const cfg = m->data;
-	struct slist *el = malloc(sizeof *el);
 	(void)modules;
+	dispatcher_songs(m, &song, 1);
+}
+
+
+
+void  dispatcher_songs(const struct music_module *restrict m,
+                       const struct music_song *restrict const *songs,
+                       size_t count) {
+	struct dispatcher_config *const cfg = m->data;
+	const unsigned long long window =
+		((const struct config *)m->core->data)->dedupWindow * 1000000ull;
+	struct slist *first = 0, *last = 0, *el, **p;
+	unsigned long long now;
+	size_t n = 0, duplicates = 0, failed = 0;
 
 	if (!music_running || !cfg->thread) return;
 
-#define DUP(x) ((x) ? music_strdup_realloc(0, (x)) : 0)
-	el->song.title   = DUP(song->title  );
-	el->song.artist  = DUP(song->artist );
-	el->song.album   = DUP(song->album  );
-	el->song.genre   = DUP(song->genre  );
-#undef DUP
-	el->song.time    = song->time   ;
-	el->song.endTime = song->endTime;
-	el->song.length  = song->length ;
+	/* Copy songs before taking the lock */
+	now = music_time_us();
+	for (; count; --count, ++songs) {
+		if (!(el = slist_new(*songs, now))) {
+			++failed;
+			continue;
+		}
+
+		/* Queue is LIFO so the last song goes first */
+		el->next = first;
+		first = el;
+		if (!last) last = el;
+		++n;
+	}
+
+	if (failed) {
+		music_log(m, LOG_ERROR, "not enough memory; dropped %lu song(s)",
+		          (unsigned long)failed);
+	}
+
+	/* Drop songs reported during dedup window */
+	if (window && n) {
+		pthread_mutex_lock(&cfg->dedupMutex);
+		for (last = 0, p = &first; (el = *p); ) {
+			if (dedup_check(cfg, song_hash(&el->song), now, window)) {
+				*p = el->next;
+				el->next = 0;
+				slist_free(el);
+				++duplicates;
+			} else {
+				last = el;
+				p = &el->next;
+			}
+		}
+		pthread_mutex_unlock(&cfg->dedupMutex);
+
+		if (duplicates) {
+			music_metric_add(cfg->songsDuplicate, duplicates);
+			music_log(m, LOG_DEBUG, "dropped %lu duplicate song(s)",
+			          (unsigned long)duplicates);
+			n -= duplicates;
+		}
+	}
+	if (!n) return;
 
 	pthread_mutex_lock(&cfg->mutex);
-	el->next = cfg->first;
-	cfg->first = el;
-	++cfg->count;
+	last->next = cfg->first;
+	cfg->first = first;
+	cfg->count += n;
+	music_metric_set(cfg->queueLength, cfg->count);
 	pthread_cond_signal(&cfg->cond);
 	pthread_mutex_unlock(&cfg->mutex);
+	music_metric_add(cfg->songsQueued, n);
+}
+
 
-	return;
+
+size_t dispatcher_queued(const struct music_module *restrict m) {
+	struct dispatcher_config *const cfg = m->data;
+	return __atomic_load_n(&cfg->count, __ATOMIC_RELAXED);
+}
+
+
+
+void  dispatcher_now(const struct music_module *restrict m,
+                     const struct music_module *restrict in,
+                     const struct music_song *restrict song) {
+	struct dispatcher_config *const cfg = m->data;
+	struct slist *el = 0, *old = 0;
+	struct now_entry *e, *entry = 0;
+	int superseded = 0;
+
+	if (!music_running || !cfg->thread) return;
+
+	/* Allocate before taking the lock */
+	if (song && !(el = slist_new(song, music_time_us()))) {
+		music_log(m, LOG_ERROR, "not enough memory; dropped now playing");
+		return;
+	}
+
+	/* Entry is needed only if there is no pending update from the
+	   input module; allocate it without the lock and look again */
+	pthread_mutex_lock(&cfg->mutex);
+	for (;;) {
+		for (e = cfg->now; e && e->in != in; e = e->next);
+		if (e || entry) {
+			break;
+		}
+		pthread_mutex_unlock(&cfg->mutex);
+		if (!(entry = malloc(sizeof *entry))) {
+			music_log(m, LOG_ERROR, "not enough memory; dropped now playing");
+			slist_free(el);
+			return;
+		}
+		pthread_mutex_lock(&cfg->mutex);
+	}
+	if (e) {
+		/* Latest wins */
+		old = e->song;
+		e->song = el;
+		superseded = 1;
+	} else {
+		entry->next = cfg->now;
+		entry->in   = in;
+		entry->song = el;
+		cfg->now    = entry;
+		entry       = 0;
+	}
+	pthread_cond_signal(&cfg->cond);
+	pthread_mutex_unlock(&cfg->mutex);
+
+	free(entry);
+	slist_free(old);
+	music_metric_add(cfg->nowUpdates, 1);
+	music_metric_add(cfg->nowSuperseded, superseded);
 }
 
 
@@ -231,32 +761,64 @@ static void *module_run_no_cache(void *restrict ptr) {
 	struct dispatcher_config *const cfg = m->data;
 	const size_t outCount = cfg->outCount;
 	struct music_song **songs, **s;
-	struct slist *el, *first;
-	size_t i;
+	struct slist *el, *first = 0;
+	struct now_entry *now = 0;
+	size_t i, count;
 
 	do {
 		pthread_mutex_lock(&cfg->mutex);
-		if (!cfg->first) {
+		while (!cfg->first && !cfg->now && cfg->run) {
 			pthread_cond_wait(&cfg->cond, &cfg->mutex);
 		}
+		if (!cfg->run) {
+			/* Paused; songs stay on queue till thread is resumed */
+			pthread_mutex_unlock(&cfg->mutex);
+			break;
+		}
 		el = first = cfg->first;
-		i = cfg->count;
+		count = i = cfg->count;
+		now = cfg->now;
 		cfg->first = 0;
 		cfg->count = 0;
+		cfg->now = 0;
+		music_metric_set(cfg->queueLength, 0);
 		pthread_mutex_unlock(&cfg->mutex);
 
 		if (!music_running) {
 			break;
 		}
 
+		now_deliver(m, now, !first);
+		now = 0;
+		if (!first) {
+			continue;
+		}
+
 		s = songs = malloc((i + 1) * sizeof *songs);
 		for (; el; el = el->next) *s++ = &el->song;
 		*s = 0;
+		observe_latency(cfg->queueLatency, (const struct music_song **)songs,
+		                0, music_time_us());
 
 		i = outCount;
 		for (o = m->next; i; o = o->next, --i) {
 			if (o->song.send) {
-				o->song.send(o, (const struct music_song **)songs, 0);
+				struct music_metric **const metrics = cfg->outMetrics +
+					OUT_METRICS * (outCount - i);
+				size_t failed;
+				int ret;
+
+				observe_latency(metrics[2], (const struct music_song **)songs,
+				                0, music_time_us());
+				ret = o->song.send(o, (const struct music_song **)songs, 0);
+				failed = ret < 0 || (size_t)ret > count ? count : (size_t)ret;
+				music_metric_add(metrics[0], count - failed);
+				music_metric_add(metrics[1], failed);
+				if (!failed) {
+					observe_latency(metrics[3],
+					                (const struct music_song **)songs, 0,
+					                music_time_us());
+				}
 			}
 		}
 
@@ -266,6 +828,7 @@ static void *module_run_no_cache(void *restrict ptr) {
 	} while (music_running);
 
 	slist_free(first);
+	now_free(now);
 	return 0;
 }
 
@@ -286,9 +849,10 @@ static void *module_run_cache  (void *restrict ptr) {
 	size_t i = cfg->outCount;
 	const struct music_module **const outs = malloc((i*2+1) * sizeof *outs);
 
-	uint_least32_t *flags = malloc(i);
+	uint_least32_t *flags = malloc(i * sizeof *flags);
 	const struct music_song *songs[33];
 	struct slist *first = 0, *el;
+	struct now_entry *now = 0;
 
 
 	{
@@ -301,22 +865,37 @@ static void *module_run_cache  (void *restrict ptr) {
 
 	do {
 		pthread_mutex_lock(&cfg->mutex);
-		if (!cfg->first) {
+		while (!cfg->first && !cfg->now && cfg->run) {
 			pthread_cond_wait(&cfg->cond, &cfg->mutex);
 		}
+		if (!cfg->run) {
+			/* Paused; songs stay on queue till thread is resumed */
+			pthread_mutex_unlock(&cfg->mutex);
+			break;
+		}
 		first = cfg->first;
+		now = cfg->now;
 		cfg->first = 0;
 		cfg->count = 0;
+		cfg->now = 0;
+		music_metric_set(cfg->queueLength, 0);
 		pthread_mutex_unlock(&cfg->mutex);
 
 		if (!music_running) {
 			break;
 		}
 
+		now_deliver(m, now, !first);
+		now = 0;
+		if (!first) {
+			continue;
+		}
+
 		el = first;
 		do {
 			for (i = 0; el && i<32; el = el->next) songs[i++] = &el->song;
 			songs[i] = 0;
+			observe_latency(cfg->queueLatency, songs, 0, music_time_us());
 			submit_songs_and_cache(m, songs, i, flags, outs);
 		} while (el);
 
@@ -326,6 +905,9 @@ static void *module_run_cache  (void *restrict ptr) {
 
 
 	slist_free(first);
+	now_free(now);
+	free(flags);
+	free(outs);
 	return 0;
 }
 
@@ -361,13 +943,24 @@ static void submit_songs_and_cache(const struct music_module *restrict m,
 
 	/* Submit songs */
 	for (i = 0; i < outCount; ++i) {
+		struct music_metric **const metrics = cfg->outMetrics + OUT_METRICS * i;
 		size_t errPos[32];
-		int ret = outs[i]->song.send(outs[i], songs, errPos);
+		int ret;
+
+		observe_latency(metrics[2], songs, 0, music_time_us());
+		ret = outs[i]->song.send(outs[i], songs, errPos);
 
 		if (ret<0 || (size_t)ret >= count) {
 			flags[i] = 0xffffffff;
+			ret = count;
 		} else if (ret) {
-			while (ret) flags[i] |= ((uint_least32_t)1) << (errPos[--ret]&31);
+			int n = ret;
+			while (n) flags[i] |= ((uint_least32_t)1) << (errPos[--n]&31);
+		}
+		music_metric_add(metrics[0], count - ret);
+		music_metric_add(metrics[1], ret);
+		if (flags[i] != 0xffffffff) {
+			observe_latency(metrics[3], songs, flags[i], music_time_us());
 		}
 	}
 
@@ -382,5 +975,7 @@ static void submit_songs_and_cache(const struct music_module *restrict m,
 		*p = 0;
 
 		m->core->next->song.cache(m->core->next, *s, oarr);
+		music_metric_add(cfg->songsCached, 1);
+		music_metric_observe(cfg->cacheLatency, music_time_us() - (*s)->ingest);
 	}
 }
@@ -16,6 +16,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -27,7 +28,7 @@
 /**
  * Starts module.  See music_module::start.
  *
- * @param m in_mpd module to start.
+ * @param m in_dummy module to start.
  * @return whether starting succeed.
  */
 static int   module_start(const struct music_module *restrict m)
@@ -37,28 +38,80 @@ static int   module_start(const struct music_module *restrict m)
 /**
  * Stops module.  See music_module::stop.
  *
- * @param m in_mpd module to stop.
+ * @param m in_dummy module to stop.
  */
 static void  module_stop (const struct music_module *restrict m)
 	__attribute__((nonnull));
 
 
 /**
- * Module's thread function.
+ * Frees memory allocated by module.  See music_module::free.
  *
- * @param ptr a pointer to const struct music_module cast to pointer
- *            to void.
+ * @param m in_dummy module to free.
+ */
+static void  module_free (struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Accepts configuration options.  See music_module::conf.
+ *
+ * @param m in_dummy module.
+ * @param opt option keyword.
+ * @param arg argument.
+ * @return whether option was accepted.
+ */
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt, const char *restrict arg)
+	__attribute__((nonnull(1)));
+
+
+/**
+ * Generator thread function.
+ *
+ * @param ptr a pointer to struct generator cast to pointer to void.
  * @return return value shall be ignored.
  */
 static void *module_run  (void *restrict ptr) __attribute__((nonnull));
 
 
 
+/** Maximal number of songs passed to music_songs() at once. */
+#define MAX_BATCH 64
+
+
+
+/**
+ * State of a single generator thread.
+ */
+struct generator {
+	pthread_t thread;                /**< Thread's ID. */
+	const struct music_module *m;    /**< in_dummy module. */
+	uint64_t random;                 /**< Pseudo random generator state. */
+	char started;                    /**< Whether thread was started. */
+};
+
+
 /**
  * Module's configuration.
  */
 struct module_config {
-	pthread_t thread;
+	struct generator *generators;  /**< Array of generators. */
+	double *artistCDF;    /**< Zipf's cumulative distribution of artists. */
+	double *albumCDF;     /**< Zipf's cumulative distribution of albums. */
+	double interval;      /**< Seconds between songs (module wide) or
+	                           zero to generate songs as fast as
+	                           possible. */
+	double zipf;          /**< Zipf's distribution exponent. */
+	unsigned long threads;  /**< Number of generator threads. */
+	unsigned long artists;  /**< Number of distinct artists. */
+	unsigned long albums;   /**< Number of albums per artist. */
+	unsigned long tracks;   /**< Number of tracks per album. */
+	unsigned long seed;     /**< Vocabulary seed. */
+	pthread_mutex_t gate;   /**< Held by module_start() till all
+	                             generators are created. */
+	int failed;             /**< Whether creating a generator failed;
+	                             generators exit at once if so. */
 };
 
 
@@ -70,22 +123,182 @@ struct music_module *init(const char *restrict name,
 	(void)name; /* supress warning */
 	(void)arg;  /* supress warning */
 
-	m->start    = module_start;
-	m->stop     = module_stop;
-	cfg         = m->data;
-	cfg->thread = 0;
+	m->start        = module_start;
+	m->stop         = module_stop;
+	m->free         = module_free;
+	m->config       = module_conf;
+	cfg             = m->data;
+	cfg->generators = 0;
+	cfg->artistCDF  = 0;
+	cfg->albumCDF   = 0;
+	cfg->interval   = 10;
+	cfg->zipf       = 1;
+	cfg->threads    = 1;
+	cfg->artists    = 1000;
+	cfg->albums     = 10;
+	cfg->tracks     = 12;
+	cfg->seed       = 0;
+	pthread_mutex_init(&cfg->gate, 0);
 
 	return m;
 }
 
 
 
+static void  module_free (struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	free(cfg->generators);
+	free(cfg->artistCDF);
+	free(cfg->albumCDF);
+	pthread_mutex_destroy(&cfg->gate);
+}
+
+
+
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt,
+                          const char *restrict arg) {
+	static const struct music_option options[] = {
+		{ "rate",    2, 1 },
+		{ "threads", 2, 2 },
+		{ "artists", 2, 3 },
+		{ "albums",  2, 4 },
+		{ "tracks",  2, 5 },
+		{ "zipf",    1, 6 },
+		{ "seed",    2, 7 },
+		{ 0, 0, 0 }
+	};
+	struct module_config *const cfg = m->data;
+	unsigned long *num = 0, max = 1ul << 24;
+	long val;
+
+	if (!opt) return 1;
+
+	switch (music_config(m, options, opt, arg, 1)) {
+	case 1:
+		val = atol(arg);
+		if (val < 0) {
+			music_log(m, LOG_FATAL, "rate: %s: must not be negative", arg);
+			return 0;
+		}
+		cfg->interval = val ? 1.0 / val : 0;
+		return 1;
+	case 2: num = &cfg->threads; max = 256; break;
+	case 3: num = &cfg->artists; break;
+	case 4: num = &cfg->albums ; break;
+	case 5: num = &cfg->tracks ; break;
+	case 6: {
+		char *end;
+		cfg->zipf = strtod(arg, &end);
+		if (*end || cfg->zipf < 0 || cfg->zipf > 10) {
+			music_log(m, LOG_FATAL, "zipf: %s: number from 0 to 10 expected",
+			          arg);
+			return 0;
+		}
+		return 1;
+	}
+	case 7:
+		cfg->seed = strtoul(arg, 0, 0);
+		return 1;
+	default:
+		return 0;
+	}
+
+	val = atol(arg);
+	if (val < 1 || (unsigned long)val > max) {
+		music_log(m, LOG_FATAL, "%s: %s: number from 1 to %lu expected",
+		          opt, arg, max);
+		return 0;
+	}
+	*num = val;
+	return 1;
+}
+
+
+
+/**
+ * Calculates Zipf's cumulative distribution function for n elements.
+ * If n is one returns NULL since there is no need for a table.
+ *
+ * @param n number of elements.
+ * @param s distribution's exponent.
+ * @return an array of n doubles, NULL if n is one or on error.
+ */
+static double *zipf_cdf(unsigned long n, double s) {
+	double *cdf, sum = 0;
+	unsigned long i;
+
+	if (n < 2 || !(cdf = malloc(n * sizeof *cdf))) {
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		cdf[i] = sum += pow(i + 1, -s);
+	}
+	for (i = 0; i < n; ++i) {
+		cdf[i] /= sum;
+	}
+	return cdf;
+}
+
+
+
 static int  module_start(const struct music_module *restrict m) {
 	struct module_config *const cfg = m->data;
-	if (pthread_create(&cfg->thread, 0, module_run, (void*)m)) {
-		music_log_errno(m, LOG_FATAL, "pthread_create");
+	unsigned long i;
+
+	/* Module may be started again */
+	free(cfg->generators);
+	free(cfg->artistCDF);
+	free(cfg->albumCDF);
+
+	cfg->artistCDF  = zipf_cdf(cfg->artists, cfg->zipf);
+	cfg->albumCDF   = zipf_cdf(cfg->albums , cfg->zipf);
+	cfg->generators = malloc(cfg->threads * sizeof *cfg->generators);
+	if (!cfg->generators ||
+	    (cfg->artists > 1 && !cfg->artistCDF) ||
+	    (cfg->albums  > 1 && !cfg->albumCDF)) {
+		music_log(m, LOG_FATAL, "not enough memory");
 		return 0;
 	}
+
+	for (i = 0; i < cfg->threads; ++i) {
+		struct generator *const g = cfg->generators + i;
+		g->m       = m;
+		/* Given seed makes load reproducible */
+		g->random  = cfg->seed
+			? ((uint64_t)cfg->seed << 32) ^ (i + 1)
+			: (uint64_t)time(0) ^ (i + 1);
+		g->started = 0;
+	}
+
+	/* Generators wait for the gate so that they can be told to exit
+	   if some other one could not be created */
+	cfg->failed = 0;
+	pthread_mutex_lock(&cfg->gate);
+	for (i = 0; i < cfg->threads; ++i) {
+		struct generator *const g = cfg->generators + i;
+		if (pthread_create(&g->thread, 0, module_run, g)) {
+			music_log_errno(m, LOG_FATAL, "pthread_create");
+			cfg->failed = 1;
+			break;
+		}
+		g->started = 1;
+	}
+	pthread_mutex_unlock(&cfg->gate);
+
+	if (cfg->failed) {
+		module_stop(m);
+		return 0;
+	}
+
+	if (cfg->interval) {
+		music_log(m, LOG_DEBUG, "generating %g songs/sec in %lu thread(s)",
+		          1 / cfg->interval, cfg->threads);
+	} else {
+		music_log(m, LOG_DEBUG, "generating songs in %lu thread(s)",
+		          cfg->threads);
+	}
 	return 1;
 }
 
@@ -93,25 +306,216 @@ static int  module_start(const struct music_module *restrict m) {
 
 static void module_stop (const struct music_module *restrict m) {
 	struct module_config *const cfg = m->data;
-	pthread_join(cfg->thread, 0);
+	unsigned long i;
+	if (!cfg->generators) {
+		return;
+	}
+	for (i = 0; i < cfg->threads; ++i) {
+		if (cfg->generators[i].started) {
+			pthread_join(cfg->generators[i].thread, 0);
+			cfg->generators[i].started = 0;
+		}
+	}
+}
+
+
+
+/**
+ * Mixes bits of a 64-bit value (splitmix64 finaliser).  Used both to
+ * step pseudo random generators and to derive vocabulary seeds.
+ *
+ * @param x value to mix.
+ * @return mixed value.
+ */
+static uint64_t mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+
+/**
+ * Returns pseudo random number from [0, 1) range and steps generator.
+ *
+ * @param state generator's state.
+ * @return pseudo random number.
+ */
+static double uniform(uint64_t *restrict state) {
+	*state += 0x9E3779B97F4A7C15ull;
+	return (mix(*state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/**
+ * Returns a log-normally distributed pseudo random number.  The
+ * median of the distribution is median.
+ *
+ * @param state generator's state.
+ * @param median distribution's median.
+ * @param sigma standard deviation of the underlying normal distribution.
+ * @return pseudo random number.
+ */
+static double lognormal(uint64_t *restrict state, double median, double sigma) {
+	double u = uniform(state), v = uniform(state);
+	double n = sqrt(-2 * log(1 - u)) * cos(6.283185307179586 * v);
+	return median * exp(sigma * n);
+}
+
+
+/**
+ * Picks an index from Zipf's distribution.
+ *
+ * @param state generator's state.
+ * @param cdf cumulative distribution function or NULL if n is one.
+ * @param n number of elements.
+ * @return index from [0, n) range.
+ */
+static unsigned long zipf_pick(uint64_t *restrict state,
+                               const double *restrict cdf, unsigned long n) {
+	unsigned long lo = 0, hi = n - 1;
+	double u;
+	if (!cdf) return 0;
+	u = uniform(state);
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+
+/**
+ * Generates a string of words which length is drawn from a log-normal
+ * distribution.  String depends only on the seed so the same artist,
+ * album or title is always spelled the same way.  Some of the
+ * characters are two-byte UTF-8 sequences so that escaping is
+ * exercised the same way real metadata exercises it.
+ *
+ * @param buf buffer to save string to.
+ * @param size buffer's size.
+ * @param seed string's seed.
+ * @param median median of string's length.
+ * @return buf.
+ */
+static char *make_string(char *restrict buf, size_t size, uint64_t seed,
+                         double median) {
+	static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+	size_t len = lognormal(&seed, median, 0.45), i, word = 0;
+
+	if (len < 1) len = 1;
+	if (len > size - 2) len = size - 2;
+
+	for (i = 0; i < len; ++i) {
+		const double u = uniform(&seed);
+		if (word > 2 && u < 0.18 && i + 1 < len) {
+			buf[i] = ' ';
+			word = 0;
+		} else if (u > 0.97 && i + 2 < len) {
+			buf[i++] = (char)0xC3;
+			buf[i]   = (char)(0xA0 + (unsigned)(u * 1000) % 0x1E);
+			++word;
+		} else {
+			buf[i] = letters[(unsigned)(uniform(&seed) * uniform(&seed) * 26)];
+			if (!word) buf[i] -= 'a' - 'A';
+			++word;
+		}
+	}
+	buf[i] = 0;
+	return buf;
 }
 
 
 
 static void *module_run  (void *restrict ptr) {
-	static struct music_song song = {
-		"Title",
-		"Artist",
-		"Album",
-		"Genre",
-		0,
-		0,
-		60
+	static const char *const genres[] = {
+		"Rock", "Pop", "Jazz", "Classical", "Electronic", "Hip-Hop",
+		"Metal", "Folk", "Blues", "Country", "Reggae", "Soundtrack",
+		"Alternative", "Ambient", "Punk", "Soul"
 	};
-	while (music_running && music_sleep(ptr, 10000)==1) {
-		song.endTime = time(&song.time) + 30;
-		song.time -= 30;
-		music_song(ptr, &song);
+
+	struct generator *const g = ptr;
+	const struct music_module *const m = g->m;
+	struct module_config *const cfg = m->data;
+	const double period = cfg->interval * cfg->threads;
+	struct music_song songs[MAX_BATCH];
+	struct strings {
+		char title[256], artist[128], album[256];
+	} *const strings = malloc(MAX_BATCH * sizeof *strings);
+	struct timespec start, now;
+	unsigned long sent = 0;
+	size_t i, n;
+
+	/* Wait till module_start() creates all generators */
+	pthread_mutex_lock(&cfg->gate);
+	pthread_mutex_unlock(&cfg->gate);
+	if (cfg->failed) {
+		free(strings);
+		return 0;
 	}
+
+	if (!strings) {
+		music_log(m, LOG_ERROR, "not enough memory");
+		return 0;
+	}
+	for (i = 0; i < MAX_BATCH; ++i) {
+		songs[i].title  = strings[i].title;
+		songs[i].artist = strings[i].artist;
+		songs[i].album  = strings[i].album;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (music_module_running(m)) {
+		n = MAX_BATCH;
+
+		/* Wait till next song is due; if we are late, all songs due
+		   by now are reported at once. */
+		if (period) {
+			unsigned long due;
+			double elapsed;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - start.tv_sec) +
+				(now.tv_nsec - start.tv_nsec) * 1e-9;
+			due = elapsed / period;
+			if (sent >= due) {
+				if (music_sleep(m, ((sent + 1) * period - elapsed) * 1000 + 1)
+				    != 1) {
+					break;
+				}
+				continue;
+			}
+			if (due - sent < n) n = due - sent;
+		}
+
+		/* Pick songs */
+		for (i = 0; i < n; ++i) {
+			struct music_song *const song = songs + i;
+			uint64_t seed;
+			unsigned long a, b, t;
+
+			a = zipf_pick(&g->random, cfg->artistCDF, cfg->artists);
+			b = zipf_pick(&g->random, cfg->albumCDF , cfg->albums );
+			t = uniform(&g->random) * cfg->tracks;
+
+			seed = mix(cfg->seed ^ mix(a));
+			make_string(strings[i].artist, sizeof strings[i].artist, seed, 13);
+			song->genre = genres[seed % (sizeof genres / sizeof *genres)];
+			seed = mix(seed ^ mix(b));
+			make_string(strings[i].album, sizeof strings[i].album, seed, 16);
+			seed = mix(seed ^ mix(t));
+			make_string(strings[i].title, sizeof strings[i].title, seed, 15);
+
+			song->length = lognormal(&seed, 230, 0.3);
+			if (song->length < 30) song->length = 30;
+			song->endTime = time(&song->time) + song->length - 30;
+			song->time -= 30;
+		}
+
+		music_songs(m, songs, n);
+		sent += n;
+	}
+
+	free(strings);
 	return 0;
 }
@@ -0,0 +1,1490 @@
+/**
+ * "Listening to" daemon HTTP relay input module.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Module speaks the server side of the music protocol (see http.txt)
+ * so other daemons' out_http modules may submit songs to this one.
+ * Songs are passed to the core and submitted further by this daemon's
+ * output modules, usually out_http configured with the real server,
+ * which batch songs from all clients so that many daemons share
+ * a single connection to the server.
+ *
+ * All connections are handled by a single thread using epoll.
+ * Requests are parsed incrementally as data arrives and connections
+ * are kept alive between requests.  Songs are acknowledged once they
+ * are on song dispatcher's queue.  When there are more songs on the
+ * queue than "queue" option allows, songs are answered with FAIL so
+ * clients keep them and try again later.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "music.h"
+#include "sha1.h"
+
+
+/**
+ * Starts module.  See music_module::start.
+ *
+ * @param m in_http module to start.
+ * @return whether starting succeed.
+ */
+static int   module_start(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Stops module.  See music_module::stop.
+ *
+ * @param m in_http module to stop.
+ */
+static void  module_stop (const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Frees memory allocated by module.  See music_module::free.
+ *
+ * @param m in_http module to free.
+ */
+static void  module_free (struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Accepts configuration options.  See music_module::conf.
+ *
+ * @param m in_http module.
+ * @param opt option keyword.
+ * @param arg argument.
+ * @return whether option was accepted.
+ */
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt, const char *restrict arg)
+	__attribute__((nonnull(1)));
+
+
+/**
+ * Module's thread function.
+ *
+ * @param ptr a pointer to const struct music_module cast to pointer
+ *            to void.
+ * @return return value shall be ignored.
+ */
+static void *module_run  (void *restrict ptr) __attribute__((nonnull));
+
+
+
+/** Initial size of connection's buffers. */
+#define INIT_BUFFER  4096
+
+/** Maximal length of request's head. */
+#define MAX_HEAD     8192
+
+/** Maximal length of request's body. */
+#define MAX_BODY     (1 << 20)
+
+/** Maximal number of songs passed to music_songs() at once. */
+#define MAX_BATCH    1024
+
+/** Maximal number of events handled in single epoll_wait() call. */
+#define MAX_EVENTS   64
+
+/** How many seconds client's clock may differ from ours. */
+#define AUTH_WINDOW  900
+
+/** Number of miliseconds listening sockets are not watched for after
+    running out of file descriptors. */
+#define ACCEPT_BACKOFF 1000
+
+
+
+/**
+ * A growable buffer.
+ */
+struct buffer {
+	char *data;       /**< Buffer's data. */
+	size_t length;    /**< Length of data in buffer. */
+	size_t capacity;  /**< Size of the buffer. */
+};
+
+
+/**
+ * A growable array of strings.
+ */
+struct strings {
+	char **data;      /**< Array's elements. */
+	size_t count;     /**< Number of elements. */
+	size_t capacity;  /**< Size of the array. */
+};
+
+
+/**
+ * A client connection.
+ */
+struct connection {
+	struct connection *next;   /**< Next connection. */
+	struct connection **prev;  /**< Pointer to previous connection's next
+	                                field. */
+	int fd;                    /**< Connection's socket. */
+	unsigned events;           /**< Events connection is watched for. */
+	time_t lastActive;         /**< When anything was last read from or
+	                                written to the connection. */
+
+	struct buffer in;          /**< Received data; first byte is start
+	                                of current request. */
+	size_t scanned;            /**< How much of received data was
+	                                searched for end of request's head. */
+	size_t headLength;         /**< Length of request's head or zero if
+	                                it was not yet received. */
+	size_t bodyLength;         /**< Length of request's body. */
+	char keepAlive;            /**< Whether to keep connection open after
+	                                replying to current request. */
+	char expect;               /**< Whether client waits for "100
+	                                Continue" before sending body. */
+	char closing;              /**< Whether to close connection once
+	                                pending data is sent. */
+
+	struct buffer out;         /**< Data to send. */
+	size_t sent;               /**< How much of it was already sent. */
+};
+
+
+/**
+ * Module's configuration.
+ */
+struct module_config {
+	pthread_t thread;        /**< Thread's ID module is running. */
+	char *address;           /**< Address to listen on. */
+	long port;               /**< TCP port to listen on or zero. */
+	char *path;              /**< Unix socket's path or NULL. */
+	long mode;               /**< Unix socket's permissions. */
+	char *username;          /**< User name clients must authenticate
+	                              with or NULL to accept anyone. */
+	char password[20];       /**< SHA1 of password. */
+	char gotPassword;        /**< Whether password was given in
+	                              configuration file. */
+	unsigned long queue;     /**< Maximal number of songs on song
+	                              dispatcher's queue above which songs
+	                              are answered with FAIL; zero means no
+	                              limit. */
+	unsigned long maxConnections; /**< Maximal number of connections. */
+	unsigned long timeout;   /**< Idle connection's timeout in seconds
+	                              or zero for none. */
+
+	int tcpFd;               /**< Listening TCP socket or -1. */
+	int unixFd;              /**< Listening unix socket or -1. */
+	int epollFd;             /**< epoll descriptor. */
+	time_t now;              /**< Current time; updated in each loop. */
+	struct connection *connections;  /**< List of open connections. */
+	unsigned long connectionCount;   /**< Number of open connections. */
+	unsigned long long acceptAt;  /**< Time listening sockets are to be
+	                                   watched again at as returned by
+	                                   music_time_us() or zero if they
+	                                   are watched. */
+	int acceptLogged;        /**< Whether running out of file
+	                              descriptors was logged since
+	                              a connection was last accepted. */
+
+	struct music_song *songs;  /**< Songs to pass to music_songs(). */
+	struct buffer reply;       /**< Reply's body being built. */
+	struct strings args;       /**< Current request's song arguments. */
+	struct strings dict;       /**< Current request's dictionary. */
+
+	struct music_metric *requests;       /**< Requests handled. */
+	struct music_metric *requestErrors;  /**< Requests answered with an
+	                                          HTTP error. */
+	struct music_metric *songsOk;        /**< Songs accepted. */
+	struct music_metric *songsRejected;  /**< Songs rejected as invalid. */
+	struct music_metric *songsFailed;    /**< Songs refused because queue
+	                                          was full. */
+	struct music_metric *openConnections;  /**< Open connections. */
+};
+
+
+
+struct music_module *init(const char *restrict name,
+                          const char *restrict arg) {
+	struct module_config *cfg;
+	struct music_module *const m = music_init(MUSIC_IN, sizeof *cfg);
+	(void)name; /* supress warning */
+	(void)arg;  /* supress warning */
+
+	m->start         = module_start;
+	m->stop          = module_stop;
+	m->free          = module_free;
+	m->config        = module_conf;
+	cfg              = m->data;
+	memset(cfg, 0, sizeof *cfg);
+	cfg->address     = music_strdup("127.0.0.1");
+	cfg->mode        = 0660;
+	cfg->queue       = 65536;
+	cfg->maxConnections = 1024;
+	cfg->timeout     = 60;
+	cfg->tcpFd       = -1;
+	cfg->unixFd      = -1;
+	cfg->epollFd     = -1;
+
+	return m;
+}
+
+
+
+static void  module_free (struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	free(cfg->address);
+	free(cfg->path);
+	free(cfg->username);
+}
+
+
+
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt,
+                          const char *restrict arg) {
+	static const struct music_option options[] = {
+		{ "address",     1, 1 },
+		{ "port",        2, 2 },
+		{ "socket",      1, 3 },
+		{ "mode",        2, 4 },
+		{ "username",    1, 5 },
+		{ "password",    1, 6 },
+		{ "queue",       2, 7 },
+		{ "connections", 2, 8 },
+		{ "timeout",     2, 9 },
+		{ 0, 0, 0 }
+	};
+	struct module_config *const cfg = m->data;
+	int option;
+
+	/* Check configuration */
+	if (!opt) {
+		if (!cfg->port && !cfg->path) {
+			music_log(m, LOG_FATAL, "neither port nor socket set");
+			return 0;
+		}
+		if (!cfg->username != !cfg->gotPassword) {
+			music_log(m, LOG_FATAL, cfg->username
+			          ? "username set but password not"
+			          : "password set but username not");
+			return 0;
+		}
+		return 1;
+	}
+
+	switch (option = music_config(m, options, opt, arg, 1)) {
+	case 1:
+		cfg->address = music_strdup_realloc(cfg->address, arg);
+		break;
+
+	case 2:
+		cfg->port = atol(arg);
+		if (cfg->port < 1 || cfg->port > 65535) {
+			music_log(m, LOG_FATAL, "%s: %s: invalid port", opt, arg);
+			return 0;
+		}
+		break;
+
+	case 3:
+		cfg->path = music_strdup_realloc(cfg->path, arg);
+		break;
+
+	case 4:
+		cfg->mode = strtol(arg, 0, 0) & 0777;
+		break;
+
+	case 5:
+		cfg->username = music_strdup_realloc(cfg->username, arg);
+		break;
+
+	case 6:
+		sha1((uint8_t*)cfg->password, (const uint8_t*)arg, strlen(arg));
+		cfg->gotPassword = 1;
+		break;
+
+	case 7:
+	case 8:
+	case 9:
+		if (atol(arg) < 0) {
+			music_log(m, LOG_FATAL, "%s: %s: must not be negative", opt, arg);
+			return 0;
+		}
+		*(option == 7 ? &cfg->queue : option == 8 ? &cfg->maxConnections
+		  : &cfg->timeout) = atol(arg);
+		break;
+
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+
+
+/**
+ * Opens listening TCP socket.
+ *
+ * @param m in_http module.
+ * @return socket or -1 on error.
+ */
+static int   listen_tcp(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	struct addrinfo hints, *ai;
+	char port[8];
+	int fd, ret, one = 1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+	sprintf(port, "%ld", cfg->port);
+	if ((ret = getaddrinfo(cfg->address, port, &hints, &ai))) {
+		music_log(m, LOG_FATAL, "%s: %s", cfg->address, gai_strerror(ret));
+		return -1;
+	}
+
+	fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		music_log_errno(m, LOG_FATAL, "socket");
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen)) {
+		music_log_errno(m, LOG_FATAL, "bind: %s:%s", cfg->address, port);
+	} else if (listen(fd, SOMAXCONN)) {
+		music_log_errno(m, LOG_FATAL, "listen");
+	} else {
+		freeaddrinfo(ai);
+		return fd;
+	}
+
+	freeaddrinfo(ai);
+	close(fd);
+	return -1;
+}
+
+
+/**
+ * Opens listening unix socket.
+ *
+ * @param m in_http module.
+ * @return socket or -1 on error.
+ */
+static int   listen_unix(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	struct sockaddr_un addr;
+	size_t len = strlen(cfg->path);
+	int fd;
+
+	if (len >= sizeof addr.sun_path) {
+		music_log(m, LOG_FATAL, "%s: path too long", cfg->path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, cfg->path, len + 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		music_log_errno(m, LOG_FATAL, "socket");
+		return -1;
+	}
+
+	unlink(cfg->path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr)) {
+		music_log_errno(m, LOG_FATAL, "bind: %s", cfg->path);
+		close(fd);
+		return -1;
+	}
+	if (chmod(cfg->path, cfg->mode)) {
+		music_log_errno(m, LOG_WARNING, "chmod: %s", cfg->path);
+	}
+	if (listen(fd, SOMAXCONN)) {
+		music_log_errno(m, LOG_FATAL, "listen");
+		close(fd);
+		unlink(cfg->path);
+		return -1;
+	}
+	return fd;
+}
+
+
+
+static int   module_start(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	struct epoll_event ev;
+
+	if ((cfg->port && (cfg->tcpFd = listen_tcp(m)) < 0) ||
+	    (cfg->path && (cfg->unixFd = listen_unix(m)) < 0)) {
+		goto error;
+	}
+
+	if ((cfg->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		music_log_errno(m, LOG_FATAL, "epoll_create");
+		goto error;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &cfg->tcpFd;
+	if (cfg->tcpFd >= 0 &&
+	    epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->tcpFd, &ev)) {
+		music_log_errno(m, LOG_FATAL, "epoll_ctl");
+		goto error;
+	}
+	ev.data.ptr = &cfg->unixFd;
+	if (cfg->unixFd >= 0 &&
+	    epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->unixFd, &ev)) {
+		music_log_errno(m, LOG_FATAL, "epoll_ctl");
+		goto error;
+	}
+	ev.data.ptr = &cfg->epollFd;
+	if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, sleep_pipe_fd, &ev) ||
+	    (music_stop_fd(m) >= 0 &&
+	     epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, music_stop_fd(m), &ev))) {
+		music_log_errno(m, LOG_FATAL, "epoll_ctl");
+		goto error;
+	}
+
+	cfg->requests        = music_metric(m, "requests", MUSIC_COUNTER);
+	cfg->requestErrors   = music_metric(m, "request_errors", MUSIC_COUNTER);
+	cfg->songsOk         = music_metric(m, "songs_accepted", MUSIC_COUNTER);
+	cfg->songsRejected   = music_metric(m, "songs_rejected", MUSIC_COUNTER);
+	cfg->songsFailed     = music_metric(m, "songs_queue_full", MUSIC_COUNTER);
+	cfg->openConnections = music_metric(m, "connections", MUSIC_GAUGE);
+
+	if (pthread_create(&cfg->thread, 0, module_run, (void*)m)) {
+		music_log_errno(m, LOG_FATAL, "pthread_create");
+		goto error;
+	}
+	return 1;
+
+ error:
+	if (cfg->epollFd >= 0) close(cfg->epollFd);
+	if (cfg->tcpFd >= 0) close(cfg->tcpFd);
+	if (cfg->unixFd >= 0) {
+		close(cfg->unixFd);
+		unlink(cfg->path);
+	}
+	cfg->epollFd = cfg->tcpFd = cfg->unixFd = -1;
+	return 0;
+}
+
+
+
+static void  module_stop (const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	pthread_join(cfg->thread, 0);
+	close(cfg->epollFd);
+	if (cfg->tcpFd >= 0) close(cfg->tcpFd);
+	if (cfg->unixFd >= 0) {
+		close(cfg->unixFd);
+		unlink(cfg->path);
+	}
+	cfg->epollFd = cfg->tcpFd = cfg->unixFd = -1;
+}
+
+
+
+/**
+ * Makes sure there is room for at least n more bytes in buffer.
+ *
+ * @param b buffer.
+ * @param n number of bytes.
+ * @return whether there is enough room.
+ */
+static int   buffer_reserve(struct buffer *restrict b, size_t n) {
+	size_t capacity = b->capacity ? b->capacity : INIT_BUFFER;
+	char *tmp;
+
+	if (b->capacity - b->length >= n) return 1;
+	while (capacity - b->length < n) capacity *= 2;
+	if (!(tmp = realloc(b->data, capacity))) return 0;
+	b->data = tmp;
+	b->capacity = capacity;
+	return 1;
+}
+
+
+/**
+ * Appends data to buffer.
+ *
+ * @param b buffer.
+ * @param data data to append.
+ * @param len data's length.
+ * @return whether there was enough memory.
+ */
+static int   buffer_append(struct buffer *restrict b,
+                           const char *restrict data, size_t len) {
+	if (!buffer_reserve(b, len)) return 0;
+	memcpy(b->data + b->length, data, len);
+	b->length += len;
+	return 1;
+}
+
+
+/**
+ * Appends formatted string to buffer.
+ *
+ * @param b buffer.
+ * @param fmt format (same as in printf()).
+ * @return whether there was enough memory.
+ */
+static int   buffer_printf(struct buffer *restrict b,
+                           const char *restrict fmt, ...)
+	__attribute__((format (printf, 2, 3)));
+static int   buffer_printf(struct buffer *restrict b,
+                           const char *restrict fmt, ...) {
+	va_list ap;
+	int len;
+
+	if (!buffer_reserve(b, 128)) return 0;
+	va_start(ap, fmt);
+	len = vsnprintf(b->data + b->length, b->capacity - b->length, fmt, ap);
+	va_end(ap);
+	if (len < 0) return 0;
+
+	if ((size_t)len >= b->capacity - b->length) {
+		if (!buffer_reserve(b, len + 1)) return 0;
+		va_start(ap, fmt);
+		vsnprintf(b->data + b->length, b->capacity - b->length, fmt, ap);
+		va_end(ap);
+	}
+	b->length += len;
+	return 1;
+}
+
+
+/**
+ * Adds string to an array.
+ *
+ * @param a array.
+ * @param str string to add.
+ * @return whether there was enough memory.
+ */
+static int   strings_push(struct strings *restrict a, char *str) {
+	if (a->count == a->capacity) {
+		size_t capacity = a->capacity ? a->capacity * 2 : 64;
+		char **tmp = realloc(a->data, capacity * sizeof *tmp);
+		if (!tmp) return 0;
+		a->data = tmp;
+		a->capacity = capacity;
+	}
+	a->data[a->count++] = str;
+	return 1;
+}
+
+
+
+/**
+ * Decodes per cent escaped string in place.
+ *
+ * @param str string to decode.
+ * @return str or NULL if string was empty.
+ */
+static char *unescape(char *restrict str) {
+	char *rd = str, *wr = str;
+	if (!*str) return 0;
+
+	for (; *rd; ++wr) {
+		if (*rd == '%' && isxdigit((unsigned char)rd[1]) &&
+		    isxdigit((unsigned char)rd[2])) {
+			char hex[3];
+			hex[0] = rd[1];
+			hex[1] = rd[2];
+			hex[2] = 0;
+			*wr = strtol(hex, 0, 16);
+			rd += 3;
+		} else {
+			*wr = *rd++;
+		}
+	}
+	*wr = 0;
+	return str;
+}
+
+
+/**
+ * Splits string into fields separated with colons.  Separators are
+ * replaced with NUL bytes.
+ *
+ * @param str string to split.
+ * @param fields array to save fields to.
+ * @param n number of fields string must have.
+ * @return whether string had exactly n fields.
+ */
+static int   split(char *restrict str, char **restrict fields, unsigned n) {
+	unsigned i;
+	for (i = 0; i < n - 1; ++i) {
+		char *const sep = strchr(str, ':');
+		if (!sep) return 0;
+		*sep = 0;
+		fields[i] = str;
+		str = sep + 1;
+	}
+	fields[i] = str;
+	return !strchr(str, ':');
+}
+
+
+/**
+ * Parses hexadecimal number.
+ *
+ * @param str string to parse; empty string means zero.
+ * @param ret where to save the number.
+ * @return whether string was a valid number.
+ */
+static int   parse_hex(const char *restrict str, unsigned long *restrict ret) {
+	char *end;
+	if (!*str) {
+		*ret = 0;
+		return 1;
+	}
+	if (!isxdigit((unsigned char)*str)) return 0;
+	*ret = strtoul(str, &end, 16);
+	return !*end;
+}
+
+
+
+/**
+ * Fills song from "song[]" or "now" argument's value.
+ *
+ * @param song song to fill.
+ * @param value argument's value; modified.
+ * @param end where to save song's finish time.
+ * @return error message or NULL if value was valid.
+ */
+static const char *song_plain(struct music_song *restrict song,
+                              char *restrict value,
+                              unsigned long *restrict end) {
+	unsigned long length;
+	char *fields[6];
+
+	if (!split(value, fields, 6) ||
+	    !parse_hex(fields[4], &length) || !parse_hex(fields[5], end)) {
+		return "Invalid song";
+	}
+
+	song->title   = unescape(fields[0]);
+	song->artist  = unescape(fields[1]);
+	song->album   = unescape(fields[2]);
+	song->genre   = unescape(fields[3]);
+	song->length  = length;
+	return 0;
+}
+
+
+/**
+ * Fills song from "c[]" argument's value.
+ *
+ * @param song song to fill.
+ * @param value argument's value; modified.
+ * @param dict request's dictionary.
+ * @param end previous song's finish time; replaced with this song's
+ *            finish time if it was valid even if the rest was not.
+ * @param first whether this is the first "c[]" argument.
+ * @return error message or NULL if value was valid.
+ */
+static const char *song_compact(struct music_song *restrict song,
+                                char *restrict value,
+                                const struct strings *restrict dict,
+                                unsigned long *restrict end, int first) {
+	const char *strs[4];
+	unsigned long length, index, delta;
+	char *fields[6];
+	unsigned i;
+
+	if (!split(value, fields, 6) || !parse_hex(fields[4], &length) ||
+	    !parse_hex(fields[5] + (*fields[5] == '-'), &delta)) {
+		return "Invalid song";
+	}
+	if (first) {
+		*end = delta;
+	} else if (*fields[5] == '-') {
+		*end -= delta;
+	} else {
+		*end += delta;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (!*fields[i]) {
+			strs[i] = 0;
+		} else if (!parse_hex(fields[i], &index)) {
+			return "Invalid song";
+		} else if (index >= dict->count) {
+			return "Bad dictionary index";
+		} else {
+			strs[i] = dict->data[index];
+		}
+	}
+
+	song->title   = strs[0];
+	song->artist  = strs[1];
+	song->album   = strs[2];
+	song->genre   = strs[3];
+	song->length  = length;
+	return 0;
+}
+
+
+
+/**
+ * Checks client's authentication.
+ *
+ * @param cfg module's configuration.
+ * @param auth "auth" argument's value or NULL; modified.
+ * @param clientTime where to save client's time or zero if not known.
+ * @return error reply (without the "MUSIC " prefix) or NULL if client
+ *         may submit songs.
+ */
+static const char *request_auth(const struct module_config *restrict cfg,
+                                char *restrict auth,
+                                unsigned long *restrict clientTime) {
+	static const char invalidUser[] =
+		"201 Invalid User\nInvalid user name or password\n";
+	char *fields[5], *sep, hash[29], pass[28], buf[40];
+	unsigned long t;
+	size_t len;
+	unsigned n;
+
+	*clientTime = 0;
+	if (!auth) {
+		return cfg->username ? invalidUser : 0;
+	}
+
+	/* Split into at most five fields */
+	for (n = 0, fields[n++] = auth; n < 5 && (sep = strchr(auth, ':')); ) {
+		*sep = 0;
+		fields[n++] = auth = sep + 1;
+	}
+
+	if (!strcmp(fields[0], "session") || !strcmp(fields[0], "close")) {
+		return cfg->username
+			? "301 Bad Session\nSessions are not supported\n" : 0;
+	}
+	if ((strcmp(fields[0], "pass") && strcmp(fields[0], "open")) || n < 4 ||
+	    !*fields[2] || strlen(fields[2]) > 16 || !parse_hex(fields[2], &t)) {
+		return cfg->username ? invalidUser : 0;
+	}
+	*clientTime = t;
+	if (!cfg->username) {
+		return 0;
+	}
+
+	if (!unescape(fields[1]) || strcmp(fields[1], cfg->username)) {
+		return invalidUser;
+	}
+	if ((unsigned long)cfg->now - t + AUTH_WINDOW > 2 * AUTH_WINDOW) {
+		return "203 Invalid Time\nClock differs too much from server's\n";
+	}
+
+	/* Client may strip equal signs and replace plus with underscore
+	   or minus. */
+	unescape(fields[3]);
+	for (len = 0; fields[3][len] && fields[3][len] != '=' && len < 28; ++len) {
+		const char ch = fields[3][len];
+		pass[len] = ch == '_' || ch == '-' || ch == ' ' ? '+' : ch;
+	}
+	if (len != 27) {
+		return invalidUser;
+	}
+
+	memcpy(buf, cfg->password, 20);
+	len = strlen(fields[2]);
+	memcpy(buf + 20, fields[2], len);
+	sha1_b64(hash, (unsigned char *)buf, 20 + len);
+	return memcmp(hash, pass, 27) ? invalidUser : 0;
+}
+
+
+/**
+ * Checks whether core would accept the song.  Core silently ignores
+ * songs without a title and songs shorter than 30 seconds (see
+ * music_song()) so such songs are rejected rather than acknowledged.
+ *
+ * @param song song to check.
+ * @return error message or NULL if song is fine.
+ */
+static const char *song_check(const struct music_song *restrict song) {
+	if (!song->title) return "No title";
+	if (song->length < 30) return "Song too short";
+	return 0;
+}
+
+
+
+/**
+ * Handles request's body and builds reply in cfg->reply.  Strings
+ * of submitted songs point into the body so all songs are passed to
+ * music_songs() before this function returns.
+ *
+ * @param m in_http module.
+ * @param body request's body (NUL terminated).
+ * @param len body's length.
+ * @return HTTP error status or NULL on success.
+ */
+static const char *request_body(const struct music_module *restrict m,
+                                char *restrict body, size_t len) {
+	static const char noMemory[] = "500 Internal Server Error";
+	struct module_config *const cfg = m->data;
+	struct buffer *const reply = &cfg->reply;
+	char *ch = body, *const end = body + len, *auth = 0, *now = 0, *dict = 0;
+	unsigned long clientTime, prevEnd = 0, room = 0;
+	const char *error;
+	int plain = 0, compact = 0;
+	size_t count = 0, i;
+	long offset;
+
+	cfg->args.count = 0;
+	cfg->dict.count = 0;
+	reply->length = 0;
+
+	/* Split arguments */
+	while (ch < end) {
+		char *const amp = strchr(ch, '&'), *value;
+		if (amp) *amp = 0;
+		if ((value = strchr(ch, '='))) {
+			*value++ = 0;
+			unescape(ch);
+			if (!strcmp(ch, "song[]")) {
+				plain = 1;
+				if (!strings_push(&cfg->args, value)) return noMemory;
+			} else if (!strcmp(ch, "c[]")) {
+				compact = 1;
+				if (!strings_push(&cfg->args, value)) return noMemory;
+			} else if (!strcmp(ch, "d")) {
+				dict = value;
+			} else if (!strcmp(ch, "now")) {
+				now = value;
+			} else if (!strcmp(ch, "auth")) {
+				auth = value;
+			}
+		}
+		if (!amp) break;
+		ch = amp + 1;
+	}
+	if (plain && compact) {
+		return "400 Bad Request";
+	}
+
+	/* Authenticate */
+	if ((error = request_auth(cfg, auth, &clientTime))) {
+		return buffer_printf(reply, "MUSIC %s", error) ? 0 : noMemory;
+	}
+	offset = clientTime ? (long)(cfg->now - (time_t)clientTime) : 0;
+
+	/* Split dictionary */
+	if (dict && *dict) {
+		for (;;) {
+			char *const sep = strchr(dict, ':');
+			if (sep) *sep = 0;
+			if (!strings_push(&cfg->dict, unescape(dict))) {
+				return noMemory;
+			}
+			if (!sep) break;
+			dict = sep + 1;
+		}
+	}
+
+	/* How many songs may be put on the queue */
+	if (cfg->queue) {
+		const size_t queued = music_queue_length(m);
+		room = queued < cfg->queue ? cfg->queue - queued : 0;
+	}
+
+	if (!buffer_printf(reply, "MUSIC 100 OK\n")) return noMemory;
+	for (i = 0; i < cfg->args.count; ++i) {
+		struct music_song *const song = cfg->songs + count;
+		unsigned long songEnd;
+		int ok;
+
+		if (compact) {
+			error = song_compact(song, cfg->args.data[i], &cfg->dict,
+			                     &prevEnd, !i);
+			songEnd = prevEnd;
+		} else {
+			error = song_plain(song, cfg->args.data[i], &songEnd);
+		}
+		if (!error) error = song_check(song);
+
+		if (error) {
+			music_metric_add(cfg->songsRejected, 1);
+			ok = buffer_printf(reply, "SONG %lu REJ %s\n",
+			                   (unsigned long)i, error);
+		} else if (cfg->queue && !room) {
+			music_metric_add(cfg->songsFailed, 1);
+			ok = buffer_printf(reply, "SONG %lu FAIL Queue full\n",
+			                   (unsigned long)i);
+		} else {
+			song->time    = cfg->now;
+			song->endTime = songEnd ? (time_t)songEnd + offset
+			                        : song->time + (time_t)song->length;
+			if (++count == MAX_BATCH) {
+				music_songs(m, cfg->songs, count);
+				count = 0;
+			}
+			--room;
+			music_metric_add(cfg->songsOk, 1);
+			ok = buffer_printf(reply, "SONG %lu OK\n", (unsigned long)i);
+		}
+
+		if (!ok) {
+			/* Songs already on the queue will be submitted again by
+			   client; dispatcher's dedup window may drop them. */
+			if (count) music_songs(m, cfg->songs, count);
+			return noMemory;
+		}
+	}
+	if (count) {
+		music_songs(m, cfg->songs, count);
+	}
+
+	/* Now playing; only the latest update is kept so with many
+	   clients it is the song which was reported last. */
+	if (now) {
+		struct music_song song;
+		unsigned long songEnd;
+		if (!(error = song_plain(&song, now, &songEnd)) && !song.title) {
+			error = "No title";
+		}
+		if (!error) {
+			song.time    = cfg->now;
+			song.endTime = songEnd ? (time_t)songEnd + offset
+			                       : song.time + (time_t)song.length;
+			music_now_playing(m, &song);
+		}
+		if (!(error ? buffer_printf(reply, "SONG -1 REJ %s\n", error)
+		            : buffer_printf(reply, "SONG -1 OK\n"))) {
+			return noMemory;
+		}
+	}
+
+	return buffer_printf(reply, "END\n") ? 0 : noMemory;
+}
+
+
+
+/**
+ * Parses request's head.
+ *
+ * @param c connection; its headLength must be set.
+ * @return HTTP error status or NULL on success.
+ */
+static const char *request_head(struct connection *restrict c) {
+	char *line = c->in.data, *next, *value;
+	int gotLength = 0;
+	size_t len;
+
+	/* Replace "\r" of the empty line so head is NUL terminated */
+	c->in.data[c->headLength - 2] = 0;
+	c->bodyLength = 0;
+	c->expect     = 0;
+
+	/* Request line */
+	if (!(next = strstr(line, "\r\n"))) {
+		return "400 Bad Request";
+	}
+	*next = 0;
+	next += 2;
+	len = strlen(line);
+	if (len < 14 || strncmp(line + len - 8, "HTTP/1.", 7) ||
+	    !isdigit((unsigned char)line[len - 1])) {
+		return "400 Bad Request";
+	}
+	c->keepAlive = line[len - 1] != '0';
+	if (strncmp(line, "POST ", 5)) {
+		return "405 Method Not Allowed";
+	}
+
+	/* Headers */
+	for (line = next; *line; line = next) {
+		if ((next = strstr(line, "\r\n"))) {
+			*next = 0;
+			next += 2;
+		} else {
+			next = line + strlen(line);
+		}
+
+		if (!(value = strchr(line, ':'))) {
+			return "400 Bad Request";
+		}
+		*value++ = 0;
+		value += strspn(value, " \t");
+
+		if (!strcasecmp(line, "Content-Length")) {
+			char *end;
+			if (!isdigit((unsigned char)*value)) return "400 Bad Request";
+			c->bodyLength = strtoul(value, &end, 10);
+			if (*end && *end != ' ' && *end != '\t') return "400 Bad Request";
+			gotLength = 1;
+		} else if (!strcasecmp(line, "Transfer-Encoding")) {
+			return "501 Not Implemented";
+		} else if (!strcasecmp(line, "Expect")) {
+			if (strcasecmp(value, "100-continue")) {
+				return "417 Expectation Failed";
+			}
+			c->expect = 1;
+		} else if (!strcasecmp(line, "Connection")) {
+			/* Comma separated list of tokens */
+			while (*value) {
+				len = strcspn(value, ", \t");
+				if (len == 5 && !strncasecmp(value, "close", 5)) {
+					c->keepAlive = 0;
+				} else if (len == 10 && !strncasecmp(value, "keep-alive", 10)) {
+					c->keepAlive = 1;
+				}
+				value += len;
+				value += strspn(value, ", \t");
+			}
+		}
+	}
+
+	if (!gotLength) {
+		return "411 Length Required";
+	}
+	if (c->bodyLength > MAX_BODY) {
+		return "413 Payload Too Large";
+	}
+	return 0;
+}
+
+
+/**
+ * Queues HTTP error reply and marks connection to be closed.
+ *
+ * @param m in_http module.
+ * @param c connection.
+ * @param status HTTP status.
+ * @return 1 or -1 if there was not enough memory.
+ */
+static int   request_error(const struct music_module *restrict m,
+                           struct connection *restrict c,
+                           const char *restrict status) {
+	struct module_config *const cfg = m->data;
+	music_metric_add(cfg->requestErrors, 1);
+	music_log(m, LOG_DEBUG, "replying with %s", status);
+	c->closing = 1;
+	return buffer_printf(&c->out, "HTTP/1.1 %s\r\n"
+	                     "Content-Type: text/plain\r\n"
+	                     "Content-Length: %lu\r\n"
+	                     "Connection: close\r\n\r\n%s\n",
+	                     status, (unsigned long)strlen(status) + 1, status)
+		? 1 : -1;
+}
+
+
+/**
+ * Parses request from connection's buffer and if it is complete
+ * handles it queuing a reply.
+ *
+ * @param m in_http module.
+ * @param c connection.
+ * @return 1 if reply was queued, 0 if more data is needed or -1 if
+ *         connection should be closed.
+ */
+static int   request_parse(const struct music_module *restrict m,
+                           struct connection *restrict c) {
+	struct module_config *const cfg = m->data;
+	const char *status;
+	size_t total;
+	char next;
+
+	/* Look for end of head; only newly received data is searched */
+	if (!c->headLength) {
+		size_t i = c->scanned > 3 ? c->scanned - 3 : 0;
+		char *nl;
+
+		while ((nl = memchr(c->in.data + i, '\n', c->in.length - i))) {
+			i = nl - c->in.data + 1;
+			if (i >= 4 && !memcmp(nl - 3, "\r\n\r\n", 4)) {
+				c->headLength = i;
+				break;
+			}
+		}
+
+		if (!c->headLength) {
+			c->scanned = c->in.length;
+			return c->in.length < MAX_HEAD ? 0
+				: request_error(m, c, "431 Request Header Fields Too Large");
+		}
+		if ((status = request_head(c))) {
+			return request_error(m, c, status);
+		}
+		if (c->expect && c->in.length < c->headLength + c->bodyLength) {
+			c->expect = 0;
+			return buffer_append(&c->out, "HTTP/1.1 100 Continue\r\n\r\n", 25)
+				? 1 : -1;
+		}
+	}
+
+	total = c->headLength + c->bodyLength;
+	if (c->in.length < total) {
+		return 0;
+	}
+
+	/* Handle request; body is NUL terminated for the time being so
+	   first byte of next pipelined request has to be restored. */
+	music_metric_add(cfg->requests, 1);
+	next = c->in.data[total];
+	c->in.data[total] = 0;
+	status = request_body(m, c->in.data + c->headLength, c->bodyLength);
+	c->in.data[total] = next;
+	if (status) {
+		return request_error(m, c, status);
+	}
+	if (!buffer_printf(&c->out, "HTTP/1.1 200 OK\r\n"
+	                   "Content-Type: text/x-music\r\n"
+	                   "X-Music-Batch: dict\r\n"
+	                   "Content-Length: %lu\r\n%s\r\n",
+	                   (unsigned long)cfg->reply.length,
+	                   c->keepAlive ? "" : "Connection: close\r\n") ||
+	    !buffer_append(&c->out, cfg->reply.data, cfg->reply.length)) {
+		return -1;
+	}
+	c->closing = !c->keepAlive;
+
+	/* Keep pipelined data */
+	memmove(c->in.data, c->in.data + total, c->in.length - total);
+	c->in.length -= total;
+	c->headLength = 0;
+	c->scanned    = 0;
+	return 1;
+}
+
+
+
+/**
+ * Changes events connection is watched for.
+ *
+ * @param m in_http module.
+ * @param c connection.
+ * @param events events to watch for.
+ * @return whether connection should be kept open.
+ */
+static int   connection_watch(const struct music_module *restrict m,
+                              struct connection *restrict c,
+                              unsigned events) {
+	struct module_config *const cfg = m->data;
+	struct epoll_event ev;
+
+	if (c->events == events) return 1;
+	ev.events   = events;
+	ev.data.ptr = c;
+	if (epoll_ctl(cfg->epollFd, EPOLL_CTL_MOD, c->fd, &ev)) {
+		music_log_errno(m, LOG_ERROR, "epoll_ctl");
+		return 0;
+	}
+	c->events = events;
+	return 1;
+}
+
+
+/**
+ * Reads requests from connection and sends replies.  Returns when
+ * client has to send or receive more data.  Next request is not
+ * parsed until reply to the previous one is sent.
+ *
+ * @param m in_http module.
+ * @param c connection.
+ * @return whether connection should be kept open.
+ */
+static int   connection_run(const struct music_module *restrict m,
+                            struct connection *restrict c) {
+	struct module_config *const cfg = m->data;
+
+	for (;;) {
+		ssize_t r;
+		int ret;
+
+		/* Send pending data */
+		if (c->sent < c->out.length) {
+			r = send(c->fd, c->out.data + c->sent, c->out.length - c->sent,
+			         MSG_NOSIGNAL);
+			if (r > 0) {
+				c->sent += r;
+				c->lastActive = cfg->now;
+				continue;
+			} else if (r < 0 && errno == EAGAIN) {
+				return connection_watch(m, c, EPOLLOUT);
+			} else if (r < 0 && errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		c->out.length = c->sent = 0;
+		if (c->closing) {
+			return 0;
+		}
+
+		/* Handle received request */
+		if ((ret = request_parse(m, c))) {
+			if (ret < 0) return 0;
+			continue;
+		}
+
+		/* Read more data; one byte is kept for NUL terminator */
+		if (c->in.length + 1 >= c->in.capacity) {
+			const size_t need = c->headLength
+				? c->headLength + c->bodyLength + 1 : c->in.capacity * 2;
+			if (!buffer_reserve(&c->in, need - c->in.length)) {
+				music_log(m, LOG_ERROR, "not enough memory");
+				return 0;
+			}
+		}
+
+		r = read(c->fd, c->in.data + c->in.length,
+		         c->in.capacity - c->in.length - 1);
+		if (r > 0) {
+			c->in.length += r;
+			c->lastActive = cfg->now;
+		} else if (r < 0 && errno == EAGAIN) {
+			return connection_watch(m, c, EPOLLIN);
+		} else if (r >= 0 || errno != EINTR) {
+			return 0;
+		}
+	}
+}
+
+
+/**
+ * Closes connection and frees it.
+ *
+ * @param m in_http module.
+ * @param c connection.
+ */
+static void  connection_close(const struct music_module *restrict m,
+                              struct connection *restrict c) {
+	struct module_config *const cfg = m->data;
+	if (cfg->epollFd >= 0) {
+		epoll_ctl(cfg->epollFd, EPOLL_CTL_DEL, c->fd, 0);
+	}
+	close(c->fd);
+	if ((*c->prev = c->next)) c->next->prev = c->prev;
+	free(c->in.data);
+	free(c->out.data);
+	free(c);
+	--cfg->connectionCount;
+	music_metric_add(cfg->openConnections, -1);
+}
+
+
+/**
+ * Accepts all pending connections.
+ *
+ * @param m in_http module.
+ * @param listenFd listening socket.
+ */
+static void  accept_connections(const struct music_module *restrict m,
+                                int listenFd) {
+	struct module_config *const cfg = m->data;
+	struct epoll_event ev;
+	struct connection *c;
+	int fd, one = 1;
+
+	while ((fd = accept(listenFd, 0, 0)) >= 0) {
+		cfg->acceptLogged = 0;
+		if (cfg->maxConnections &&
+		    cfg->connectionCount >= cfg->maxConnections) {
+			music_log(m, LOG_WARNING, "too many connections");
+			close(fd);
+			continue;
+		}
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (listenFd == cfg->tcpFd) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		}
+
+		if (!(c = calloc(1, sizeof *c)) ||
+		    !buffer_reserve(&c->in, INIT_BUFFER)) {
+			music_log(m, LOG_ERROR, "not enough memory");
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		c->fd         = fd;
+		c->events     = EPOLLIN;
+		c->lastActive = cfg->now;
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, fd, &ev)) {
+			music_log_errno(m, LOG_ERROR, "epoll_ctl");
+			free(c->in.data);
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		if ((c->next = cfg->connections)) c->next->prev = &c->next;
+		c->prev = &cfg->connections;
+		cfg->connections = c;
+		++cfg->connectionCount;
+		music_metric_add(cfg->openConnections, 1);
+	}
+
+	/* Pending connection keeps listening socket readable; stop
+	   watching listening sockets for a while rather than spin */
+	if (errno == EMFILE || errno == ENFILE) {
+		if (!cfg->acceptLogged) {
+			music_log_errno(m, LOG_WARNING, "accept");
+			cfg->acceptLogged = 1;
+		}
+		if (cfg->tcpFd >= 0) {
+			epoll_ctl(cfg->epollFd, EPOLL_CTL_DEL, cfg->tcpFd, 0);
+		}
+		if (cfg->unixFd >= 0) {
+			epoll_ctl(cfg->epollFd, EPOLL_CTL_DEL, cfg->unixFd, 0);
+		}
+		cfg->acceptAt = music_time_us() + ACCEPT_BACKOFF * 1000ull;
+	}
+}
+
+
+/**
+ * Watches listening sockets again once backoff after running out of
+ * file descriptors passes.
+ *
+ * @param m in_http module.
+ * @return number of miliseconds till listening sockets are to be
+ *         watched again or -1 if they are watched.
+ */
+static int   accept_resume(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	const unsigned long long now = music_time_us();
+	struct epoll_event ev;
+
+	if (!cfg->acceptAt) {
+		return -1;
+	} else if (now < cfg->acceptAt) {
+		return (cfg->acceptAt - now + 999) / 1000;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &cfg->tcpFd;
+	if (cfg->tcpFd >= 0 &&
+	    epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->tcpFd, &ev) &&
+	    errno != EEXIST) {
+		goto error;
+	}
+	ev.data.ptr = &cfg->unixFd;
+	if (cfg->unixFd >= 0 &&
+	    epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->unixFd, &ev) &&
+	    errno != EEXIST) {
+		goto error;
+	}
+	cfg->acceptAt = 0;
+	return -1;
+
+ error:
+	music_log_errno(m, LOG_ERROR, "epoll_ctl");
+	cfg->acceptAt = now + ACCEPT_BACKOFF * 1000ull;
+	return ACCEPT_BACKOFF;
+}
+
+
+
+static void *module_run  (void *restrict ptr) {
+	const struct music_module *const m = ptr;
+	struct module_config *const cfg = m->data;
+	struct epoll_event events[MAX_EVENTS];
+	time_t lastSweep = 0;
+
+	if (!(cfg->songs = malloc(MAX_BATCH * sizeof *cfg->songs))) {
+		music_log(m, LOG_ERROR, "not enough memory");
+		return 0;
+	}
+
+	while (music_module_running(m)) {
+		int n, i, wait = accept_resume(m);
+
+		if (cfg->timeout && (wait < 0 || wait > 1000)) {
+			wait = 1000;
+		}
+		n = epoll_wait(cfg->epollFd, events, MAX_EVENTS, wait);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			music_log_errno(m, LOG_ERROR, "epoll_wait");
+			break;
+		}
+		cfg->now = time(0);
+
+		for (i = 0; i < n; ++i) {
+			struct connection *const c = events[i].data.ptr;
+
+			if (c == (void*)&cfg->epollFd) {
+				/* Core is terminating or stopping module */
+				goto finish;
+			} else if (c == (void*)&cfg->tcpFd) {
+				accept_connections(m, cfg->tcpFd);
+			} else if (c == (void*)&cfg->unixFd) {
+				accept_connections(m, cfg->unixFd);
+			} else if (!connection_run(m, c)) {
+				connection_close(m, c);
+			}
+		}
+
+		/* Close idle connections */
+		if (cfg->timeout && cfg->now != lastSweep) {
+			struct connection *c, *next;
+			lastSweep = cfg->now;
+			for (c = cfg->connections; c; c = next) {
+				next = c->next;
+				if (cfg->now - c->lastActive > (time_t)cfg->timeout) {
+					connection_close(m, c);
+				}
+			}
+		}
+	}
+
+ finish:
+	while (cfg->connections) {
+		connection_close(m, cfg->connections);
+	}
+	free(cfg->songs);
+	free(cfg->reply.data);
+	free(cfg->args.data);
+	free(cfg->dict.data);
+	memset(&cfg->reply, 0, sizeof cfg->reply);
+	memset(&cfg->args, 0, sizeof cfg->args);
+	memset(&cfg->dict, 0, sizeof cfg->dict);
+	cfg->songs = 0;
+	return 0;
+}
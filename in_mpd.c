@@ -16,6 +16,7 @@
  * along with this program; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -84,9 +85,15 @@ static void *module_run  (void *restrict ptr) __attribute__((nonnull));
  */
 struct module_config {
 	pthread_t thread;      /**< Thread's ID module is running. */
-	char *host;            /**< Host to connect to. */
+	char *host;            /**< Host to connect to or, if it starts
+	                            with a slash, MPD's unix socket. */
 	char *password;        /**< Password to use when connecting. */
 	long port;             /**< Port to connect to. */
+	long bufferMax;        /**< Maximal size of connection's buffer. */
+
+	struct music_metric *connects;       /**< Successful connections. */
+	struct music_metric *connectErrors;  /**< Failed connections. */
+	struct music_metric *songs;          /**< Songs reported. */
 };
 
 
@@ -98,15 +105,16 @@ struct music_module *init(const char *restrict name,
 	(void)name; /* supress warning */
 	(void)arg;  /* supress warning */
 
-	m->start      = module_start;
-	m->stop       = module_stop;
-	m->free       = module_free;
-	m->config     = module_conf;
-	cfg           = m->data;
-	cfg->thread   = 0;
-	cfg->host     = music_strdup("localhost");
-	cfg->password = 0;
-	cfg->port     = 6600;
+	m->start       = module_start;
+	m->stop        = module_stop;
+	m->free        = module_free;
+	m->config      = module_conf;
+	cfg            = m->data;
+	cfg->thread    = 0;
+	cfg->host      = music_strdup("localhost");
+	cfg->password  = 0;
+	cfg->port      = 6600;
+	cfg->bufferMax = MPD_BUFFER_MAX_LENGTH;
 
 	return m;
 }
@@ -115,6 +123,9 @@ struct music_module *init(const char *restrict name,
 
 static int   module_start(const struct music_module *restrict m) {
 	struct module_config *const cfg = m->data;
+	cfg->connects      = music_metric(m, "connects", MUSIC_COUNTER);
+	cfg->connectErrors = music_metric(m, "connect_errors", MUSIC_COUNTER);
+	cfg->songs         = music_metric(m, "songs", MUSIC_COUNTER);
 	if (pthread_create(&cfg->thread, 0, module_run, (void*)m)) {
 		music_log_errno(m, LOG_FATAL, "pthread_create");
 		return 0;
@@ -149,6 +160,7 @@ static int   module_conf (const struct music_module *restrict m,
 		{ "host",     1, 1 },
 		{ "port",     2, 2 },
 		{ "password", 1, 3 },
+		{ "buffer",   2, 4 },
 		{ 0, 0, 0 }
 	};
 	struct module_config *const cfg = m->data;
@@ -164,6 +176,15 @@ static int   module_conf (const struct music_module *restrict m,
 	case 3:
 		cfg->password = music_strdup_realloc(cfg->password, arg);
 		break;
+	case 4:
+		cfg->bufferMax = atol(arg);
+		if (cfg->bufferMax < MPD_BUFFER_INIT_LENGTH ||
+		    cfg->bufferMax > INT_MAX) {
+			music_log(m, LOG_FATAL, "buffer: %s: number from %d to %d "
+			          "expected", arg, MPD_BUFFER_INIT_LENGTH, INT_MAX);
+			return 0;
+		}
+		break;
 	default:
 		return 0;
 	}
@@ -176,8 +197,8 @@ static int   module_conf (const struct music_module *restrict m,
 
 /**
  * Connects to MPD.  This function runs in a loop which finishes
- * either when it menages to connect to MPD or when music_running is
- * set to zero (which means that application is terminating).
+ * either when it menages to connect to MPD or when module is being
+ * stopped (see music_module_running()).
  *
  * @param m in_mpd module.
  * @return connection to MPD or NULL on error.
@@ -189,8 +210,8 @@ static mpd_Connection *module_do_connect(const struct music_module *restrict m)
 /**
  * Retrives song MPD is playing and submitts it if needed.  This
  * function runs in a loop which finishes either when there is
- * a connection error or when music_running is set to zero (which
- * means taht application is terminating).
+ * a connection error or when module is being stopped (see
+ * music_module_running()).
  *
  * @param m in_mpd module.
  * @param conn connection to MPD.
@@ -202,17 +223,19 @@ static void module_do_songs(const struct music_module *restrict m,
 
 /**
  * Retrives song MPD is playing and submits it to core using
- * music_song() function.
+ * music_song() or music_now_playing() function.
  *
  * @param m in_mpd module.
  * @param conn connection to MPD.
  * @param start when the song has started playing.
  * @param songid song's ID to retrive.
+ * @param now whether song has just started playing rather then has
+ *            been played long enough to be submitted.
  * @return zero on error, non-zero on success.
  */
 static int  module_do_submit_song(const struct music_module *restrict m,
                                   mpd_Connection *restrict conn,
-                                  time_t start, int songid)
+                                  time_t start, int songid, int now)
 	__attribute__((nonnull));
 
 
@@ -222,6 +245,7 @@ static void *module_run  (void *restrict ptr) {
 
 	do {
 		mpd_Connection *conn = module_do_connect(m);
+		if (!conn) break;
 		module_do_songs(m, conn);
 
 		if (conn->error) {
@@ -229,7 +253,7 @@ static void *module_run  (void *restrict ptr) {
 		}
 		mpd_closeConnection(conn);
 
-	} while (music_running);
+	} while (music_module_running(m));
 
 	return 0;
 }
@@ -242,22 +266,28 @@ static mpd_Connection *module_do_connect(const struct music_module *restrict m)
 
 	do {
 		mpd_Connection *conn = mpd_newConnection(cfg->host, cfg->port, 10);
-
-		if (!conn->error && cfg->password && *cfg->password) {
-			mpd_sendPasswordCommand(conn, cfg->password);
-			if (!conn->error) mpd_finishCommand(conn);
-		}
-
-		if (!conn->error) {
-			return conn;
+		if (conn) {
+			mpd_setConnectionBufferMax(conn, cfg->bufferMax);
+
+			if (!conn->error && cfg->password && *cfg->password) {
+				mpd_sendPasswordCommand(conn, cfg->password);
+				if (!conn->error) mpd_finishCommand(conn);
+			}
+
+			if (!conn->error) {
+				music_metric_add(cfg->connects, 1);
+				return conn;
+			}
 		}
 
+		music_metric_add(cfg->connectErrors, 1);
 		music_log(m, LOG_WARNING, "unable to connect to MPD: %s"
-		          "; waiting %ds to reconnect", conn->errorStr, delay);
-		mpd_closeConnection(conn);
+		          "; waiting %ds to reconnect",
+		          conn ? conn->errorStr : "not enough memory", delay);
+		if (conn) mpd_closeConnection(conn);
 		music_sleep(m, delay * 1000);
 		if (delay<300000) delay <<= 1;
-	} while (music_running);
+	} while (music_module_running(m));
 	return 0;
 }
 
@@ -265,7 +295,7 @@ static mpd_Connection *module_do_connect(const struct music_module *restrict m)
 
 static void module_do_songs(const struct music_module *restrict m,
                             mpd_Connection *conn) {
-	int id = -1, count = 0;
+	int id = -1, count = 0, playing = 0;
 	time_t start;
 
 	while (music_sleep(m, 1000)==1) {
@@ -280,14 +310,24 @@ static void module_do_songs(const struct music_module *restrict m,
 		mpd_freeStatus(status);
 		mpd_nextListOkCommand(conn);  if (conn->error) return;
 
-		if (state!=MPD_STATUS_STATE_PLAY) continue;
+		if (state!=MPD_STATUS_STATE_PLAY) {
+			if (playing) {
+				playing = 0;
+				music_now_playing(m, 0);
+			}
+			continue;
+		}
 
-		if (i!=id) {
-			id = i;
-			count = 1;
-			start = time(0) - elapsed;
+		if (i!=id || !playing) {
+			if (i!=id) {
+				id = i;
+				count = 1;
+				start = time(0) - elapsed;
+			}
+			playing = 1;
+			if (!module_do_submit_song(m, conn, start, id, 1)) return;
 		} else if (count!=30 && ++count==30) {
-			if (!module_do_submit_song(m, conn, start, id)) return;
+			if (!module_do_submit_song(m, conn, start, id, 0)) return;
 		}
 	}
 }
@@ -296,7 +336,8 @@ static void module_do_songs(const struct music_module *restrict m,
 
 static int  module_do_submit_song(const struct music_module *restrict m,
                                   mpd_Connection *restrict conn,
-                                  time_t start, int songid) {
+                                  time_t start, int songid, int now) {
+	struct module_config *const cfg = m->data;
 	mpd_InfoEntity *info;
 	struct music_song song;
 
@@ -316,7 +357,12 @@ static int  module_do_submit_song(const struct music_module *restrict m,
 	song.time    = start;
 	song.endTime = song.length > 1 ? start + (time_t)song.length : -1;
 
-	music_song(m, &song);
+	if (now) {
+		music_now_playing(m, &song);
+	} else {
+		music_song(m, &song);
+		music_metric_add(cfg->songs, 1);
+	}
 
 	mpd_freeInfoEntity(info);
 	return 1;
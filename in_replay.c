@@ -0,0 +1,273 @@
+/**
+ * "Listening to" daemon trace replaying input module.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "music.h"
+#include "trace.h"
+
+
+/**
+ * Starts module.  See music_module::start.
+ *
+ * @param m in_replay module to start.
+ * @return whether starting succeed.
+ */
+static int   module_start(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Stops module.  See music_module::stop.
+ *
+ * @param m in_replay module to stop.
+ */
+static void  module_stop (const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Frees memory allocated by module.  See music_module::free.
+ *
+ * @param m in_replay module to free.
+ */
+static void  module_free (struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Accepts configuration options.  See music_module::conf.
+ *
+ * @param m in_replay module.
+ * @param opt option keyword.
+ * @param arg argument.
+ * @return whether option was accepted.
+ */
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt, const char *restrict arg)
+	__attribute__((nonnull(1)));
+
+
+/**
+ * Module's thread function.
+ *
+ * @param ptr a pointer to const struct music_module cast to pointer
+ *            to void.
+ * @return return value shall be ignored.
+ */
+static void *module_run  (void *restrict ptr) __attribute__((nonnull));
+
+
+
+/**
+ * Module's configuration.
+ */
+struct module_config {
+	pthread_t thread;      /**< Thread's ID module is running. */
+	char *file;            /**< Trace file name. */
+	FILE *fp;              /**< Opened trace file. */
+	long speed;            /**< Replay speed multiplier or zero to
+	                            replay as fast as possible. */
+	char loop;             /**< Whether to start again at end of trace. */
+};
+
+
+
+struct music_module *init(const char *restrict name,
+                          const char *restrict arg) {
+	struct module_config *cfg;
+	struct music_module *const m = music_init(MUSIC_IN, sizeof *cfg);
+	(void)name; /* supress warning */
+
+	m->start    = module_start;
+	m->stop     = module_stop;
+	m->free     = module_free;
+	m->config   = module_conf;
+	cfg         = m->data;
+	cfg->thread = 0;
+	cfg->file   = *arg ? music_strdup(arg) : 0;
+	cfg->fp     = 0;
+	cfg->speed  = 1;
+	cfg->loop   = 0;
+
+	return m;
+}
+
+
+
+static void  module_free (struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	free(cfg->file);
+}
+
+
+
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt,
+                          const char *restrict arg) {
+	static const struct music_option options[] = {
+		{ "file",  1, 1 },
+		{ "speed", 2, 2 },
+		{ "loop",  0, 3 },
+		{ 0, 0, 0 }
+	};
+	struct module_config *const cfg = m->data;
+	if (!opt) return 1;
+
+	switch (music_config(m, options, opt, arg, 1)) {
+	case 1:
+		cfg->file = music_strdup_realloc(cfg->file, arg);
+		break;
+	case 2:
+		cfg->speed = atol(arg);
+		if (cfg->speed < 0) {
+			music_log(m, LOG_FATAL, "speed: %s: must not be negative", arg);
+			return 0;
+		}
+		break;
+	case 3:
+		cfg->loop = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+
+
+static int   module_start(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+
+	if (!cfg->file) {
+		music_log(m, LOG_FATAL, "file not set");
+		return 0;
+	}
+
+	if (!(cfg->fp = fopen(cfg->file, "rb"))) {
+		music_log_errno(m, LOG_FATAL, "open: %s", cfg->file);
+		return 0;
+	}
+
+	if (!trace_read_header(cfg->fp)) {
+		music_log(m, LOG_FATAL, "%s: not a trace file", cfg->file);
+		fclose(cfg->fp);
+		return 0;
+	}
+
+	if (pthread_create(&cfg->thread, 0, module_run, (void*)m)) {
+		music_log_errno(m, LOG_FATAL, "pthread_create");
+		fclose(cfg->fp);
+		return 0;
+	}
+	return 1;
+}
+
+
+
+static void  module_stop (const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	pthread_join(cfg->thread, 0);
+	fclose(cfg->fp);
+}
+
+
+
+/**
+ * Waits till given moment.  Waits longer then a milisecond are done
+ * with music_sleep() so that they are interrupted when core
+ * terminates, the rest is done with nanosleep().
+ *
+ * @param m in_replay module.
+ * @param till moment to wait for as returned by music_time_us().
+ * @return whether module should continue.
+ */
+static int   wait_till(const struct music_module *restrict m,
+                       unsigned long long till) {
+	unsigned long long now;
+
+	while ((now = music_time_us()) < till) {
+		if (till - now >= 1000) {
+			if (music_sleep(m, (till - now) / 1000) != 1) {
+				return 0;
+			}
+		} else {
+			struct timespec ts = { 0, 0 };
+			ts.tv_nsec = (till - now) * 1000;
+			nanosleep(&ts, 0);
+		}
+	}
+	return music_module_running(m);
+}
+
+
+
+static void *module_run  (void *restrict ptr) {
+	const struct music_module *const m = ptr;
+	struct module_config *const cfg = m->data;
+	struct trace_record rec;
+	unsigned long long first = 0, start = music_time_us(), count = 0;
+	const unsigned long long begin = start;
+	long pos = ftell(cfg->fp);
+	int ret;
+
+	memset(&rec, 0, sizeof rec);
+
+	while (music_module_running(m)) {
+		ret = trace_read(cfg->fp, &rec);
+
+		if (ret < 0) {
+			music_log(m, LOG_ERROR, "%s: invalid trace file", cfg->file);
+			break;
+		} else if (!ret && !cfg->loop) {
+			break;
+		} else if (!ret) {
+			if (!count || fseek(cfg->fp, pos, SEEK_SET)) break;
+			rec.arrival = 0;
+			first = 0;
+			continue;
+		}
+
+		if (!first) {
+			first = rec.arrival;
+			start = music_time_us();
+		}
+
+		if (cfg->speed &&
+		    !wait_till(m, start + (rec.arrival - first) / cfg->speed)) {
+			break;
+		}
+
+		{
+			const time_t now = time(0);
+			rec.song.time    += now;
+			rec.song.endTime += now;
+		}
+		music_song(m, &rec.song);
+		++count;
+	}
+
+	music_log(m, LOG_NOTICE, "replayed %llu songs in %.3f seconds",
+	          count, (music_time_us() - begin) / 1e6);
+	trace_record_free(&rec);
+	return 0;
+}
@@ -0,0 +1,684 @@
+/**
+ * "Listening to" daemon unix socket input module.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Clients connect to a unix socket and send song records.  A record
+ * is either:
+ *
+ * - a line: <title>:<artist>:<album>:<genre>:<length>:<finish-time>
+ *   terminated with a new line character where values are escaped and
+ *   integers are hexadecimal exactly as in "song[]" argument of the
+ *   music protocol (see http.txt), or
+ *
+ * - a NUL byte followed by a 32-bit big-endian length followed by
+ *   that many bytes holding the same six values, not escaped, each
+ *   terminated with a NUL byte.
+ *
+ * Both kinds may be mixed on a single connection.  Nothing is ever
+ * sent back to the client.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "music.h"
+
+
+/**
+ * Starts module.  See music_module::start.
+ *
+ * @param m in_socket module to start.
+ * @return whether starting succeed.
+ */
+static int   module_start(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Stops module.  See music_module::stop.
+ *
+ * @param m in_socket module to stop.
+ */
+static void  module_stop (const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Frees memory allocated by module.  See music_module::free.
+ *
+ * @param m in_socket module to free.
+ */
+static void  module_free (struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Accepts configuration options.  See music_module::conf.
+ *
+ * @param m in_socket module.
+ * @param opt option keyword.
+ * @param arg argument.
+ * @return whether option was accepted.
+ */
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt, const char *restrict arg)
+	__attribute__((nonnull(1)));
+
+
+/**
+ * Module's thread function.
+ *
+ * @param ptr a pointer to const struct music_module cast to pointer
+ *            to void.
+ * @return return value shall be ignored.
+ */
+static void *module_run  (void *restrict ptr) __attribute__((nonnull));
+
+
+
+/** Initial size of connection's buffer. */
+#define INIT_BUFFER  4096
+
+/** Maximal length of a single record (and connection's buffer). */
+#define MAX_RECORD   65536
+
+/** Maximal number of songs passed to music_songs() at once. */
+#define MAX_BATCH    1024
+
+/** Maximal number of events handled in single epoll_wait() call. */
+#define MAX_EVENTS   64
+
+/** Number of miliseconds listening socket is not watched for after
+    running out of file descriptors. */
+#define ACCEPT_BACKOFF 1000
+
+
+
+/**
+ * A client connection.
+ */
+struct connection {
+	struct connection *next;       /**< Next connection. */
+	struct connection **prev;      /**< Pointer to previous connection's
+	                                    next field. */
+	struct connection *nextDirty;  /**< Next connection with records
+	                                    parsed in current round. */
+	int fd;                        /**< Connection's socket. */
+	size_t capacity;               /**< Size of the buffer. */
+	size_t length;                 /**< Length of data in buffer. */
+	size_t parsed;                 /**< Length of already parsed data. */
+	char *buffer;                  /**< Received data. */
+};
+
+
+/**
+ * Module's configuration.
+ */
+struct module_config {
+	pthread_t thread;      /**< Thread's ID module is running. */
+	char *path;            /**< Socket's path. */
+	long mode;             /**< Socket's permissions. */
+	int listenFd;          /**< Listening socket. */
+	int epollFd;           /**< epoll descriptor. */
+	struct connection *connections;  /**< List of open connections. */
+	unsigned long long acceptAt;  /**< Time listening socket is to be
+	                                   watched again at as returned by
+	                                   music_time_us() or zero if it is
+	                                   watched. */
+	int acceptLogged;      /**< Whether running out of file descriptors
+	                            was logged since a connection was last
+	                            accepted. */
+};
+
+
+
+struct music_module *init(const char *restrict name,
+                          const char *restrict arg) {
+	struct module_config *cfg;
+	struct music_module *const m = music_init(MUSIC_IN, sizeof *cfg);
+	(void)name; /* supress warning */
+
+	m->start      = module_start;
+	m->stop       = module_stop;
+	m->free       = module_free;
+	m->config     = module_conf;
+	cfg           = m->data;
+	cfg->thread   = 0;
+	cfg->path     = *arg ? music_strdup(arg) : 0;
+	cfg->mode     = 0660;
+	cfg->listenFd = -1;
+	cfg->epollFd  = -1;
+	cfg->connections = 0;
+	cfg->acceptAt = 0;
+	cfg->acceptLogged = 0;
+
+	return m;
+}
+
+
+
+static void  module_free (struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	free(cfg->path);
+}
+
+
+
+static int   module_conf (const struct music_module *restrict m,
+                          const char *restrict opt,
+                          const char *restrict arg) {
+	static const struct music_option options[] = {
+		{ "socket", 1, 1 },
+		{ "mode",   2, 2 },
+		{ 0, 0, 0 }
+	};
+	struct module_config *const cfg = m->data;
+	if (!opt) return 1;
+
+	switch (music_config(m, options, opt, arg, 1)) {
+	case 1:
+		cfg->path = music_strdup_realloc(cfg->path, arg);
+		break;
+	case 2:
+		cfg->mode = strtol(arg, 0, 0) & 0777;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+
+
+static int   module_start(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	struct epoll_event ev;
+	struct sockaddr_un addr;
+	size_t len;
+
+	if (!cfg->path) {
+		music_log(m, LOG_FATAL, "socket not set");
+		return 0;
+	}
+
+	len = strlen(cfg->path);
+	if (len >= sizeof addr.sun_path) {
+		music_log(m, LOG_FATAL, "%s: path too long", cfg->path);
+		return 0;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, cfg->path, len + 1);
+
+	cfg->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	                       0);
+	if (cfg->listenFd < 0) {
+		music_log_errno(m, LOG_FATAL, "socket");
+		return 0;
+	}
+
+	unlink(cfg->path);
+	if (bind(cfg->listenFd, (struct sockaddr *)&addr, sizeof addr)) {
+		music_log_errno(m, LOG_FATAL, "bind: %s", cfg->path);
+		goto error;
+	}
+	if (chmod(cfg->path, cfg->mode)) {
+		music_log_errno(m, LOG_WARNING, "chmod: %s", cfg->path);
+	}
+	if (listen(cfg->listenFd, SOMAXCONN)) {
+		music_log_errno(m, LOG_FATAL, "listen");
+		goto error;
+	}
+
+	if ((cfg->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		music_log_errno(m, LOG_FATAL, "epoll_create");
+		goto error;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->listenFd, &ev)) {
+		music_log_errno(m, LOG_FATAL, "epoll_ctl");
+		goto error;
+	}
+	ev.data.ptr = &cfg->epollFd;
+	if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, sleep_pipe_fd, &ev) ||
+	    (music_stop_fd(m) >= 0 &&
+	     epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, music_stop_fd(m), &ev))) {
+		music_log_errno(m, LOG_FATAL, "epoll_ctl");
+		goto error;
+	}
+
+	if (pthread_create(&cfg->thread, 0, module_run, (void*)m)) {
+		music_log_errno(m, LOG_FATAL, "pthread_create");
+		goto error;
+	}
+	return 1;
+
+ error:
+	if (cfg->epollFd >= 0) close(cfg->epollFd);
+	close(cfg->listenFd);
+	unlink(cfg->path);
+	return 0;
+}
+
+
+
+static void  module_stop (const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	pthread_join(cfg->thread, 0);
+	close(cfg->epollFd);
+	close(cfg->listenFd);
+	unlink(cfg->path);
+}
+
+
+
+/**
+ * Decodes per cent escaped string in place.
+ *
+ * @param str string to decode.
+ * @param len string's length.
+ * @return str (now NUL terminated) or NULL if string was empty.
+ */
+static char *unescape(char *restrict str, size_t len) {
+	char *rd = str, *wr = str, *const end = str + len;
+	if (!len) return 0;
+
+	while (rd != end) {
+		if (*rd == '%' && end - rd > 2 &&
+		    isxdigit((unsigned char)rd[1]) && isxdigit((unsigned char)rd[2])) {
+			char hex[3];
+			hex[0] = rd[1];
+			hex[1] = rd[2];
+			hex[2] = 0;
+			*wr++ = strtol(hex, 0, 16);
+			rd += 3;
+		} else {
+			*wr++ = *rd++;
+		}
+	}
+	*wr = 0;
+	return str;
+}
+
+
+/**
+ * Fills song structure with given fields.
+ *
+ * @param song song to fill.
+ * @param fields six NUL terminated fields; strings may be NULL.
+ * @return whether fields were valid.
+ */
+static int   fill_song(struct music_song *restrict song, char **fields) {
+	unsigned long length = 0, end = 0;
+	char *e;
+
+	if (fields[4]) {
+		length = strtoul(fields[4], &e, 16);
+		if (*e) return 0;
+	}
+	if (fields[5]) {
+		end = strtoul(fields[5], &e, 16);
+		if (*e) return 0;
+	}
+
+	song->title   = fields[0];
+	song->artist  = fields[1];
+	song->album   = fields[2];
+	song->genre   = fields[3];
+	song->length  = length;
+	song->time    = time(0);
+	song->endTime = end ? (time_t)end : song->time + (time_t)length;
+	return 1;
+}
+
+
+/**
+ * Parses as many complete records from connection's buffer as
+ * possible.  Strings of parsed songs point into connection's buffer
+ * so it must not be modified until songs are submitted.
+ *
+ * @param m in_socket module.
+ * @param c connection.
+ * @param songs array to add songs to.
+ * @param count number of songs in the array; updated.
+ * @return zero if connection should be closed, non-zero otherwise.
+ */
+static int   parse_records(const struct music_module *restrict m,
+                           struct connection *restrict c,
+                           struct music_song *restrict songs,
+                           size_t *restrict count) {
+	char *ch = c->buffer + c->parsed, *const end = c->buffer + c->length;
+	int ret = 1;
+
+	while (ch != end && *count < MAX_BATCH) {
+		char *fields[6], *rec, *recEnd;
+		unsigned i;
+
+		if (*ch) {
+			/* Line record */
+			char *nl = memchr(ch, '\n', end - ch);
+			if (!nl) break;
+			rec = ch;
+			recEnd = nl;
+			ch = nl + 1;
+			if (recEnd != rec && recEnd[-1] == '\r') --recEnd;
+
+			for (i = 0; i < 6; ++i) {
+				char *sep = i < 5 ? memchr(rec, ':', recEnd - rec) : recEnd;
+				if (!sep) break;
+				fields[i] = unescape(rec, sep - rec);
+				rec = sep + 1;
+			}
+		} else {
+			/* Length prefixed record */
+			unsigned long len;
+			if (end - ch < 5) break;
+			len = ((unsigned long)(unsigned char)ch[1] << 24) |
+				((unsigned long)(unsigned char)ch[2] << 16) |
+				((unsigned long)(unsigned char)ch[3] <<  8) |
+				 (unsigned long)(unsigned char)ch[4];
+			if (len > MAX_RECORD - 5) {
+				music_log(m, LOG_WARNING, "record too long");
+				ret = 0;
+				break;
+			}
+			if ((unsigned long)(end - ch) < len + 5) break;
+			rec = ch + 5;
+			recEnd = rec + len;
+			ch = recEnd;
+
+			for (i = 0; i < 6; ++i) {
+				char *nul = memchr(rec, 0, recEnd - rec);
+				if (!nul) break;
+				fields[i] = nul == rec ? 0 : rec;
+				rec = nul + 1;
+			}
+		}
+
+		if (i != 6 || !fill_song(songs + *count, fields)) {
+			music_log(m, LOG_NOTICE, "ignoring invalid record");
+			continue;
+		}
+		++*count;
+	}
+
+	c->parsed = ch - c->buffer;
+	return ret;
+}
+
+
+/**
+ * Reads data from connection and parses records.  Returns when
+ * there is no more data to read, connection was closed or songs
+ * need to be submitted before reading may continue (because either
+ * songs array or connection's buffer is full).
+ *
+ * @param m in_socket module.
+ * @param c connection.
+ * @param songs array to add songs to.
+ * @param count number of songs in the array; updated.
+ * @return non-zero if songs need to be submitted before reading from
+ *         connection again, zero otherwise.
+ */
+static int   read_records(const struct music_module *restrict m,
+                          struct connection *restrict c,
+                          struct music_song *restrict songs,
+                          size_t *restrict count) {
+	struct module_config *const cfg = m->data;
+
+	for (;;) {
+		ssize_t r;
+
+		if (!parse_records(m, c, songs, count)) break;
+		if (*count == MAX_BATCH) return 1;
+
+		if (c->length == c->capacity) {
+			char *tmp;
+			if (c->parsed) return 1;
+			if (c->capacity == MAX_RECORD) {
+				music_log(m, LOG_WARNING, "record too long");
+				break;
+			}
+			if (!(tmp = realloc(c->buffer, c->capacity * 2))) {
+				music_log(m, LOG_ERROR, "not enough memory");
+				break;
+			}
+			c->buffer = tmp;
+			c->capacity *= 2;
+		}
+
+		r = read(c->fd, c->buffer + c->length, c->capacity - c->length);
+		if (r > 0) {
+			c->length += r;
+		} else if (r < 0 && errno == EAGAIN) {
+			return 0;
+		} else if (r >= 0 || errno != EINTR) {
+			break;
+		}
+	}
+
+	/* EOF or error; songs parsed so far may still point into the
+	   buffer so it is freed in flush_songs(). */
+	epoll_ctl(cfg->epollFd, EPOLL_CTL_DEL, c->fd, 0);
+	close(c->fd);
+	c->fd = -1;
+	return 0;
+}
+
+
+/**
+ * Submits collected songs and compacts buffers of connections
+ * songs were read from.  Frees closed connections.
+ *
+ * @param m in_socket module.
+ * @param songs array of songs.
+ * @param count number of songs in the array; zeroed.
+ * @param dirty list of connections songs were read from; emptied.
+ */
+static void  flush_songs(const struct music_module *restrict m,
+                         struct music_song *restrict songs,
+                         size_t *restrict count,
+                         struct connection **restrict dirty) {
+	struct connection *c = *dirty, *next;
+
+	if (*count) {
+		music_songs(m, songs, *count);
+		*count = 0;
+	}
+
+	for (; c; c = next) {
+		next = c->nextDirty == c ? 0 : c->nextDirty;
+		c->nextDirty = 0;
+		if (c->fd < 0) {
+			if ((*c->prev = c->next)) c->next->prev = c->prev;
+			free(c->buffer);
+			free(c);
+		} else if (c->parsed) {
+			memmove(c->buffer, c->buffer + c->parsed, c->length - c->parsed);
+			c->length -= c->parsed;
+			c->parsed = 0;
+		}
+	}
+	*dirty = 0;
+}
+
+
+/**
+ * Accepts all pending connections.
+ *
+ * @param m in_socket module.
+ */
+static void  accept_connections(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	struct epoll_event ev;
+	struct connection *c;
+	int fd;
+
+	while ((fd = accept(cfg->listenFd, 0, 0)) >= 0) {
+		cfg->acceptLogged = 0;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (!(c = malloc(sizeof *c)) ||
+		    !(c->buffer = malloc(INIT_BUFFER))) {
+			music_log(m, LOG_ERROR, "not enough memory");
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		c->nextDirty = 0;
+		c->fd        = fd;
+		c->capacity  = INIT_BUFFER;
+		c->length    = 0;
+		c->parsed    = 0;
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, fd, &ev)) {
+			music_log_errno(m, LOG_ERROR, "epoll_ctl");
+			free(c->buffer);
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		if ((c->next = cfg->connections)) c->next->prev = &c->next;
+		c->prev = &cfg->connections;
+		cfg->connections = c;
+	}
+
+	/* Pending connection keeps listening socket readable; stop
+	   watching it for a while rather than spin */
+	if (errno == EMFILE || errno == ENFILE) {
+		if (!cfg->acceptLogged) {
+			music_log_errno(m, LOG_WARNING, "accept");
+			cfg->acceptLogged = 1;
+		}
+		epoll_ctl(cfg->epollFd, EPOLL_CTL_DEL, cfg->listenFd, 0);
+		cfg->acceptAt = music_time_us() + ACCEPT_BACKOFF * 1000ull;
+	}
+}
+
+
+/**
+ * Watches listening socket again once backoff after running out of
+ * file descriptors passes.
+ *
+ * @param m in_socket module.
+ * @return number of miliseconds till listening socket is to be
+ *         watched again or -1 if it is watched.
+ */
+static int   accept_resume(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+	const unsigned long long now = music_time_us();
+	struct epoll_event ev;
+
+	if (!cfg->acceptAt) {
+		return -1;
+	} else if (now < cfg->acceptAt) {
+		return (cfg->acceptAt - now + 999) / 1000;
+	}
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = 0;
+	if (epoll_ctl(cfg->epollFd, EPOLL_CTL_ADD, cfg->listenFd, &ev)) {
+		music_log_errno(m, LOG_ERROR, "epoll_ctl");
+		cfg->acceptAt = now + ACCEPT_BACKOFF * 1000ull;
+		return ACCEPT_BACKOFF;
+	}
+	cfg->acceptAt = 0;
+	return -1;
+}
+
+
+
+static void *module_run  (void *restrict ptr) {
+	const struct music_module *const m = ptr;
+	struct module_config *const cfg = m->data;
+	struct music_song *const songs = malloc(MAX_BATCH * sizeof *songs);
+	struct epoll_event events[MAX_EVENTS];
+	struct connection *dirty = 0;
+	size_t count = 0;
+
+	if (!songs) {
+		music_log(m, LOG_ERROR, "not enough memory");
+		return 0;
+	}
+
+	while (music_module_running(m)) {
+		int n, i;
+
+		n = epoll_wait(cfg->epollFd, events, MAX_EVENTS, accept_resume(m));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			music_log_errno(m, LOG_ERROR, "epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			struct connection *const c = events[i].data.ptr;
+
+			if (c == (void*)&cfg->epollFd) {
+				/* Core is terminating or stopping module */
+				goto finish;
+			} else if (!c) {
+				accept_connections(m);
+				continue;
+			}
+
+			if (!c->nextDirty) {
+				c->nextDirty = dirty ? dirty : c;
+				dirty = c;
+			}
+			while (read_records(m, c, songs, &count)) {
+				flush_songs(m, songs, &count, &dirty);
+				c->nextDirty = c;
+				dirty = c;
+			}
+		}
+
+		/* All songs read in this round are submitted at once */
+		flush_songs(m, songs, &count, &dirty);
+	}
+
+ finish:
+	flush_songs(m, songs, &count, &dirty);
+	free(songs);
+	while (cfg->connections) {
+		struct connection *const c = cfg->connections;
+		cfg->connections = c->next;
+		close(c->fd);
+		free(c->buffer);
+		free(c);
+	}
+	return 0;
+}
@@ -70,6 +70,7 @@
 #  include <netinet/in.h>
 #  include <arpa/inet.h>
 #  include <sys/socket.h>
+#  include <sys/un.h>
 #  include <netdb.h>
 #endif
 
@@ -267,6 +268,50 @@ static int mpd_connect(mpd_Connection * connection, const char * host, int port,
 }
 #endif /* !MPD_HAVE_GAI */
 
+#ifndef WIN32
+static int mpd_connect_un(mpd_Connection * connection, const char * path,
+                          float timeout)
+{
+	struct sockaddr_un addr;
+	size_t len = strlen(path);
+
+	if(len>=sizeof(addr.sun_path)) {
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+				"socket path \"%s\" too long",path);
+		connection->error = MPD_ERROR_UNKHOST;
+		return -1;
+	}
+
+	memset(&addr,0,sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path,path,len+1);
+
+	if((connection->sock = socket(AF_UNIX,SOCK_STREAM,0))<0) {
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+				"problems creating socket: %s",
+				strerror(errno));
+		connection->error = MPD_ERROR_SYSTEM;
+		return -1;
+	}
+
+	mpd_setConnectionTimeout(connection,timeout);
+
+	/* connect stuff */
+	if (do_connect_fail(connection, (struct sockaddr *)&addr,
+	                    sizeof(struct sockaddr_un))) {
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+				"problems connecting to \"%s\": %s",
+				path,strerror(errno));
+		connection->error = MPD_ERROR_CONNPORT;
+		closesocket(connection->sock);
+		connection->sock = -1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* !WIN32 */
+
 char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES] =
 {
 	(char*)"Artist",
@@ -329,6 +374,55 @@ void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout) {
 					    0.5);
 }
 
+void mpd_setConnectionBufferMax(mpd_Connection * connection, int max) {
+	connection->bufmax = max < MPD_BUFFER_INIT_LENGTH ?
+	                     MPD_BUFFER_INIT_LENGTH : max;
+}
+
+/* makes room at the end of the buffer by dropping already processed data
+ * and, if that is not enough, by doubling buffer's size up to bufmax
+ * returns 0 if buffer is full and cannot grow any more */
+static int mpd_growBuffer(mpd_Connection * connection) {
+	char * tmp;
+	int cap;
+
+	if(connection->bufstart) {
+		memmove(connection->buffer,
+				connection->buffer+connection->bufstart,
+				connection->buflen-connection->bufstart+1);
+		connection->buflen-=connection->bufstart;
+		connection->bufstart = 0;
+		if(connection->buflen<connection->bufcap) return 1;
+	}
+
+	if(connection->bufcap>=connection->bufmax) return 0;
+	cap = connection->bufcap > connection->bufmax / 2 ?
+	      connection->bufmax : connection->bufcap * 2;
+	if(!(tmp = realloc(connection->buffer, cap+1))) return 0;
+	connection->buffer = tmp;
+	connection->bufcap = cap;
+	return 1;
+}
+
+/* shrinks buffer back to MPD_BUFFER_INIT_LENGTH after a long response if
+ * unprocessed data fits in it */
+static void mpd_shrinkBuffer(mpd_Connection * connection) {
+	int len = connection->buflen - connection->bufstart;
+	char * tmp;
+
+	if(connection->bufcap<=MPD_BUFFER_INIT_LENGTH ||
+	   len>=MPD_BUFFER_INIT_LENGTH) return;
+
+	memmove(connection->buffer, connection->buffer+connection->bufstart,
+			len+1);
+	connection->buflen = len;
+	connection->bufstart = 0;
+	if((tmp = realloc(connection->buffer, MPD_BUFFER_INIT_LENGTH+1))) {
+		connection->buffer = tmp;
+		connection->bufcap = MPD_BUFFER_INIT_LENGTH;
+	}
+}
+
 static int mpd_parseWelcome(mpd_Connection * connection, const char * host, int port,
                             char * rt, char * output) {
 	char * tmp;
@@ -372,7 +466,11 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	mpd_Connection * connection = malloc(sizeof(mpd_Connection));
 	struct timeval tv;
 	fd_set fds;
-	strcpy(connection->buffer,"");
+	if (!connection) return NULL;
+	connection->buffer = malloc(MPD_BUFFER_INIT_LENGTH+1);
+	connection->bufcap = MPD_BUFFER_INIT_LENGTH;
+	connection->bufmax = MPD_BUFFER_MAX_LENGTH;
+	connection->sock = -1;
 	connection->buflen = 0;
 	connection->bufstart = 0;
 	strcpy(connection->errorStr,"");
@@ -384,13 +482,32 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	connection->returnElement = NULL;
 	connection->request = NULL;
 
+	if (!connection->buffer) {
+		strcpy(connection->errorStr,"not enough memory");
+		connection->error = MPD_ERROR_SYSTEM;
+		return connection;
+	}
+	strcpy(connection->buffer,"");
+
 	if (winsock_dll_error(connection))
 		return connection;
 
+#ifndef WIN32
+	if (host[0] == '/') {
+		if (mpd_connect_un(connection, host, timeout) < 0)
+			return connection;
+	} else
+#endif
 	if (mpd_connect(connection, host, port, timeout) < 0)
 		return connection;
 
 	while(!(rt = strstr(connection->buffer,"\n"))) {
+		if(connection->buflen>=connection->bufcap &&
+		   !mpd_growBuffer(connection)) {
+			strcpy(connection->errorStr,"buffer overrun");
+			connection->error = MPD_ERROR_BUFFEROVERRUN;
+			return connection;
+		}
 		tv.tv_sec = connection->timeout.tv_sec;
 		tv.tv_usec = connection->timeout.tv_usec;
 		FD_ZERO(&fds);
@@ -399,7 +516,7 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 			int readed;
 			readed = recv(connection->sock,
 					&(connection->buffer[connection->buflen]),
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,0);
+					connection->bufcap-connection->buflen,0);
 			if(readed<=0) {
 				snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 						"problems getting a response from"
@@ -451,6 +568,7 @@ void mpd_closeConnection(mpd_Connection * connection) {
 	closesocket(connection->sock);
 	if(connection->returnElement) free(connection->returnElement);
 	if(connection->request) free(connection->request);
+	free(connection->buffer);
 	free(connection);
 	WSACleanup();
 }
@@ -535,16 +653,8 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 	bufferCheck = connection->buffer+connection->bufstart;
 	while(connection->bufstart>=connection->buflen ||
 			!(rt = strchr(bufferCheck,'\n'))) {
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			memmove(connection->buffer,
-					connection->buffer+
-					connection->bufstart,
-					connection->buflen-
-					connection->bufstart+1);
-			connection->buflen-=connection->bufstart;
-			connection->bufstart = 0;
-		}
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
+		if(connection->buflen>=connection->bufcap &&
+		   !mpd_growBuffer(connection)) {
 			strcpy(connection->errorStr,"buffer overrun");
 			connection->error = MPD_ERROR_BUFFEROVERRUN;
 			connection->doneProcessing = 1;
@@ -559,7 +669,7 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv) == 1)) {
 			readed = recv(connection->sock,
 					connection->buffer+connection->buflen,
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,
+					connection->bufcap-connection->buflen,
 					MSG_DONTWAIT);
 			if(readed<0 && SENDRECV_ERRNO_IGNORE) {
 				continue;
@@ -597,6 +707,7 @@ static void mpd_getNextReturnElement(mpd_Connection * connection) {
 		connection->listOks = 0;
 		connection->doneProcessing = 1;
 		connection->doneListOk = 0;
+		mpd_shrinkBuffer(connection);
 		return;
 	}
 
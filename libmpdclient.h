@@ -57,7 +57,8 @@
 
 #include <sys/time.h>
 #include <stdarg.h>
-#define MPD_BUFFER_MAX_LENGTH	50000
+#define MPD_BUFFER_INIT_LENGTH	1024
+#define MPD_BUFFER_MAX_LENGTH	(1 << 20)
 #define MPD_ERRORSTR_MAX_LENGTH	1000
 #define MPD_WELCOME_MESSAGE	"OK MPD "
 
@@ -134,7 +135,9 @@ typedef struct _mpd_Connection {
 	int error;
 	/* DON'T TOUCH any of the rest of this stuff */
 	int sock;
-	char buffer[MPD_BUFFER_MAX_LENGTH+1];
+	char * buffer;
+	int bufcap;
+	int bufmax;
 	int buflen;
 	int bufstart;
 	int doneProcessing;
@@ -151,11 +154,21 @@ typedef struct _mpd_Connection {
  * you should use mpd_closeConnection, when your done with the connection,
  * even if an error has occurred
  * _timeout_ is the connection timeout period in seconds
+ * if _host_ starts with a slash it is a path to MPD's unix socket and
+ * _port_ is ignored
  */
 mpd_Connection * mpd_newConnection(const char * host, int port, float timeout);
 
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout);
 
+/* mpd_setConnectionBufferMax
+ * sets the size up to which the receive buffer may grow; the buffer starts
+ * at MPD_BUFFER_INIT_LENGTH bytes, grows on demand when a response line
+ * does not fit and shrinks back once a command has been processed
+ * _max_ is the maximal buffer size in bytes
+ */
+void mpd_setConnectionBufferMax(mpd_Connection * connection, int max);
+
 /* mpd_closeConnection
  * use this to close a connection and free'ing subsequent memory
  */
@@ -0,0 +1,549 @@
+/**
+ * Mock music server for testing out_http.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A small HTTP server speaking protocol described in http.txt.  It
+ * accepts any authentication and acknowledges every submitted song
+ * unless told to inject errors.  Each connection is handled by its
+ * own thread and HTTP/1.1 keep-alive is supported.
+ *
+ * Once listening, server prints "port <number>" on standard output.
+ * On SIGINT or SIGTERM it prints a JSON summary and exits.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/** Maximal size of request's headers. */
+#define MAX_HEAD 8192
+
+/** Maximal size of request's body. */
+#define MAX_BODY (1 << 20)
+
+
+/**
+ * Kinds of injected errors.
+ */
+enum error {
+	ERR_HTTP_500,     /**< Reply with HTTP 500. */
+	ERR_MUSIC_200,    /**< Reply with MUSIC 201 Invalid User. */
+	ERR_MUSIC_300,    /**< Reply with MUSIC 301 Bad Session. */
+	ERR_PARTIAL,      /**< Omit SONG lines for second half of songs. */
+	ERR_FAIL,         /**< Reply with FAIL status for a song. */
+	ERR_DROP,         /**< Close connection without replying. */
+	ERR_COUNT
+};
+
+
+/** Per cent of requests (or songs for ERR_FAIL) to inject given
+    error to. */
+static double errorRate[ERR_COUNT];
+
+/** Number of injected errors. */
+static unsigned long errorCount[ERR_COUNT];
+
+/** Delay before replying in microseconds. */
+static unsigned long latency = 0;
+
+/** Random jitter added to latency in microseconds. */
+static unsigned long jitter = 0;
+
+/** Whether to close connection after each response. */
+static int closeAlways = 0;
+
+/** Whether to accept only plain (not compact) batches. */
+static int plainOnly = 0;
+
+
+/** Number of requests handled. */
+static unsigned long requests = 0;
+
+/** Number of songs received. */
+static unsigned long songs = 0;
+
+/** Number of songs acknowledged with OK. */
+static unsigned long songsOk = 0;
+
+/** Number of now playing songs received. */
+static unsigned long nowPlaying = 0;
+
+/** Number of requests with compact batches. */
+static unsigned long compactRequests = 0;
+
+/** Number of request body bytes received. */
+static unsigned long bodyBytes = 0;
+
+/** Number of connections accepted. */
+static unsigned long connections = 0;
+
+
+/** Set by signal handler. */
+static volatile sig_atomic_t running = 1;
+
+
+
+/**
+ * Connection's thread.
+ *
+ * @param ptr socket cast to pointer to void.
+ * @return return value shall be ignored.
+ */
+static void *connection_run(void *ptr);
+
+
+/**
+ * Reads and handles a single request.
+ *
+ * @param fd connection's socket.
+ * @param buf buffer of MAX_HEAD + MAX_BODY bytes.
+ * @param have number of bytes already in buffer.
+ * @param random random generator's state.
+ * @return number of bytes left in buffer belonging to next request
+ *         or -1 if connection should be closed.
+ */
+static long handle_request(int fd, char *restrict buf, size_t have,
+                           uint64_t *restrict random)
+	__attribute__((nonnull));
+
+
+/**
+ * Writes whole buffer to socket.
+ *
+ * @param fd socket.
+ * @param data data to write.
+ * @param len data's length.
+ * @return whether whole buffer was written.
+ */
+static int   write_all(int fd, const char *restrict data, size_t len)
+	__attribute__((nonnull));
+
+
+/**
+ * Returns whether an error should be injected.
+ *
+ * @param err error kind.
+ * @param random random generator's state.
+ * @return whether to inject error.
+ */
+static int   inject(enum error err, uint64_t *restrict random)
+	__attribute__((nonnull));
+
+
+/**
+ * A callback function for SIGINT and SIGTERM.
+ *
+ * @param signum signal number.
+ */
+static void  got_sig(int signum);
+
+
+
+int main(int argc, char **argv) {
+	static const char *const errorNames[ERR_COUNT] = {
+		"http_500", "music_200", "music_300", "partial", "fail", "drop"
+	};
+	struct sockaddr_in addr;
+	struct sockaddr_un unixAddr;
+	socklen_t addrLen = sizeof addr;
+	struct sigaction sa;
+	const char *unixPath = 0;
+	unsigned port = 0;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "p:u:l:j:5:2:3:P:F:D:cBh")) != -1) {
+		switch (opt) {
+		case 'p': port    = atoi(optarg); break;
+		case 'u': unixPath = optarg; break;
+		case 'l': latency = strtoul(optarg, 0, 0) * 1000; break;
+		case 'j': jitter  = strtoul(optarg, 0, 0) * 1000; break;
+		case '5': errorRate[ERR_HTTP_500 ] = atof(optarg); break;
+		case '2': errorRate[ERR_MUSIC_200] = atof(optarg); break;
+		case '3': errorRate[ERR_MUSIC_300] = atof(optarg); break;
+		case 'P': errorRate[ERR_PARTIAL  ] = atof(optarg); break;
+		case 'F': errorRate[ERR_FAIL     ] = atof(optarg); break;
+		case 'D': errorRate[ERR_DROP     ] = atof(optarg); break;
+		case 'c': closeAlways = 1; break;
+		case 'B': plainOnly   = 1; break;
+		default:
+			fputs("usage: mock_server [ -p port | -u path ] [ -l ms ] [ -j ms ]"
+			      " [ -c ] [ -B ]\n"
+			      "                   [ -5 pct ] [ -2 pct ] [ -3 pct ]"
+			      " [ -P pct ] [ -F pct ] [ -D pct ]\n"
+			      " -p  port to listen on (default: any free port)\n"
+			      " -u  listen on a unix socket at given path instead\n"
+			      " -l  delay before replying in milliseconds\n"
+			      " -j  random jitter added to delay in milliseconds\n"
+			      " -c  close connection after each response\n"
+			      " -B  accept only plain batches (reject compact ones)\n"
+			      " -5  per cent of requests answered with HTTP 500\n"
+			      " -2  per cent of requests answered with MUSIC 201\n"
+			      " -3  per cent of requests answered with MUSIC 301\n"
+			      " -P  per cent of responses missing second half of"
+			      " SONG lines\n"
+			      " -F  per cent of songs answered with FAIL\n"
+			      " -D  per cent of requests after which connection is"
+			      " closed\n     without a response\n", stdout);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = got_sig;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (unixPath) {
+		if (strlen(unixPath) >= sizeof unixAddr.sun_path) {
+			fprintf(stderr, "%s: path too long\n", unixPath);
+			return 1;
+		}
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			return 1;
+		}
+		memset(&unixAddr, 0, sizeof unixAddr);
+		unixAddr.sun_family = AF_UNIX;
+		strcpy(unixAddr.sun_path, unixPath);
+		unlink(unixPath);
+		if (bind(fd, (struct sockaddr *)&unixAddr, sizeof unixAddr) ||
+		    listen(fd, 64)) {
+			perror("bind");
+			return 1;
+		}
+		printf("unix %s\n", unixPath);
+	} else {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			perror("socket");
+			return 1;
+		}
+		i = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof i);
+
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family      = AF_INET;
+		addr.sin_port        = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof addr) ||
+		    listen(fd, 64) ||
+		    getsockname(fd, (struct sockaddr *)&addr, &addrLen)) {
+			perror("bind");
+			return 1;
+		}
+		printf("port %u\n", ntohs(addr.sin_port));
+	}
+	fflush(stdout);
+
+	while (running) {
+		pthread_t thread;
+		long conn = accept(fd, 0, 0);
+		if (conn < 0) {
+			if (errno != EINTR) perror("accept");
+			continue;
+		}
+		__atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+		if (pthread_create(&thread, 0, connection_run, (void*)conn)) {
+			close(conn);
+		} else {
+			pthread_detach(thread);
+		}
+	}
+
+	printf("{\"requests\":%lu,\"songs\":%lu,\"songs_ok\":%lu,"
+	       "\"now_playing\":%lu,\"compact_requests\":%lu,"
+	       "\"body_bytes\":%lu,\"connections\":%lu",
+	       __atomic_load_n(&requests, __ATOMIC_RELAXED),
+	       __atomic_load_n(&songs, __ATOMIC_RELAXED),
+	       __atomic_load_n(&songsOk, __ATOMIC_RELAXED),
+	       __atomic_load_n(&nowPlaying, __ATOMIC_RELAXED),
+	       __atomic_load_n(&compactRequests, __ATOMIC_RELAXED),
+	       __atomic_load_n(&bodyBytes, __ATOMIC_RELAXED),
+	       __atomic_load_n(&connections, __ATOMIC_RELAXED));
+	for (i = 0; i < ERR_COUNT; ++i) {
+		printf(",\"err_%s\":%lu", errorNames[i],
+		       __atomic_load_n(errorCount + i, __ATOMIC_RELAXED));
+	}
+	puts("}");
+	if (unixPath) unlink(unixPath);
+	return 0;
+}
+
+
+
+static void got_sig(int signum) {
+	(void)signum;
+	running = 0;
+}
+
+
+
+static void *connection_run(void *ptr) {
+	const int fd = (long)ptr;
+	char *const buf = malloc(MAX_HEAD + MAX_BODY + 1);
+	uint64_t random = (uint64_t)(long)ptr * 0x9E3779B97F4A7C15ull ^
+		(uint64_t)time(0);
+	long have = 0;
+
+	if (buf) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		while (running && (have = handle_request(fd, buf, have, &random)) >= 0);
+	}
+
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+
+
+static int   inject(enum error err, uint64_t *restrict random) {
+	uint64_t x = *random;
+	if (errorRate[err] <= 0) return 0;
+	/* xorshift64 */
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*random = x;
+	if ((x >> 11) * (1.0 / 9007199254740992.0) * 100 >= errorRate[err]) {
+		return 0;
+	}
+	__atomic_add_fetch(errorCount + err, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+
+
+static int   write_all(int fd, const char *restrict data, size_t len) {
+	while (len) {
+		ssize_t r = write(fd, data, len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return 0;
+		data += r;
+		len -= r;
+	}
+	return 1;
+}
+
+
+
+static long handle_request(int fd, char *restrict buf, size_t have,
+                           uint64_t *restrict random) {
+	size_t headLen, bodyLen = 0, total, count = 0, i, ok, dictCount = 0;
+	int now = 0, compact = 0;
+	char *head, *ch, *body, *out, *bad = 0;
+	int keepAlive = !closeAlways;
+	size_t outLen;
+	FILE *fp;
+	ssize_t r;
+
+	/* Read headers */
+	buf[have] = 0;
+	while (!(ch = strstr(buf, "\r\n\r\n"))) {
+		if (have >= MAX_HEAD) return -1;
+		r = read(fd, buf + have, MAX_HEAD - have);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		buf[have += r] = 0;
+	}
+	headLen = ch + 4 - buf;
+	head = buf;
+
+	for (ch = strchr(head, '\n'); ch && ch < buf + headLen; ch = strchr(ch, '\n')) {
+		++ch;
+		if (!strncasecmp(ch, "Content-Length:", 15)) {
+			bodyLen = strtoul(ch + 15, 0, 10);
+		} else if (!strncasecmp(ch, "Connection:", 11)) {
+			const char *v = ch + 11;
+			while (*v == ' ') ++v;
+			if (!strncasecmp(v, "close", 5)) keepAlive = 0;
+		} else if (!strncasecmp(ch, "Expect:", 7) &&
+		           !write_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25)) {
+			return -1;
+		}
+	}
+	if (bodyLen > MAX_BODY) return -1;
+	ch = strchr(head, '\r');
+	if (ch - head >= 8 && !strncmp(ch - 8, "HTTP/1.0", 8)) {
+		keepAlive = 0;
+	}
+
+	/* Read body */
+	total = headLen + bodyLen;
+	while (have < total) {
+		r = read(fd, buf + have, MAX_HEAD + MAX_BODY - have);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		have += r;
+	}
+	body = buf + headLen;
+
+	/* Count songs */
+	for (ch = body; ch < buf + total; ) {
+		char *const amp = memchr(ch, '&', buf + total - ch);
+		char *const end = amp ? amp : buf + total;
+		if (!strncmp(ch, "song[]=", 7) || !strncmp(ch, "song%5B%5D=", 11)) {
+			++count;
+		} else if (!strncmp(ch, "c[]=", 4) || !strncmp(ch, "c%5B%5D=", 8)) {
+			++count;
+			compact = 1;
+		} else if (!strncmp(ch, "d=", 2)) {
+			dictCount = end > ch + 2;
+			for (ch += 2; ch < end; ++ch) dictCount += *ch == ':';
+		} else if (!strncmp(ch, "now=", 4)) {
+			now = 1;
+		}
+		if (!amp) break;
+		ch = amp + 1;
+	}
+
+	/* Check compact batch's dictionary indexes */
+	if (compact && !plainOnly && (bad = calloc(count ? count : 1, 1))) {
+		for (i = 0, ch = body; ch < buf + total; ) {
+			char *const amp = memchr(ch, '&', buf + total - ch);
+			unsigned field;
+			if (!strncmp(ch, "c[]=", 4) || !strncmp(ch, "c%5B%5D=", 8)) {
+				ch = memchr(ch, '=', 8) + 1;
+				for (field = 0; field < 4; ++field) {
+					char *e;
+					unsigned long index = strtoul(ch, &e, 16);
+					if (*e != ':') {
+						bad[i] = 1;
+						break;
+					}
+					if (e != ch && index >= dictCount) bad[i] = 1;
+					ch = e + 1;
+				}
+				++i;
+			}
+			if (!amp) break;
+			ch = amp + 1;
+		}
+	}
+
+	__atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&songs, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&nowPlaying, now, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compactRequests, compact, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bodyBytes, bodyLen, __ATOMIC_RELAXED);
+
+	if (latency || jitter) {
+		unsigned long usec = latency;
+		if (jitter) {
+			uint64_t x = *random;
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			*random = x;
+			usec += x % jitter;
+		}
+		usleep(usec);
+	}
+
+	if (inject(ERR_DROP, random)) {
+		free(bad);
+		return -1;
+	}
+
+	/* Prepare body */
+	if (!(fp = open_memstream(&out, &outLen))) {
+		free(bad);
+		return -1;
+	}
+
+	if (compact && plainOnly) {
+		fputs("Compact batches not supported\n", fp);
+		fclose(fp);
+		fp = 0;
+	} else if (inject(ERR_HTTP_500, random)) {
+		fprintf(fp, "Internal Server Error\n");
+		fclose(fp);
+		fp = 0;
+	} else if (inject(ERR_MUSIC_200, random)) {
+		fputs("MUSIC 201 Invalid User\nInvalid user name or password\n", fp);
+	} else if (inject(ERR_MUSIC_300, random)) {
+		fputs("MUSIC 301 Bad Session\nSession expired\n", fp);
+	} else {
+		const size_t lines = inject(ERR_PARTIAL, random) ? count / 2 : count;
+		fputs("MUSIC 100 OK\n", fp);
+		for (ok = i = 0; i < lines; ++i) {
+			if (bad && bad[i]) {
+				fprintf(fp, "SONG %lu REJ Bad dictionary index\n",
+				        (unsigned long)i);
+			} else if (inject(ERR_FAIL, random)) {
+				fprintf(fp, "SONG %lu FAIL Database error\n", (unsigned long)i);
+			} else {
+				fprintf(fp, "SONG %lu OK\n", (unsigned long)i);
+				++ok;
+			}
+		}
+		if (lines == count) {
+			if (now) {
+				fputs("SONG -1 OK\n", fp);
+			}
+			fputs("END\n", fp);
+		}
+		__atomic_add_fetch(&songsOk, ok, __ATOMIC_RELAXED);
+	}
+
+	{
+		char header[256];
+		int len;
+		free(bad);
+		if (fp) {
+			fclose(fp);
+			len = sprintf(header, "HTTP/1.1 200 OK\r\n"
+			              "Content-Type: text/x-music\r\n");
+		} else if (compact && plainOnly) {
+			len = sprintf(header, "HTTP/1.1 415 Unsupported Media Type\r\n"
+			              "Content-Type: text/plain\r\n");
+		} else {
+			len = sprintf(header, "HTTP/1.1 500 Internal Server Error\r\n"
+			              "Content-Type: text/plain\r\n");
+		}
+		if (!plainOnly) {
+			len += sprintf(header + len, "X-Music-Batch: dict\r\n");
+		}
+		len += sprintf(header + len, "Content-Length: %lu\r\n%s\r\n",
+		               (unsigned long)outLen,
+		               keepAlive ? "" : "Connection: close\r\n");
+		r = write_all(fd, header, len) && write_all(fd, out, outLen);
+		free(out);
+		if (!r || !keepAlive) return -1;
+	}
+
+	/* Keep pipelined data */
+	memmove(buf, buf + total, have - total);
+	return have - total;
+}
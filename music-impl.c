@@ -17,6 +17,7 @@
  */
 
 #include "music-int.h"
+#include "trace.h"
 
 #include <ctype.h>
 #include <limits.h>
@@ -26,6 +27,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 
 #ifdef HAVE_POLL
 # include <poll.h>
@@ -56,8 +58,8 @@ static void music_log_internal(const struct music_module *restrict m,
 
 
 
-void music_log (const struct music_module *restrict m, unsigned level,
-                const char *restrict fmt, ...){
+void (music_log)(const struct music_module *restrict m, unsigned level,
+                 const char *restrict fmt, ...){
 	va_list ap;
 	va_start(ap, fmt);
 	music_log_internal(m, level, fmt, ap, 0);
@@ -65,8 +67,8 @@ void music_log (const struct music_module *restrict m, unsigned level,
 
 
 
-void music_log_errno(const struct music_module *restrict m, unsigned level,
-                     const char *restrict fmt, ...) {
+void (music_log_errno)(const struct music_module *restrict m, unsigned level,
+                       const char *restrict fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
 	music_log_internal(m, level, fmt, ap, 1);
@@ -103,9 +105,16 @@ static void music_log_internal(const struct music_module *restrict m,
 	char *str;
 	time_t t;
 
-	if (cfg->loglevel < level) return;
+	if ((m->loglevel == MUSIC_LOGLEVEL_UNSET
+	     ? cfg->loglevel : m->loglevel) < level) return;
 	if (level>LOG_DEBUG+3) return;
 
+	if (cfg->logasync) {
+		log_async_vlog(cfg->logasync, level, m->name, fmt, ap,
+		               errStr ? strerror(errno) : 0);
+		return;
+	}
+
 	t = time(0);
 	pthread_mutex_lock(&cfg->log_mutex);
 
@@ -203,13 +212,24 @@ void music_retry_cached(const struct music_module *restrict m) {
 	const struct music_module *cache = m->core->next;
 	if (cache && cache->type==MUSIC_CACHE && cache->retryCached) {
 		const struct music_module *array[2] = { 0, 0 };
+		const unsigned long long start = music_time_us();
 		array[0] = m;
 		cache->retryCached(cache, array);
+		music_metric_observe(((struct config *)m->core->data)->retryDuration,
+		                     music_time_us() - start);
 	}
 }
 
 
 
+unsigned long long music_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+
+
 char *music_strdup_realloc(char *restrict old, const char *restrict str) {
 	size_t len = strlen(str) + 1;
 	old = realloc(old, len);
@@ -219,21 +239,35 @@ char *music_strdup_realloc(char *restrict old, const char *restrict str) {
 
 
 
+int music_module_running(const struct music_module *restrict m) {
+	return music_running && !m->stopping;
+}
+
+
+
+int music_stop_fd(const struct music_module *restrict m) {
+	return m->stopPipe[0];
+}
+
+
+
 int music_sleep(const struct music_module *restrict m, unsigned long mili) {
 	int ret = 0;
 
 #ifdef HAVE_POLL
-	struct pollfd fd = { 0, POLLIN, 0 };
+	struct pollfd fds[2] = { { 0, POLLIN, 0 }, { 0, POLLIN, 0 } };
 	if (!mili) return 0;
 
-	fd.fd = sleep_pipe_fd;
-	while (mili > INT_MAX && !(ret = poll(&fd, 1, mili))) {
+	fds[0].fd = sleep_pipe_fd;
+	fds[1].fd = m->stopPipe[0];  /* poll() ignores negative descriptors */
+	while (mili > INT_MAX && !(ret = poll(fds, 2, INT_MAX))) {
 		mili -= INT_MAX;
 	}
-	ret = ret ? ret : poll(&fd, 1, mili);
+	ret = ret ? ret : poll(fds, 2, mili);
 #else
 	struct timeval timeout;
 	fd_set set;
+	int max = sleep_pipe_fd;
 	if (!mili) return 0;
 
 	timeout.tv_sec  = mili / 1000;
@@ -241,7 +275,11 @@ int music_sleep(const struct music_module *restrict m, unsigned long mili) {
 
 	FD_ZERO(&set);
 	FD_SET(sleep_pipe_fd, &set);
-	ret = select(sleep_pipe_fd + 1, &set, 0, 0, &timeout);
+	if (m->stopPipe[0] >= 0) {
+		FD_SET(m->stopPipe[0], &set);
+		if (m->stopPipe[0] > max) max = m->stopPipe[0];
+	}
+	ret = select(max + 1, &set, 0, 0, &timeout);
 #endif
 
 	if (ret<0) {
@@ -282,9 +320,54 @@ int  music_run_once_check(void (*func)(void), void *restrict arg) {
 
 
 
-void  music_song(const struct music_module *restrict m,
-                 const struct music_song *restrict song) {
-	struct music_module *core = m->core;
+/**
+ * Writes song to capture file.  See trace_write().
+ *
+ * @param m module that raports song.
+ * @param cfg core configuration.
+ * @param song song to save.
+ */
+static void music_capture(const struct music_module *restrict m,
+                          struct config *restrict cfg,
+                          const struct music_song *restrict song)
+	__attribute__((nonnull));
+static void music_capture(const struct music_module *restrict m,
+                          struct config *restrict cfg,
+                          const struct music_song *restrict song) {
+	struct timeval tv;
+
+	pthread_mutex_lock(&cfg->capture_mutex);
+	if (cfg->captureFile) {
+		gettimeofday(&tv, 0);
+		if (!trace_write(cfg->captureFile, song,
+		                 tv.tv_sec * 1000000ull + tv.tv_usec,
+		                 &cfg->lastCapture)) {
+			music_log_errno(m, LOG_ERROR, "capture: write error; stopping");
+			fclose(cfg->captureFile);
+			cfg->captureFile = 0;
+		}
+	}
+	pthread_mutex_unlock(&cfg->capture_mutex);
+}
+
+
+
+/**
+ * Checks whether song is valid, logs it and writes it to capture
+ * file if one is opened.
+ *
+ * @param m module that raports song.
+ * @param cfg core configuration.
+ * @param song song to check.
+ * @return whether song should be put on song queue.
+ */
+static int   music_song_accept(const struct music_module *restrict m,
+                               struct config *restrict cfg,
+                               const struct music_song *restrict song)
+	__attribute__((nonnull));
+static int   music_song_accept(const struct music_module *restrict m,
+                               struct config *restrict cfg,
+                               const struct music_song *restrict song) {
 	const char *error = 0;
 
 	if (!song->title) {
@@ -299,14 +382,95 @@ void  music_song(const struct music_module *restrict m,
 	          OR(song->artist, "(null)"), OR(song->album , "(null)"),
 	          OR(song->title , "(null)"), song->length, OR(error, ""));
 #undef OR
-	if (error) return;
+	if (error) return 0;
+
+	if (cfg->captureFile) {
+		music_capture(m, cfg, song);
+	}
+	return 1;
+}
+
+
 
-	/* song dispatcher is either core->next or core->next->next */
-	m = core->next;
-	if (m->type==MUSIC_CACHE) m = m->next;
-	m->song.cache(m, song, 0);
+/**
+ * Returns song dispatcher.  It is either core->next or
+ * core->next->next if there is a cache module.
+ *
+ * @param core core module.
+ * @return song dispatcher.
+ */
+static inline const struct music_module *
+music_dispatcher(const struct music_module *restrict core) {
+	const struct music_module *m = core->next;
+	return m->type==MUSIC_CACHE ? m->next : m;
+}
+
+
+
+void  music_song(const struct music_module *restrict m,
+                 const struct music_song *restrict song) {
+	if (music_song_accept(m, m->core->data, song)) {
+		dispatcher_songs(music_dispatcher(m->core), &song, 1);
+	}
+}
+
+
+
+void  music_songs(const struct music_module *restrict m,
+                  const struct music_song *restrict songs, size_t count) {
+	const struct music_song *buffer[64], **valid = buffer;
+	struct config *const cfg = m->core->data;
+	size_t n = 0;
+
+	if (count > sizeof buffer / sizeof *buffer &&
+	    !(valid = malloc(count * sizeof *valid))) {
+		/* Not enough memory; fall back to one song at a time */
+		for (; count; --count, ++songs) {
+			music_song(m, songs);
+		}
+		return;
+	}
+
+	for (; count; --count, ++songs) {
+		if (music_song_accept(m, cfg, songs)) {
+			valid[n++] = songs;
+		}
+	}
+	if (n) {
+		dispatcher_songs(music_dispatcher(m->core), valid, n);
+	}
+
+	if (valid != buffer) {
+		free(valid);
+	}
+}
+
+
+
+size_t music_queue_length(const struct music_module *restrict m) {
+	return dispatcher_queued(music_dispatcher(m->core));
+}
+
+
+
+void  music_now_playing(const struct music_module *restrict m,
+                        const struct music_song *restrict song) {
+	if (song && !song->title) {
+		music_log(m, LOG_DEBUG, "ignoring now playing song: no title");
+		return;
+	}
+
+#define OR(x, y) ((x) ? (x) : (y))
+	if (song) {
+		music_log(m, LOG_DEBUG, "now playing: %s <%s> %s [%u sec]",
+		          OR(song->artist, "(null)"), OR(song->album , "(null)"),
+		          song->title, song->length);
+	} else {
+		music_log(m, LOG_DEBUG, "now playing: nothing");
+	}
+#undef OR
 
-	return;
+	dispatcher_now(music_dispatcher(m->core), m, song);
 }
 
 
@@ -323,6 +487,14 @@ struct music_module *music_init(enum music_module_type type,
 		m->song.send   = 0;
 		/* m->song.cache  = 0; */
 		m->retryCached = 0;
+		m->nowPlaying  = 0;
+		m->next        = 0;
+		m->core        = 0;
+		m->stopPipe[0] = -1;
+		m->stopPipe[1] = -1;
+		m->stopping    = 0;
+		m->name        = 0;
+		m->loglevel    = MUSIC_LOGLEVEL_UNSET;
 		m->data        = cfgSize ? m + 1 : 0;
 	}
 	return m;
@@ -22,6 +22,18 @@
 
 #include "music.h"
 
+#include <stdarg.h>
+#include <stdio.h>
+
+
+/**
+ * Value of music_module::loglevel meaning module's log level was not
+ * set and core's log level applies.  Core replaces it with core's
+ * log level once configuration has been read.
+ */
+#define MUSIC_LOGLEVEL_UNSET (~0u)
+
+
 
 /**
  * A core module configuration structure.
@@ -41,7 +53,189 @@ struct config {
 	unsigned logboth;           /**< A temporary internal variable. */
 	unsigned requireCache;      /**< Whether user specified that cache
                                    is required module. */
+
+	/**
+	 * Mutex protecting capture file and lastCapture.  Songs are
+	 * reported from many threads so they have to be serialised.
+	 */
+	pthread_mutex_t capture_mutex;
+
+	char    *capture;           /**< Capture file name. */
+	FILE    *captureFile;       /**< Opened capture file or NULL. */
+	unsigned long long lastCapture; /**< Arrival time of last captured
+                                       song; see trace_write(). */
+
+	unsigned logbuffer;         /**< Number of messages asynchronous
+                                   log may queue; zero if logging is
+                                   synchronous. */
+	unsigned logdrop;           /**< Whether to drop messages rather
+                                   then wait when asynchronous log's
+                                   queue is full. */
+	struct log_async *logasync; /**< Asynchronous log or NULL if
+                                   messages are written directly. */
+
+	char    *stats;             /**< Stats socket's path. */
+	char    *pidfile;           /**< File to write daemon's PID to. */
+	unsigned startTimeout;      /**< Number of seconds modules have to
+                                   start or zero to wait for them
+                                   indefinitely. */
+	unsigned dedupWindow;       /**< Number of seconds song dispatcher
+                                   remembers songs for to drop
+                                   duplicates or zero to keep them. */
+	struct music_metric *retryDuration; /**< Cache's retry duration
+                                   histogram or NULL if there is no
+                                   cache. */
 };
 
 
+
+/**
+ * A module linked into daemon's binary.
+ */
+struct music_static_module {
+	const char *name;  /**< Module's name as given in "module" line. */
+	/** Module's init() function. */
+	struct music_module *(*init)(const char *restrict name,
+	                             const char *restrict arg);
+};
+
+
+/**
+ * Modules linked into daemon's binary (see STATIC in Makefile)
+ * terminated with an element whose name is NULL.  Core looks modules
+ * up here before trying to load a shared object.
+ */
+extern const struct music_static_module music_static_modules[];
+
+
+
+/**
+ * Adds songs to song dispatcher's queue taking dispatcher's lock and
+ * waking its thread only once.  music_song() and music_songs() call
+ * it directly (rather then via dispatcher's music_module::song::cache
+ * method) so that the call may be inlined.
+ *
+ * @param m dispatcher module.
+ * @param songs array of pointers to songs.
+ * @param count number of songs.
+ */
+void dispatcher_songs(const struct music_module *restrict m,
+                      const struct music_song *restrict const *songs,
+                      size_t count)
+	__attribute__((nonnull));
+
+
+/**
+ * Returns number of songs waiting on song dispatcher's queue.  See
+ * music_queue_length().
+ *
+ * @param m dispatcher module.
+ * @return number of songs.
+ */
+size_t dispatcher_queued(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Replaces song given input module is now playing.  If previous
+ * update from the same module was not yet handled by dispatcher's
+ * thread it is dropped.  See music_now_playing().
+ *
+ * @param m dispatcher module.
+ * @param in input module which raports the song.
+ * @param song song or NULL.
+ */
+void dispatcher_now(const struct music_module *restrict m,
+                    const struct music_module *restrict in,
+                    const struct music_song *restrict song)
+	__attribute__((nonnull(1, 2)));
+
+
+/**
+ * Stops song dispatcher's thread without dropping songs waiting on
+ * its queue.  Songs reported while dispatcher is paused are queued.
+ * Output modules sleeping in music_sleep() are woken up so that the
+ * thread does not linger.  Used when reloading configuration so that
+ * output modules may be replaced.
+ *
+ * @param m dispatcher module.
+ */
+void dispatcher_pause(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Starts song dispatcher's thread again (or for the first time).
+ * List of output modules is read anew.
+ *
+ * @param m dispatcher module.
+ * @return whether starting succeed.
+ */
+int  dispatcher_resume(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+
+/**
+ * Starts thread exporting metrics on a unix socket.  Must not be
+ * called before daemonizing.  Thread finishes when core writes to
+ * sleep pipe.
+ *
+ * @param core core module.
+ * @param path socket's path.
+ * @return whether starting succeed.
+ */
+int  music_metrics_start(const struct music_module *restrict core,
+                         const char *restrict path)
+	__attribute__((nonnull));
+
+
+/**
+ * Waits for metrics exporting thread to finish and removes the
+ * socket.  Does nothing if music_metrics_start() was not called or
+ * failed.
+ */
+void music_metrics_stop(void);
+
+
+
+/**
+ * Starts asynchronous logging writer thread.  Must not be called
+ * before daemonizing.
+ *
+ * @param slots number of messages that may be queued; will be
+ *        rounded up to power of two.
+ * @param drop whether to drop messages rather then wait when queue
+ *        is full.
+ * @return asynchronous log or NULL on error.
+ */
+struct log_async *log_async_start(unsigned slots, int drop);
+
+
+/**
+ * Writes all queued messages and stops writer thread.  No message
+ * may be logged with given asynchronous log after this call.
+ *
+ * @param a asynchronous log.
+ */
+void log_async_stop(struct log_async *restrict a) __attribute__((nonnull));
+
+
+/**
+ * Queues a message.  If queue is full, waits or drops message
+ * depending on configuration.
+ *
+ * @param a asynchronous log.
+ * @param level message's level.
+ * @param name module's name.
+ * @param fmt message's format.
+ * @param ap format arguments; va_end() is called on it.
+ * @param error error string or NULL.
+ */
+void log_async_vlog(struct log_async *restrict a, unsigned level,
+                    const char *restrict name, const char *restrict fmt,
+                    va_list ap, const char *restrict error)
+	__attribute__((nonnull(1,3,4)));
+
+
 #endif
@@ -0,0 +1,219 @@
+/**
+ * "Listening to" daemon string intern table.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Table is split into shards each protected by its own mutex so that
+ * threads interning different strings rarely contend.  Each shard is
+ * a chained hash table which doubles when it gets more entries than
+ * buckets.  Reference counts are updated atomically and shard's mutex
+ * is taken only when the last reference may be dropped so that
+ * a string is never found by music_intern() while it is being freed.
+ */
+
+#include "music-int.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/** Number of shards; must be a power of two. */
+#define INTERN_SHARDS       16
+
+/** Initial number of buckets in a shard; must be a power of two. */
+#define INTERN_MIN_BUCKETS  64
+
+
+/**
+ * An interned string.
+ */
+struct intern {
+	struct intern *next;  /**< Next string in the same bucket. */
+	uint64_t hash;        /**< String's hash. */
+	size_t refs;          /**< Number of references. */
+	size_t length;        /**< String's length. */
+	char str[1];          /**< The string. */
+};
+
+
+/**
+ * A shard of intern table.
+ */
+struct intern_shard {
+	pthread_mutex_t mutex;    /**< Mutex protecting the shard. */
+	struct intern **buckets;  /**< Buckets or NULL if none allocated. */
+	size_t mask;              /**< Number of buckets minus one. */
+	size_t count;             /**< Number of strings in the shard. */
+} __attribute__((aligned(64)));
+
+
+/** The intern table. */
+static struct intern_shard intern_shards[INTERN_SHARDS] = {
+#define S { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 }
+	S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S
+#undef S
+};
+
+
+
+/**
+ * Returns interned string's header.
+ *
+ * @param str interned string.
+ * @return header.
+ */
+static inline struct intern *intern_of(const char *restrict str) {
+	return (struct intern *)(str - offsetof(struct intern, str));
+}
+
+
+/**
+ * Returns shard given hash belongs to.  Uses hash's top bits since
+ * bottom ones select bucket.
+ *
+ * @param hash string's hash.
+ * @return shard.
+ */
+static inline struct intern_shard *intern_shard(uint64_t hash) {
+	return intern_shards + (hash >> 60) % INTERN_SHARDS;
+}
+
+
+/**
+ * Doubles number of buckets in a shard (or allocates initial buckets).
+ * Must be called with shard's mutex locked.  On error shard is left
+ * unchanged.
+ *
+ * @param shard shard to grow.
+ * @return whether shard has any buckets.
+ */
+static int  intern_grow(struct intern_shard *restrict shard)
+	__attribute__((nonnull));
+static int  intern_grow(struct intern_shard *restrict shard) {
+	const size_t old = shard->buckets ? shard->mask + 1 : 0;
+	const size_t size = old ? old * 2 : INTERN_MIN_BUCKETS;
+	struct intern **const buckets = calloc(size, sizeof *buckets);
+	struct intern *s, *next;
+	size_t i;
+
+	if (!buckets) {
+		return old != 0;
+	}
+
+	for (i = 0; i < old; ++i) {
+		for (s = shard->buckets[i]; s; s = next) {
+			next = s->next;
+			s->next = buckets[s->hash & (size - 1)];
+			buckets[s->hash & (size - 1)] = s;
+		}
+	}
+
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->mask = size - 1;
+	return 1;
+}
+
+
+
+const char *music_intern(const char *restrict str) {
+	const size_t length = strlen(str);
+	uint64_t hash = 14695981039346656037ull;
+	struct intern_shard *shard;
+	struct intern *s, **bucket;
+	size_t i;
+
+	for (i = 0; i < length; ++i) {
+		hash = (hash ^ (unsigned char)str[i]) * 1099511628211ull;
+	}
+	shard = intern_shard(hash);
+
+	pthread_mutex_lock(&shard->mutex);
+
+	if (shard->count >= (shard->buckets ? shard->mask + 1 : 0) &&
+	    !intern_grow(shard)) {
+		pthread_mutex_unlock(&shard->mutex);
+		return 0;
+	}
+
+	bucket = shard->buckets + (hash & shard->mask);
+	for (s = *bucket; s; s = s->next) {
+		if (s->hash == hash && s->length == length &&
+		    !memcmp(s->str, str, length)) {
+			__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&shard->mutex);
+			return s->str;
+		}
+	}
+
+	if ((s = malloc(offsetof(struct intern, str) + length + 1))) {
+		s->hash   = hash;
+		s->refs   = 1;
+		s->length = length;
+		memcpy(s->str, str, length + 1);
+		s->next = *bucket;
+		*bucket = s;
+		++shard->count;
+	}
+
+	pthread_mutex_unlock(&shard->mutex);
+	return s ? s->str : 0;
+}
+
+
+
+const char *music_intern_ref(const char *restrict str) {
+	__atomic_add_fetch(&intern_of(str)->refs, 1, __ATOMIC_RELAXED);
+	return str;
+}
+
+
+
+void music_intern_release(const char *restrict str) {
+	struct intern *const s = str ? intern_of(str) : 0;
+	struct intern_shard *shard;
+	struct intern **p;
+	size_t refs;
+
+	if (!s) return;
+
+	/* Fast path: this is not the last reference */
+	refs = __atomic_load_n(&s->refs, __ATOMIC_RELAXED);
+	while (refs > 1) {
+		if (__atomic_compare_exchange_n(&s->refs, &refs, refs - 1, 1,
+		                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return;
+		}
+	}
+
+	/* It may be the last reference; music_intern() cannot find the
+	   string while we hold shard's mutex. */
+	shard = intern_shard(s->hash);
+	pthread_mutex_lock(&shard->mutex);
+	if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_unlock(&shard->mutex);
+		return;
+	}
+
+	for (p = shard->buckets + (s->hash & shard->mask); *p != s;
+	     p = &(*p)->next);
+	*p = s->next;
+	--shard->count;
+	pthread_mutex_unlock(&shard->mutex);
+	free(s);
+}
@@ -0,0 +1,366 @@
+/**
+ * "Listening to" daemon asynchronous logging.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Messages are formatted by the reporting thread directly into a slot
+ * of a bounded multi-producer single-consumer ring (see Dmitry
+ * Vyukov's bounded queue) and a writer thread writes them to stderr
+ * in batches with a single writev() call.  Reporting threads never
+ * take a lock unless the ring is full and overflow policy is to
+ * block.
+ */
+
+#include "music-int.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+
+/** Size of text stored inline in a slot.  Longer messages are
+    allocated dynamically. */
+#define LOG_SLOT_TEXT  232
+
+/** Maximal number of messages written with a single writev(). */
+#define LOG_BATCH      64
+
+
+/**
+ * A single message in the ring.
+ */
+struct log_slot {
+	size_t seq;                 /**< Slot's sequence number. */
+	size_t len;                 /**< Message's length. */
+	char  *big;                 /**< Dynamically allocated message or
+	                                 NULL if message is in text. */
+	char   text[LOG_SLOT_TEXT]; /**< Message's text. */
+};
+
+
+/**
+ * Asynchronous logging state.
+ */
+struct log_async {
+	size_t head;                /**< Next slot to reserve. */
+	char   pad[64 - sizeof(size_t)]; /**< Keeps head in its own cache
+	                                      line. */
+	size_t tail;                /**< Next slot to write (writer only). */
+	size_t mask;                /**< Number of slots minus one. */
+	struct log_slot *slots;     /**< The ring. */
+
+	pthread_t       thread;     /**< Writer thread. */
+	pthread_mutex_t mutex;      /**< Mutex for the conditions. */
+	pthread_cond_t  notEmpty;   /**< Signaled when writer may continue. */
+	pthread_cond_t  notFull;    /**< Signaled when slots are freed. */
+	int             waiting;    /**< Whether writer waits on notEmpty. */
+	int             blocked;    /**< Number of threads waiting on notFull. */
+	int             running;    /**< Whether writer should keep running. */
+	int             drop;       /**< Whether to drop messages when ring is
+	                                 full rather then wait. */
+	unsigned long   dropped;    /**< Number of messages dropped. */
+};
+
+
+
+/**
+ * Writer thread function.
+ *
+ * @param ptr pointer to log_async structure.
+ * @return return value shall be ignored.
+ */
+static void *log_async_run(void *restrict ptr) __attribute__((nonnull));
+
+
+/**
+ * Reserves a slot.
+ *
+ * @param a asynchronous logging state.
+ * @param posp where to save reserved position.
+ * @return reserved slot or NULL if message should be dropped.
+ */
+static struct log_slot *log_async_reserve(struct log_async *restrict a,
+                                          size_t *restrict posp)
+	__attribute__((nonnull));
+
+
+/**
+ * Formats date into buffer caching result for a given second in
+ * a thread local buffer.
+ *
+ * @param buf buffer at least 23 bytes long.
+ * @return number of characters written.
+ */
+static size_t log_date(char *restrict buf) __attribute__((nonnull));
+
+
+
+struct log_async *log_async_start(unsigned slots, int drop) {
+	struct log_async *a;
+	size_t n = 16, i;
+
+	while (n < slots && n < (1u << 20)) n <<= 1;
+
+	if (!(a = malloc(sizeof *a))) return 0;
+	if (!(a->slots = malloc(n * sizeof *a->slots))) {
+		free(a);
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		a->slots[i].seq = i;
+	}
+	a->head    = 0;
+	a->tail    = 0;
+	a->mask    = n - 1;
+	a->waiting = 0;
+	a->blocked = 0;
+	a->running = 1;
+	a->drop    = drop;
+	a->dropped = 0;
+	pthread_mutex_init(&a->mutex, 0);
+	pthread_cond_init(&a->notEmpty, 0);
+	pthread_cond_init(&a->notFull, 0);
+
+	if (pthread_create(&a->thread, 0, log_async_run, a)) {
+		free(a->slots);
+		free(a);
+		return 0;
+	}
+	return a;
+}
+
+
+
+void log_async_stop(struct log_async *restrict a) {
+	pthread_mutex_lock(&a->mutex);
+	__atomic_store_n(&a->running, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&a->notEmpty);
+	pthread_mutex_unlock(&a->mutex);
+	pthread_join(a->thread, 0);
+
+	pthread_cond_destroy(&a->notFull);
+	pthread_cond_destroy(&a->notEmpty);
+	pthread_mutex_destroy(&a->mutex);
+	free(a->slots);
+	free(a);
+}
+
+
+
+static struct log_slot *log_async_reserve(struct log_async *restrict a,
+                                          size_t *restrict posp) {
+	size_t pos = __atomic_load_n(&a->head, __ATOMIC_RELAXED);
+	struct log_slot *slot;
+
+	for (;;) {
+		ptrdiff_t diff;
+		slot = a->slots + (pos & a->mask);
+		diff = (ptrdiff_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+			(ptrdiff_t)pos;
+
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&a->head, &pos, pos + 1, 1,
+			                                 __ATOMIC_RELAXED,
+			                                 __ATOMIC_RELAXED)) {
+				*posp = pos;
+				return slot;
+			}
+		} else if (diff > 0) {
+			pos = __atomic_load_n(&a->head, __ATOMIC_RELAXED);
+		} else if (a->drop) {
+			__atomic_add_fetch(&a->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else {
+			/* Ring is full; wait for writer */
+			pthread_mutex_lock(&a->mutex);
+			__atomic_add_fetch(&a->blocked, 1, __ATOMIC_SEQ_CST);
+			slot = a->slots + (pos & a->mask);
+			if ((ptrdiff_t)__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) -
+			    (ptrdiff_t)pos < 0) {
+				pthread_cond_signal(&a->notEmpty);
+				pthread_cond_wait(&a->notFull, &a->mutex);
+			}
+			__atomic_sub_fetch(&a->blocked, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&a->mutex);
+			pos = __atomic_load_n(&a->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+
+void log_async_vlog(struct log_async *restrict a, unsigned level,
+                    const char *restrict name, const char *restrict fmt,
+                    va_list ap, const char *restrict error) {
+	static const char levelChars[] = "FfEeWwNnDd";
+	char head[80];
+	size_t headLen, pos;
+	struct log_slot *const slot = log_async_reserve(a, &pos);
+	int len;
+
+	if (!slot) {
+		va_end(ap);
+		return;
+	}
+
+	headLen = log_date(head);
+	headLen += snprintf(head + headLen, sizeof head - headLen, "(%c) %s: ",
+	                    levelChars[level / 2], name);
+	if (headLen >= sizeof head) headLen = sizeof head - 1;
+
+	/* Try to fit in the slot */
+	{
+		va_list ap2;
+		va_copy(ap2, ap);
+		memcpy(slot->text, head, headLen);
+		len = vsnprintf(slot->text + headLen, LOG_SLOT_TEXT - headLen, fmt, ap2);
+		va_end(ap2);
+	}
+	if (len < 0) len = 0;
+	slot->len = headLen + len + (error ? strlen(error) + 2 : 0) + 1;
+	slot->big = 0;
+
+	if (slot->len <= LOG_SLOT_TEXT) {
+		if (error) sprintf(slot->text + headLen + len, ": %s", error);
+		slot->text[slot->len - 1] = '\n';
+	} else if ((slot->big = malloc(slot->len + 1))) {
+		memcpy(slot->big, head, headLen);
+		vsnprintf(slot->big + headLen, len + 1, fmt, ap);
+		if (error) sprintf(slot->big + headLen + len, ": %s", error);
+		slot->big[slot->len - 1] = '\n';
+	} else {
+		/* Truncate */
+		slot->len = LOG_SLOT_TEXT;
+		slot->text[LOG_SLOT_TEXT - 1] = '\n';
+	}
+	va_end(ap);
+
+	/* Publish and wake writer if it's sleeping */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&a->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&a->mutex);
+		pthread_cond_signal(&a->notEmpty);
+		pthread_mutex_unlock(&a->mutex);
+	}
+}
+
+
+
+static size_t log_date(char *restrict buf) {
+	static __thread time_t cachedTime = (time_t)-1;
+	static __thread char cached[24];
+	const time_t t = time(0);
+
+	if (t != cachedTime) {
+		struct tm tm;
+		if (!gmtime_r(&t, &tm) ||
+		    !strftime(cached, sizeof cached, "[%Y/%m/%d %H:%M:%S] ", &tm)) {
+			*cached = 0;
+		}
+		cachedTime = t;
+	}
+
+	strcpy(buf, cached);
+	return strlen(cached);
+}
+
+
+
+static void *log_async_run(void *restrict ptr) {
+	struct log_async *const a = ptr;
+	struct iovec iov[LOG_BATCH];
+	unsigned long dropped;
+
+	for (;;) {
+		const int running = __atomic_load_n(&a->running, __ATOMIC_SEQ_CST);
+		size_t n = 0, i, off;
+
+		/* Collect ready messages */
+		while (n < LOG_BATCH) {
+			struct log_slot *const slot = a->slots + ((a->tail + n) & a->mask);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) !=
+			    a->tail + n + 1) {
+				break;
+			}
+			iov[n].iov_base = slot->big ? slot->big : slot->text;
+			iov[n].iov_len  = slot->len;
+			++n;
+		}
+
+		/* Write them */
+		for (i = 0; i < n; ) {
+			ssize_t r = writev(2, iov + i, n - i);
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			while (i < n && (size_t)r >= iov[i].iov_len) {
+				r -= iov[i++].iov_len;
+			}
+			if (i < n) {
+				iov[i].iov_base = (char *)iov[i].iov_base + r;
+				iov[i].iov_len -= r;
+			}
+		}
+
+		/* Release slots */
+		for (off = 0; off < n; ++off, ++a->tail) {
+			struct log_slot *const slot = a->slots + (a->tail & a->mask);
+			free(slot->big);
+			__atomic_store_n(&slot->seq, a->tail + a->mask + 1,
+			                 __ATOMIC_SEQ_CST);
+		}
+		if (n && __atomic_load_n(&a->blocked, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&a->mutex);
+			pthread_cond_broadcast(&a->notFull);
+			pthread_mutex_unlock(&a->mutex);
+		}
+
+		/* Report dropped messages */
+		if ((dropped = __atomic_exchange_n(&a->dropped, 0, __ATOMIC_RELAXED))) {
+			char buf[80];
+			size_t len = log_date(buf);
+			len += snprintf(buf + len, sizeof buf - len,
+			                "(W) log: %lu messages dropped\n", dropped);
+			write(2, buf, len);
+		}
+
+		if (n) continue;
+		if (!running) break;
+
+		/* Wait for more */
+		pthread_mutex_lock(&a->mutex);
+		__atomic_store_n(&a->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&a->slots[a->tail & a->mask].seq,
+		                    __ATOMIC_SEQ_CST) != a->tail + 1 &&
+		    __atomic_load_n(&a->running, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&a->notEmpty, &a->mutex);
+		}
+		__atomic_store_n(&a->waiting, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&a->mutex);
+	}
+
+	return 0;
+}
@@ -0,0 +1,366 @@
+/**
+ * "Listening to" daemon metrics registry.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each client connecting to stats socket gets a dump of all metrics
+ * in Prometheus text exposition format and the connection is closed,
+ * ie.:
+ *
+ *   # TYPE music_songs_queued counter
+ *   music_songs_queued{module="dispatcher"} 42
+ *   # TYPE music_request_duration_us histogram
+ *   music_request_duration_us_bucket{module="out_http",le="1"} 0
+ *   ...
+ *   music_request_duration_us_bucket{module="out_http",le="+Inf"} 7
+ *   music_request_duration_us_sum{module="out_http"} 81234
+ *   music_request_duration_us_count{module="out_http"} 7
+ */
+
+#include "music-int.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef HAVE_POLL
+# include <poll.h>
+#else
+# include <sys/select.h>
+# include <sys/types.h>
+#endif
+
+
+/** Number of histogram buckets.  Bucket n counts values not greater
+    then 2^n, the last one counts all greater values. */
+#define METRIC_BUCKETS 41
+
+/** Number of miliseconds stats socket is not watched for after running
+    out of file descriptors. */
+#define ACCEPT_BACKOFF 1000
+
+
+/**
+ * A metric.
+ */
+struct music_metric {
+	long long value;            /**< Counter's or gauge's value or
+	                                 histogram's number of observations. */
+	unsigned long long sum;     /**< Sum of observed values. */
+	unsigned long long *buckets;/**< Histogram's buckets or NULL. */
+	struct music_metric *next;  /**< Next metric in registry. */
+	char *module;               /**< Module's name. */
+	char *name;                 /**< Metric's name. */
+	enum music_metric_type type;/**< Metric's type. */
+} __attribute__((aligned(64)));
+
+
+/** Protects registry.  Updates do not take it. */
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** List of registered metrics grouped by name. */
+static struct music_metric *metrics_first = 0;
+
+/** Metric returned when registration fails. */
+static struct music_metric metrics_dummy;
+
+
+/** Stats socket's path or NULL. */
+static char *metrics_path = 0;
+
+/** Stats socket. */
+static int metrics_fd = -1;
+
+/** Stats thread. */
+static pthread_t metrics_thread;
+
+
+
+/**
+ * Stats thread function.
+ *
+ * @param ptr core module.
+ * @return return value shall be ignored.
+ */
+static void *metrics_run(void *restrict ptr) __attribute__((nonnull));
+
+
+/**
+ * Writes all metrics to given stream.
+ *
+ * @param fp stream to write metrics to.
+ */
+static void metrics_dump(FILE *restrict fp) __attribute__((nonnull));
+
+
+
+struct music_metric *music_metric(const struct music_module *restrict m,
+                                  const char *restrict name,
+                                  enum music_metric_type type) {
+	struct music_metric *metric, **p, **after = 0;
+
+	pthread_mutex_lock(&metrics_mutex);
+
+	for (p = &metrics_first; *p; p = &(*p)->next) {
+		if (strcmp((*p)->name, name)) {
+			if (after) break;
+			continue;
+		}
+		after = &(*p)->next;
+		if (!strcmp((*p)->module, m->name) && (*p)->type == type) {
+			metric = *p;
+			goto done;
+		}
+	}
+
+	metric = calloc(1, sizeof *metric);
+	if (!metric) {
+		metric = &metrics_dummy;
+		goto done;
+	}
+	if (type == MUSIC_HISTOGRAM &&
+	    !(metric->buckets = calloc(METRIC_BUCKETS, sizeof *metric->buckets))) {
+		free(metric);
+		metric = &metrics_dummy;
+		goto done;
+	}
+	metric->module = music_strdup(m->name ? m->name : "");
+	metric->name   = music_strdup(name);
+	metric->type   = type;
+
+	/* Keep metrics with the same name together */
+	p = after ? after : p;
+	metric->next = *p;
+	*p = metric;
+
+ done:
+	pthread_mutex_unlock(&metrics_mutex);
+	return metric;
+}
+
+
+
+void music_metric_add(struct music_metric *restrict metric, long long value) {
+	__atomic_add_fetch(&metric->value, value, __ATOMIC_RELAXED);
+}
+
+
+
+void music_metric_set(struct music_metric *restrict metric, long long value) {
+	__atomic_store_n(&metric->value, value, __ATOMIC_RELAXED);
+}
+
+
+
+void music_metric_observe(struct music_metric *restrict metric,
+                          unsigned long long value) {
+	unsigned bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+	if (!metric->buckets) return;
+	if (bucket >= METRIC_BUCKETS) bucket = METRIC_BUCKETS - 1;
+	__atomic_add_fetch(metric->buckets + bucket, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&metric->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&metric->value, 1, __ATOMIC_RELAXED);
+}
+
+
+
+static void metrics_dump(FILE *restrict fp) {
+	static const char *const types[] = { "counter", "gauge", "histogram" };
+	const struct music_metric *metric, *prev = 0;
+
+	pthread_mutex_lock(&metrics_mutex);
+	for (metric = metrics_first; metric; prev = metric, metric = metric->next) {
+		const char *const name = metric->name, *const module = metric->module;
+
+		if (!prev || strcmp(prev->name, name)) {
+			fprintf(fp, "# TYPE music_%s %s\n", name, types[metric->type]);
+		}
+
+		if (metric->type != MUSIC_HISTOGRAM) {
+			fprintf(fp, "music_%s{module=\"%s\"} %lld\n", name, module,
+			        __atomic_load_n(&metric->value, __ATOMIC_RELAXED));
+		} else {
+			unsigned long long total = 0;
+			unsigned i;
+			for (i = 0; i < METRIC_BUCKETS - 1; ++i) {
+				total += __atomic_load_n(metric->buckets + i, __ATOMIC_RELAXED);
+				fprintf(fp, "music_%s_bucket{module=\"%s\",le=\"%llu\"} %llu\n",
+				        name, module, 1ull << i, total);
+			}
+			total += __atomic_load_n(metric->buckets + i, __ATOMIC_RELAXED);
+			fprintf(fp, "music_%s_bucket{module=\"%s\",le=\"+Inf\"} %llu\n"
+			        "music_%s_sum{module=\"%s\"} %llu\n"
+			        "music_%s_count{module=\"%s\"} %llu\n",
+			        name, module, total,
+			        name, module,
+			        __atomic_load_n(&metric->sum, __ATOMIC_RELAXED),
+			        name, module, total);
+		}
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+}
+
+
+
+int  music_metrics_start(const struct music_module *restrict core,
+                         const char *restrict path) {
+	struct sockaddr_un addr;
+	size_t len = strlen(path);
+
+	if (len >= sizeof addr.sun_path) {
+		music_log(core, LOG_ERROR, "stats: %s: path too long", path);
+		return 0;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path, len + 1);
+
+	if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		music_log_errno(core, LOG_ERROR, "stats: socket");
+		return 0;
+	}
+
+	unlink(path);
+	if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof addr) ||
+	    listen(metrics_fd, 16)) {
+		music_log_errno(core, LOG_ERROR, "stats: %s", path);
+		goto error;
+	}
+	chmod(path, 0600);
+
+	metrics_path = music_strdup(path);
+	if (pthread_create(&metrics_thread, 0, metrics_run, (void*)core)) {
+		music_log_errno(core, LOG_ERROR, "stats: pthread_create");
+		free(metrics_path);
+		metrics_path = 0;
+		unlink(path);
+		goto error;
+	}
+	return 1;
+
+ error:
+	close(metrics_fd);
+	metrics_fd = -1;
+	return 0;
+}
+
+
+
+void music_metrics_stop(void) {
+	if (!metrics_path) return;
+	pthread_join(metrics_thread, 0);
+	close(metrics_fd);
+	unlink(metrics_path);
+	free(metrics_path);
+	metrics_path = 0;
+	metrics_fd = -1;
+}
+
+
+
+static void *metrics_run(void *restrict ptr) {
+	const struct music_module *const core = ptr;
+	int backoff = 0, acceptLogged = 0;
+
+	while (music_running) {
+		struct timeval timeout = { 1, 0 };
+		char *buf;
+		size_t len;
+		FILE *fp;
+		int fd, ret;
+
+		/* After running out of file descriptors stats socket is not
+		   watched for a while rather than spin */
+#ifdef HAVE_POLL
+		struct pollfd fds[2] = { { 0, POLLIN, 0 }, { 0, POLLIN, 0 } };
+		fds[0].fd = sleep_pipe_fd;
+		fds[1].fd = backoff ? -1 : metrics_fd;  /* -1 is ignored */
+		ret = poll(fds, 2, backoff ? ACCEPT_BACKOFF : -1);
+#else
+		struct timeval wait = {
+			ACCEPT_BACKOFF / 1000, (ACCEPT_BACKOFF % 1000) * 1000
+		};
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(sleep_pipe_fd, &set);
+		if (!backoff) {
+			FD_SET(metrics_fd, &set);
+		}
+		ret = select((sleep_pipe_fd > metrics_fd ? sleep_pipe_fd
+		                                         : metrics_fd) + 1,
+		             &set, 0, 0, backoff ? &wait : 0);
+#endif
+
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+#ifdef HAVE_POLL
+			music_log_errno(core, LOG_ERROR, "stats: poll");
+#else
+			music_log_errno(core, LOG_ERROR, "stats: select");
+#endif
+			break;
+		}
+		if (!ret) {
+			backoff = 0;
+			continue;
+		}
+#ifdef HAVE_POLL
+		if (fds[0].revents) break;
+		if (!fds[1].revents) continue;
+#else
+		if (FD_ISSET(sleep_pipe_fd, &set)) break;
+		if (!FD_ISSET(metrics_fd, &set)) continue;
+#endif
+
+		if ((fd = accept(metrics_fd, 0, 0)) < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				if (!acceptLogged) {
+					music_log_errno(core, LOG_WARNING, "stats: accept");
+					acceptLogged = 1;
+				}
+				backoff = 1;
+			}
+			continue;
+		}
+		acceptLogged = 0;
+
+		/* Don't let a client which does not read block us forever */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+		if ((fp = open_memstream(&buf, &len))) {
+			size_t off = 0;
+			ssize_t r;
+			metrics_dump(fp);
+			fclose(fp);
+			while (off < len &&
+			       ((r = send(fd, buf + off, len - off, MSG_NOSIGNAL)) > 0 ||
+			        (r < 0 && errno == EINTR))) {
+				off += r > 0 ? (size_t)r : 0;
+			}
+			free(buf);
+		}
+		close(fd);
+	}
+
+	return 0;
+}
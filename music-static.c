@@ -0,0 +1,43 @@
+/**
+ * "Listening to" daemon modules linked into daemon's binary.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "music-int.h"
+
+
+#ifdef MUSIC_STATIC
+
+/* MUSIC_STATIC is a list of MODULE(<module>) entries generated from
+   STATIC_MODULES.  Each module's init() is renamed to <module>_init
+   when module is compiled to be linked in (see Makefile). */
+#define MODULE(name) \
+	struct music_module *name##_init(const char *restrict name, \
+	                                 const char *restrict arg);
+MUSIC_STATIC
+#undef MODULE
+
+#endif
+
+
+const struct music_static_module music_static_modules[] = {
+#ifdef MUSIC_STATIC
+#define MODULE(name) { #name, name##_init },
+	MUSIC_STATIC
+#undef MODULE
+#endif
+	{ 0, 0 }
+};
@@ -17,11 +17,14 @@
  */
 
 #include "music-int.h"
+#include "trace.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,20 +47,156 @@ static int  config_line(const struct music_module *restrict m,
 	__attribute__((nonnull(1)));
 
 
+/**
+ * Configuration of a loaded module as read from configuration files.
+ * When reloading configuration it is used to tell which modules have
+ * changed.
+ */
+struct module_source {
+	struct module_source *next;   /**< Source of previously loaded
+	                                   module. */
+	struct music_module *module;  /**< The module. */
+	char *text;                   /**< Module's "module" line and its
+	                                   options (except for name and
+	                                   loglevel) each followed by new
+	                                   line character. */
+	size_t length;                /**< Length of text. */
+	struct module_source *match;  /**< Used when reloading: source of
+	                                   running module with identical
+	                                   configuration or NULL. */
+	int state;                    /**< Used when reloading: for running
+	                                   modules 0 if module was removed,
+	                                   1 if it changed and 2 if it is
+	                                   kept. */
+};
+
+
+/**
+ * Reads configuration files.  Modules are loaded and inserted after
+ * core module and their sources are added to *sources_.
+ *
+ * @param core core module.
+ * @param sources_ list to add sources of loaded modules to.
+ * @param count number of files.
+ * @param files file names; "-" stands for standard input.
+ * @return zero on error, non-zero on success.
+ */
+static int  read_config(struct music_module *restrict core,
+                        struct module_source *restrict *restrict sources_,
+                        int count, char **files)
+	__attribute__((nonnull));
+
+
 /**
  * Parses signle configuration line.  It executes configuration's conf
  * method (music_module::conf) or loads module if option was "module".
  * It stores which module configuration it's reading now in *m_.  When
  * executed for the first time (or when a new configuration file is
  * being read ) m_ should be initialised to point to pointer to core
- * module.
+ * module.  Module's line and options are recorded in its source
+ * which is the first element of *sources_.
  *
  * @param buf line from configuration file.
  * @param m_ pointer to module being configured now.
+ * @param sources_ list to add sources of loaded modules to.
  * @return zero on error, non-zero on success.
  */
 static int  parse_line(char *restrict buf,
-                       struct music_module *restrict *restrict m_)
+                       struct music_module *restrict *restrict m_,
+                       struct module_source *restrict *restrict sources_)
+	__attribute__((nonnull));
+
+
+/**
+ * Appends a line to module's source.
+ *
+ * @param s module's source.
+ * @param option option (or module name).
+ * @param argument option's argument.
+ */
+static void source_append(struct module_source *restrict s,
+                          const char *restrict option,
+                          const char *restrict argument)
+	__attribute__((nonnull));
+
+
+/**
+ * Starts module.  Creates input or output module's stop pipe (see
+ * music_stop_fd()) prior to calling its start method.
+ *
+ * @param m module to start.
+ * @return whether starting succeed.
+ */
+static int  start_module(struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Starts modules at once, each in its own thread, and waits till all
+ * of them finish starting or till deadline passes.  Modules which did
+ * not finish starting in time are left running in the background.
+ *
+ * @param modules modules to start.
+ * @param results array to save results in: 1 if module started, 0 if
+ *                it failed to start and -1 if it did not finish
+ *                starting in time.
+ * @param count number of modules.
+ * @param timeout deadline in seconds or zero to wait indefinitely.
+ */
+static void start_modules(struct music_module *restrict *restrict modules,
+                          int *restrict results, size_t count,
+                          unsigned timeout)
+	__attribute__((nonnull));
+
+
+/**
+ * Starts modules following given one, ie. song dispatcher, output and
+ * input modules.  Dispatcher and output modules are started at once,
+ * then input modules are started at once.  Failures are logged and
+ * modules which were not started are removed from the list.
+ *
+ * @param last module after which modules to start are.
+ * @param timeout deadline for each group in seconds or zero.
+ * @return 1 on success, 0 if a module failed to start or -1 if
+ *         a signal was received.
+ */
+static int  start_rest(struct music_module *restrict last, unsigned timeout)
+	__attribute__((nonnull));
+
+
+/**
+ * Stops a single module while rest of the modules keep running.
+ *
+ * @param m module to stop.
+ */
+static void stop_module(struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Frees module and removes it's source from sources list (if it is
+ * there).  Module must not be running.
+ *
+ * @param m module to free.
+ */
+static void free_module(struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
+/**
+ * Reloads configuration.  Configuration files are read again and
+ * modules whose configuration has changed are restarted.  Modules
+ * which were removed are stopped, new modules are started and the
+ * rest keeps running.  Song dispatcher keeps its queue so no song is
+ * lost.  On error current configuration is kept.
+ *
+ * @param core core module.
+ * @param cwd directory configuration was read in or empty string.
+ * @param count number of configuration files.
+ * @param files configuration file names.
+ */
+static void reload_config(struct music_module *restrict core,
+                          const char *restrict cwd, int count, char **files)
 	__attribute__((nonnull));
 
 
@@ -77,6 +216,12 @@ volatile sig_atomic_t music_running = 1;
 int sleep_pipe_fd;
 
 
+/**
+ * Sources of all loaded modules.
+ */
+static struct module_source *sources = 0;
+
+
 
 /**
  * Signal number application recieved or 0 if none.
@@ -91,6 +236,26 @@ static volatile sig_atomic_t sig = 0;
  */
 static void got_sig(int signum);
 
+/**
+ * Whether SIGHUP was recieved and configuration should be reloaded.
+ */
+static volatile sig_atomic_t reload = 0;
+
+/**
+ * Pipe signal handlers write to so that main loop, which reads from
+ * it, notices signals recieved while it was busy reloading
+ * configuration as well as those recieved by other threads.  Write
+ * end is non-blocking.
+ */
+static int signal_pipe[2] = { -1, -1 };
+
+/**
+ * A callback function for SIGHUP.  Sets reload flag.
+ *
+ * @param signum signal number.
+ */
+static void got_hup(int signum);
+
 /**
  * A callback function for signals to ignore.  Does completly nothing.
  *
@@ -105,18 +270,24 @@ int main(int argc, char **argv) {
 	struct config cfg = {
 		PTHREAD_MUTEX_INITIALIZER,
 		0, LOG_NOTICE, 0,
-		0
+		0,
+		PTHREAD_MUTEX_INITIALIZER,
+		0, 0, 0,
+		0, 0, 0,
+		0, 0, 0, 0, 0
 	};
 	struct music_module core = {
 		-1,
 		0, 0, 0,
 		config_line,
-		{ 0 }, 0,
+		{ 0 }, 0, 0,
 		0, 0,
+		{ -1, -1 }, 0,
 		(char*)"core",
+		MUSIC_LOGLEVEL_UNSET,
 		0
 	}, *m;
-	char *ch;
+	char *ch, cwd[4096];
 	int i, returnValue = 0, pipe_fds[2];
 
 	core.core = &core;
@@ -144,25 +315,13 @@ int main(int argc, char **argv) {
 		argc = 2;
 	}
 
-	for (i = 1; i < argc; ++i) {
-		FILE *fp = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
-		char buf[1026];
-
-		if (!fp) {
-			music_log_errno(&core, LOG_FATAL, "open: %s", argv[i]);
-			return 1;
-		}
-
-		m = &core;
-		if (ch) *ch = 0;
-		while (fgets(buf, sizeof buf, fp)) {
-			int result = !parse_line(buf, &m);
-			if (result) return result;
-		}
+	if (!read_config(&core, &sources, argc - 1, argv + 1)) {
+		return 1;
+	}
 
-		if (fp!=stdin) {
-			fclose(fp);
-		}
+	/* Remember where we are so that configuration may be reloaded */
+	if (!getcwd(cwd, sizeof cwd)) {
+		*cwd = 0;
 	}
 
 	struct music_module *dispatcher_init();
@@ -180,6 +339,12 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	for (m = &core; m; m = m->next) {
+		if (m->loglevel == MUSIC_LOGLEVEL_UNSET) {
+			m->loglevel = cfg.loglevel;
+		}
+	}
+
 
 
 	/***** Open log file *****/
@@ -194,6 +359,17 @@ int main(int argc, char **argv) {
 		close(i);
 	}
 
+	/***** Open capture file *****/
+	if (cfg.capture && *cfg.capture) {
+		cfg.captureFile = fopen(cfg.capture, "wb");
+		/* Flush now or else forked processes would write header again */
+		if (!cfg.captureFile || !trace_write_header(cfg.captureFile) ||
+		    fflush(cfg.captureFile)) {
+			music_log_errno(&core, LOG_FATAL, "open: %s", cfg.capture);
+			return 1;
+		}
+	}
+
 	music_log(&core, LOG_NOTICE, "starting");
 	cfg.logboth = 1;
 
@@ -221,7 +397,7 @@ int main(int argc, char **argv) {
 	cfg.logboth = 0;
 	i = sysconf(_SC_OPEN_MAX);
 	while (--i > 2) {
-		close(i);
+		if (!cfg.captureFile || i!=fileno(cfg.captureFile)) close(i);
 	}
 	close(0);
 	open("/dev/null", O_RDWR); /* stdin  is /dev/null */
@@ -236,9 +412,44 @@ int main(int argc, char **argv) {
 	}
 	sleep_pipe_fd = pipe_fds[0];
 
+	if (pipe(signal_pipe) ||
+	    fcntl(signal_pipe[1], F_SETFL,
+	          fcntl(signal_pipe[1], F_GETFL) | O_NONBLOCK) < 0) {
+		music_log_errno(&core, LOG_FATAL, "pipe");
+		return 1;
+	}
+
+
+	/***** Write PID file *****/
+	if (cfg.pidfile && *cfg.pidfile) {
+		FILE *fp = fopen(cfg.pidfile, "w");
+		if (!fp) {
+			music_log_errno(&core, LOG_WARNING, "open: %s", cfg.pidfile);
+		} else {
+			fprintf(fp, "%ld\n", (long)getpid());
+			if (fclose(fp)) {
+				music_log_errno(&core, LOG_WARNING, "write: %s", cfg.pidfile);
+			}
+		}
+	}
+
+
+	/***** Start asynchronous logging *****/
+	if (cfg.logbuffer && !(cfg.logasync = log_async_start(cfg.logbuffer,
+	                                                       cfg.logdrop))) {
+		music_log(&core, LOG_WARNING,
+		          "could not start asynchronous logging");
+	}
+
+
+	/***** Start stats socket *****/
+	if (cfg.stats && *cfg.stats) {
+		music_metrics_start(&core, cfg.stats);
+	}
+
 
 	/***** Register signal handler *****/
-	signal(SIGHUP,  got_sig);
+	signal(SIGHUP,  got_hup);
 	signal(SIGINT,  got_sig);
 	signal(SIGILL,  got_sig);
 	signal(SIGQUIT, got_sig);
@@ -260,13 +471,14 @@ int main(int argc, char **argv) {
 		music_log(m, LOG_NOTICE, "starting");
 		if (!m->start || m->start(m)) {
 			music_log(m, LOG_DEBUG, "this will be our cache");
+			cfg.retryDuration = music_metric(m, "retry_duration_us",
+			                                 MUSIC_HISTOGRAM);
 			break;
 		}
 
 		music_log(m, LOG_FATAL + 2, "error starting module");
 		prev->next = m->next;
-		if (m->free) m->free(m);
-		free(m);
+		free_module(m);
 		m = prev;
 	}
 
@@ -281,34 +493,42 @@ int main(int argc, char **argv) {
 	while (m->next && m->next->type==MUSIC_CACHE) {
 		struct music_module *next = m->next;
 		m->next = next->next;
-		if (next->free) next->free(next);
-		if (next->name) free(next->name);
-		free(next);
+		free_module(next);
 	}
 
 
 	/***** Start other modules *****/
-	while (m->next) {
-		struct music_module *prev = m;
-		m = m->next;
+	{
+		const unsigned long long start = music_time_us();
+		unsigned long long took;
 
-		if (sig) {
+		switch (start_rest(m, cfg.startTimeout)) {
+		case -1:
 			goto finishSig;
-		}
-
-		music_log(m, LOG_NOTICE, "starting");
-		if (m->start && !m->start(m)) {
-			music_log(m, LOG_FATAL, "error starting module");
-			prev->next = 0;
+		case 0:
 			returnValue = 1;
 			goto finishNoSig;
 		}
+
+		took = music_time_us() - start;
+		music_metric_set(music_metric(&core, "startup_duration_us",
+		                              MUSIC_GAUGE), took);
+		music_log(&core, LOG_NOTICE, "modules started in %llu.%03llu s",
+		          took / 1000000, took / 1000 % 1000);
 	}
 
 
 	/***** Run *****/
 	while (music_running) {
-		pause();
+		char buf[16];
+		if (read(signal_pipe[0], buf, sizeof buf) < 0 && errno!=EINTR) {
+			music_log_errno(&core, LOG_FATAL, "read");
+			break;
+		}
+		if (reload && music_running) {
+			reload = 0;
+			reload_config(&core, cwd, argc - 1, argv + 1);
+		}
 	}
 
 
@@ -319,29 +539,87 @@ int main(int argc, char **argv) {
 	}
 
  finishNoSig:
-	/* Stop everything */
+	/* Stop everything.  Input modules go first so that no song is
+	   reported to already stopped dispatcher. */
 	write(pipe_fds[1], "B", 1);
-	for (m = core.next; m; m = m->next) {
-		music_log(m, LOG_NOTICE + 2, "stopping");
-		if (m->stop) m->stop(m);
+	for (i = 0; i < 2; ++i) {
+		for (m = core.next; m; m = m->next) {
+			if ((m->type==MUSIC_IN) == !i) {
+				music_log(m, LOG_NOTICE + 2, "stopping");
+				if (m->stop) m->stop(m);
+			}
+		}
 	}
+	music_metrics_stop();
 
  finishNoStop:
 	/* OS will free all resources we were using so no need to do it
-	   ourselfves */
+	   ourselfves but capture file must be flushed */
+	if (cfg.captureFile) {
+		pthread_mutex_lock(&cfg.capture_mutex);
+		fclose(cfg.captureFile);
+		cfg.captureFile = 0;
+		pthread_mutex_unlock(&cfg.capture_mutex);
+	}
+	if (cfg.logasync) {
+		struct log_async *const a = cfg.logasync;
+		cfg.logasync = 0;
+		log_async_stop(a);
+	}
+	if (cfg.pidfile && *cfg.pidfile) {
+		unlink(cfg.pidfile);
+	}
 	music_log(&core, LOG_NOTICE, "terminated");
 	return returnValue;
 }
 
 
 
+/****************************** Read Config ******************************/
+static int  read_config(struct music_module *restrict core,
+                        struct module_source *restrict *restrict sources_,
+                        int count, char **files) {
+	int i, ok = 1;
+
+	for (i = 0; ok && i < count; ++i) {
+		FILE *fp = strcmp(files[i], "-") ? fopen(files[i], "r") : stdin;
+		struct music_module *m = core;
+		char buf[1026];
+
+		if (!fp) {
+			music_log_errno(core, LOG_FATAL, "open: %s", files[i]);
+			return 0;
+		}
+
+		while (ok && fgets(buf, sizeof buf, fp)) {
+			ok = parse_line(buf, &m, sources_);
+		}
+
+		/* Configuration for the last module has ended */
+		if (ok && m!=core && m->config) {
+			ok = m->config(m, 0, 0);
+		}
+
+		if (fp!=stdin) {
+			fclose(fp);
+		}
+	}
+
+	return ok;
+}
+
+
+
 /****************************** Parse Line ******************************/
 static int  parse_line(char *restrict buf,
-                       struct music_module *restrict *restrict m_) {
+                       struct music_module *restrict *restrict m_,
+                       struct module_source *restrict *restrict sources_) {
 	struct music_module *restrict m    = *m_;
 	struct music_module *restrict core = m->core;
 	struct music_module *(*init)(const char *name, const char *arg);
 	char *option, *moduleName, *argument, *ch, *end;
+	const struct music_static_module *builtin;
+	struct module_source *source;
 	void *handle;
 	size_t len;
 
@@ -375,8 +653,23 @@ static int  parse_line(char *restrict buf,
 	}
 
 
+	/* "loglevel" argument of a module */
+	if (!strcmp(option, "loglevel") && m!=core) {
+		long level = strtol(argument, &ch, 0);
+		if (!*argument || *ch || level < 0) {
+			music_log(m, LOG_FATAL, "loglevel: %s: integer expected", argument);
+			return 0;
+		}
+		m->loglevel = level;
+		return 1;
+	}
+
+
 	/* Pass arguments to module */
 	if (strcmp(option, "module")) {
+		if (m!=core) {
+			source_append(*sources_, option, argument);
+		}
 		if (m->config) {
 			return m->config(m, option, argument);
 		} else {
@@ -415,27 +708,36 @@ static int  parse_line(char *restrict buf,
 	          *argument ? "%s: loading module (%s)" : "%s: loading module",
 	          moduleName, argument);
 
-	sprintf(buf, "./%s.so", moduleName);
-	handle = dlopen(buf, RTLD_LAZY);
-	if (!handle) {
-		music_log(core, LOG_FATAL, "%s", dlerror());
-		free(moduleName);
-		return 0;
-	}
+	/* Modules linked in go first */
+	for (builtin = music_static_modules;
+	     builtin->name && strcmp(builtin->name, moduleName);
+	     ++builtin);
 
-	/* Load "init" function */
-	dlerror();
-	if (!(handle = dlsym(handle, "init"))) {
-		music_log(core, LOG_FATAL, "%s", dlerror());
-		free(moduleName);
-		return 0;
+	if (builtin->name) {
+		init = builtin->init;
+	} else {
+		sprintf(buf, "./%s.so", moduleName);
+		handle = dlopen(buf, RTLD_LAZY);
+		if (!handle) {
+			music_log(core, LOG_FATAL, "%s", dlerror());
+			free(moduleName);
+			return 0;
+		}
+
+		/* Load "init" function */
+		dlerror();
+		if (!(handle = dlsym(handle, "init"))) {
+			music_log(core, LOG_FATAL, "%s", dlerror());
+			free(moduleName);
+			return 0;
+		}
+		*(void **)&init = handle;
 	}
 
 	/* Run "init" function */
-	*(void **)&init = handle;
 	m = init(moduleName, argument);
 	if (!m) {
-		music_log(core, LOG_FATAL, "%s: init: unknown error", buf);
+		music_log(core, LOG_FATAL, "%s: init: unknown error", moduleName);
 		free(moduleName);
 		return 0;
 	}
@@ -447,11 +749,39 @@ static int  parse_line(char *restrict buf,
 	m->core = core;
 	core->next = m;
 	*m_ = m;
+
+	/* Record module's source */
+	source = malloc(sizeof *source);
+	source->next   = *sources_;
+	source->module = m;
+	source->text   = 0;
+	source->length = 0;
+	source->match  = 0;
+	source->state  = 0;
+	*sources_ = source;
+	source_append(source, moduleName, argument);
 	return 1;
 }
 
 
 
+static void source_append(struct module_source *restrict s,
+                          const char *restrict option,
+                          const char *restrict argument) {
+	const size_t optLen = strlen(option), argLen = strlen(argument);
+	char *ch;
+
+	s->text = realloc(s->text, s->length + optLen + argLen + 2);
+	ch = s->text + s->length;
+	memcpy(ch, option, optLen);
+	ch[optLen] = ' ';
+	memcpy(ch + optLen + 1, argument, argLen);
+	ch[optLen + argLen + 1] = '\n';
+	s->length += optLen + argLen + 2;
+}
+
+
+
 /****************************** Sort modules ******************************/
 static int  sort_modules(struct music_module *restrict core) {
 	struct music_module *buckets[3] = { 0, 0, 0 }, *last[3] = { 0, 0, 0 }, *m;
@@ -506,6 +836,459 @@ static int  sort_modules(struct music_module *restrict core) {
 
 
 
+/****************************** Modules ******************************/
+static int  start_module(struct music_module *restrict m) {
+	if ((m->type==MUSIC_IN || m->type==MUSIC_OUT) && m->stopPipe[0] < 0 &&
+	    pipe(m->stopPipe)) {
+		music_log_errno(m, LOG_WARNING, "pipe");
+		m->stopPipe[0] = m->stopPipe[1] = -1;
+	}
+
+	music_log(m, LOG_NOTICE, "starting");
+	return !m->start || m->start(m);
+}
+
+
+
+/**
+ * Module being started by start_modules().
+ */
+struct start_job {
+	struct start_batch *batch;  /**< Batch job belongs to. */
+	struct music_module *m;     /**< Module to start. */
+	int result;                 /**< Result; see start_modules(). */
+};
+
+/**
+ * Modules being started by start_modules().  It is freed by
+ * start_modules() unless some modules did not finish starting in
+ * time in which case it is left for their threads to use.
+ */
+struct start_batch {
+	pthread_mutex_t mutex;      /**< Mutex protecting results. */
+	pthread_cond_t cond;        /**< Signaled when module started. */
+	size_t pending;             /**< Number of modules starting. */
+	struct start_job jobs[1];   /**< Modules being started. */
+};
+
+
+/**
+ * Thread starting a single module.
+ *
+ * @param ptr a pointer to struct start_job cast to pointer to void.
+ * @return return value shall be ignored.
+ */
+static void *start_thread(void *restrict ptr) __attribute__((nonnull));
+static void *start_thread(void *restrict ptr) {
+	struct start_job *const job = ptr;
+	struct start_batch *const b = job->batch;
+	const int result = start_module(job->m);
+
+	pthread_mutex_lock(&b->mutex);
+	job->result = result;
+	--b->pending;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+	return 0;
+}
+
+
+static void start_modules(struct music_module *restrict *restrict modules,
+                          int *restrict results, size_t count,
+                          unsigned timeout) {
+	struct start_batch *const b = malloc(sizeof *b + count * sizeof *b->jobs);
+	struct timespec deadline;
+	pthread_t thread;
+	size_t i, pending;
+	int ret = 0;
+
+	if (!b) {
+		for (i = 0; i < count; ++i) {
+			results[i] = start_module(modules[i]);
+		}
+		return;
+	}
+
+	pthread_mutex_init(&b->mutex, 0);
+	pthread_cond_init(&b->cond, 0);
+	b->pending = count;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	for (i = 0; i < count; ++i) {
+		b->jobs[i].batch  = b;
+		b->jobs[i].m      = modules[i];
+		b->jobs[i].result = -1;
+		if (pthread_create(&thread, 0, start_thread, b->jobs + i)) {
+			start_thread(b->jobs + i);
+		} else {
+			pthread_detach(thread);
+		}
+	}
+
+	pthread_mutex_lock(&b->mutex);
+	while (b->pending && ret != ETIMEDOUT) {
+		ret = timeout
+			? pthread_cond_timedwait(&b->cond, &b->mutex, &deadline)
+			: pthread_cond_wait(&b->cond, &b->mutex);
+	}
+	for (i = 0; i < count; ++i) {
+		results[i] = b->jobs[i].result;
+	}
+	pending = b->pending;
+	pthread_mutex_unlock(&b->mutex);
+
+	if (!pending) {
+		pthread_mutex_destroy(&b->mutex);
+		pthread_cond_destroy(&b->cond);
+		free(b);
+	}
+}
+
+
+
+static int  start_rest(struct music_module *restrict last, unsigned timeout) {
+	struct music_module **modules, *m;
+	size_t count = 0, from, to, i;
+	int *results, ret = 1;
+
+	for (m = last->next; m; m = m->next) ++count;
+	modules = malloc(count * (sizeof *modules + sizeof *results) + 1);
+	if (!modules) {
+		music_log(last->core, LOG_FATAL, "not enough memory");
+		last->next = 0;
+		return 0;
+	}
+	results = (int *)(modules + count);
+	for (i = 0, m = last->next; m; m = m->next) modules[i++] = m;
+
+	/* Dispatcher and output modules go first, input modules last */
+	for (from = 0; ret==1 && from < count; from = to) {
+		const int in = modules[from]->type==MUSIC_IN;
+		for (to = from; to < count && (modules[to]->type==MUSIC_IN)==in; ++to);
+
+		if (sig) {
+			ret = -1;
+			break;
+		}
+
+		start_modules(modules + from, results + from, to - from, timeout);
+		for (i = from; i < to; ++i) {
+			if (results[i] < 0) {
+				music_log(modules[i], LOG_FATAL,
+				          "module did not start in %u s", timeout);
+				ret = 0;
+			} else if (!results[i]) {
+				music_log(modules[i], LOG_FATAL, "error starting module");
+				ret = 0;
+			}
+		}
+	}
+
+	/* Only started modules are kept on the list */
+	for (m = last, i = 0; i < from; ++i) {
+		if (results[i]==1) {
+			m = m->next = modules[i];
+		}
+	}
+	m->next = 0;
+
+	free(modules);
+	return ret;
+}
+
+
+
+static void stop_module(struct music_module *restrict m) {
+	music_log(m, LOG_NOTICE + 2, "stopping");
+	m->stopping = 1;
+	if (m->stopPipe[1] >= 0) {
+		write(m->stopPipe[1], "B", 1);
+	}
+	if (m->stop) m->stop(m);
+}
+
+
+
+static void free_module(struct music_module *restrict m) {
+	struct module_source **p = &sources, *s;
+
+	while ((s = *p) && s->module!=m) p = &s->next;
+	if (s) {
+		*p = s->next;
+		free(s->text);
+		free(s);
+	}
+
+	if (m->free) m->free(m);
+	if (m->stopPipe[0] >= 0) {
+		close(m->stopPipe[0]);
+		close(m->stopPipe[1]);
+	}
+	free(m->name);
+	free(m);
+}
+
+
+
+/****************************** Reload ******************************/
+/**
+ * Compares two strings either of which may be NULL.  NULL is
+ * considered equal to an empty string.
+ *
+ * @param a first string or NULL.
+ * @param b second string or NULL.
+ * @return whether strings differ.
+ */
+static int  str_differ(const char *restrict a, const char *restrict b) {
+	return strcmp(a ? a : "", b ? b : "");
+}
+
+
+static void reload_config(struct music_module *restrict core,
+                          const char *restrict cwd, int count, char **files) {
+	struct config *const cfg = core->data;
+	struct config newCfg = {
+		PTHREAD_MUTEX_INITIALIZER,
+		0, LOG_NOTICE, 0,
+		0,
+		PTHREAD_MUTEX_INITIALIZER,
+		0, 0, 0,
+		0, 0, 0,
+		0, 0, 0, 0, 0
+	};
+	struct music_module head = {
+		-1,
+		0, 0, 0,
+		config_line,
+		{ 0 }, 0, 0,
+		0, 0,
+		{ -1, -1 }, 0,
+		0,
+		MUSIC_LOGLEVEL_UNSET,
+		0
+	}, *dispatcher, *m;
+	struct module_source *newSources = 0, *s, *o, **p;
+	unsigned started = 0, stopped = 0, kept = 0;
+	int i, ok;
+
+	head.core = &head;
+	head.data = &newCfg;
+	head.name = core->name;
+	newCfg.logasync = cfg->logasync;
+
+	music_log(core, LOG_NOTICE, "reloading configuration");
+
+	for (i = 0; i < count && strcmp(files[i], "-"); ++i);
+	if (i < count) {
+		music_log(core, LOG_ERROR,
+		          "configuration was read from standard input; "
+		          "cannot reload");
+		return;
+	}
+	if (!*cwd || chdir(cwd)) {
+		music_log_errno(core, LOG_ERROR, "chdir: %s", cwd);
+		return;
+	}
+	ok = read_config(&head, &newSources, count, files);
+	chdir("/");
+
+
+	/* Match new modules with running ones */
+	for (s = newSources; ok && s; s = s->next) {
+		m = s->module;
+		m->core = core;
+		if (m->loglevel == MUSIC_LOGLEVEL_UNSET) {
+			m->loglevel = newCfg.loglevel;
+		}
+		if ((unsigned)m->type>2) {
+			music_log(m, LOG_ERROR, "invalid module type: %d", (int)m->type);
+			ok = 0;
+			break;
+		}
+
+		for (o = sources; o && (o->state || strcmp(o->module->name, m->name));
+		     o = o->next);
+		if (!o) {
+			continue;
+		}
+		o->state = 1;
+		if (o->length==s->length && !memcmp(o->text, s->text, s->length)) {
+			o->state = 2;
+			s->match = o;
+		}
+	}
+
+	/* Caches are chosen at start up and cannot be changed */
+	for (i = 0, s = newSources; ok && s; s = s->next) {
+		i |= s->module->type==MUSIC_CACHE && !s->match;
+	}
+	for (o = sources; ok && o; o = o->next) {
+		i |= o->module->type==MUSIC_CACHE && o->state!=2;
+	}
+	if (ok && i) {
+		music_log(core, LOG_ERROR, "cache modules changed; restart required");
+		ok = 0;
+	}
+
+	/* There must be at least one output module */
+	for (i = 0, s = newSources; ok && s; s = s->next) {
+		i += s->module->type==MUSIC_OUT && !!s->module->song.send;
+	}
+	if (ok && !i) {
+		music_log(core, LOG_ERROR, "no output modules");
+		ok = 0;
+	}
+
+	if (!ok) {
+		music_log(core, LOG_ERROR, "error reloading configuration; "
+		          "keeping current one");
+		for (o = sources; o; o = o->next) o->state = 0;
+		goto done;
+	}
+
+
+	/* Core options */
+	if (str_differ(cfg->logfile, newCfg.logfile) ||
+	    str_differ(cfg->capture, newCfg.capture) ||
+	    str_differ(cfg->stats  , newCfg.stats  ) ||
+	    str_differ(cfg->pidfile, newCfg.pidfile) ||
+	    cfg->logbuffer!=newCfg.logbuffer || cfg->logdrop!=newCfg.logdrop ||
+	    cfg->requireCache!=newCfg.requireCache) {
+		music_log(core, LOG_WARNING, "core options other then loglevel "
+		          "and dedupwindow take effect after restart");
+	}
+	cfg->loglevel = newCfg.loglevel;
+	cfg->dedupWindow = newCfg.dedupWindow;
+	core->loglevel = cfg->loglevel;
+
+	for (dispatcher = core->next; dispatcher->type!=MUSIC_CORE;
+	     dispatcher = dispatcher->next);
+	dispatcher->loglevel = cfg->loglevel;
+
+
+	/* Kept modules: running instance is moved to new source and new
+	   instance is put to old source to be freed along with it */
+	for (s = newSources; s; s = s->next) {
+		if (s->match) {
+			m = s->module;
+			s->module = s->match->module;
+			s->match->module = m;
+			s->module->loglevel = m->loglevel;
+			s->match = 0;
+			s->state = 2;
+			++kept;
+		}
+	}
+
+
+	/* Stop removed and changed modules.  Dispatcher is paused so no
+	   songs are sent to output modules being stopped (nor lost) and
+	   input modules go first. */
+	dispatcher_pause(dispatcher);
+	for (i = 0; i < 2; ++i) {
+		for (o = sources; o; o = o->next) {
+			if (o->state!=2 && (o->module->type==MUSIC_IN) == !i) {
+				stop_module(o->module);
+				++stopped;
+			}
+		}
+	}
+
+
+	/* Start new modules.  Input modules go last; songs they report
+	   before dispatcher is resumed wait on its queue. */
+	for (i = 0; i < 2; ++i) {
+		struct music_module **modules;
+		int *results;
+		size_t n = 0, j;
+
+		for (s = newSources; s; s = s->next) {
+			n += s->state!=2 && (s->module->type==MUSIC_IN) == i;
+		}
+		if (!n) {
+			continue;
+		}
+		modules = malloc(n * (sizeof *modules + sizeof *results));
+		if (!modules) {
+			music_log(core, LOG_ERROR, "not enough memory");
+			n = 0;
+		}
+		results = (int *)(modules + n);
+
+		for (j = 0, s = newSources; j < n && s; s = s->next) {
+			if (s->state!=2 && (s->module->type==MUSIC_IN) == i) {
+				modules[j++] = s->module;
+			}
+		}
+		start_modules(modules, results, n, 0);
+
+		for (j = 0, p = &newSources; (s = *p); ) {
+			m = s->module;
+			if (s->state==2 || (m->type==MUSIC_IN) != i) {
+				p = &s->next;
+			} else if (j < n && results[j++]) {
+				p = &s->next;
+				++started;
+			} else {
+				music_log(m, LOG_ERROR, "error starting module");
+				*p = s->next;
+				free_module(m);
+				free(s->text);
+				free(s);
+			}
+		}
+		free(modules);
+	}
+
+
+	/* Build new list of output and input modules and splice it after
+	   dispatcher.  Input modules find dispatcher through core and
+	   cache (see music_dispatcher()) while we are here so neither is
+	   relinked; cache is the same module anyway. */
+	head.next = 0;
+	for (s = newSources; s; s = s->next) {
+		s->state = 0;
+		if (s->module->type!=MUSIC_CACHE) {
+			s->module->next = head.next;
+			head.next = s->module;
+		}
+	}
+	sort_modules(&head);
+	dispatcher->next = head.next;
+
+	if (!dispatcher_resume(dispatcher)) {
+		music_log(dispatcher, LOG_ERROR, "songs will be queued till "
+		          "configuration is fixed");
+	}
+
+
+	/* Free old modules */
+	while (sources) {
+		free_module(sources->module);
+	}
+	sources = newSources;
+	newSources = 0;
+
+	music_log(core, LOG_NOTICE, "configuration reloaded: %u modules "
+	          "started, %u stopped, %u unchanged", started, stopped, kept);
+
+ done:
+	while (newSources) {
+		s = newSources;
+		newSources = s->next;
+		free_module(s->module);
+		free(s->text);
+		free(s);
+	}
+	free(newCfg.logfile);
+	free(newCfg.capture);
+	free(newCfg.stats);
+	free(newCfg.pidfile);
+}
+
+
+
 /****************************** Config Line ******************************/
 static int  config_line(const struct music_module *restrict m,
                         const char *restrict opt, const char *restrict arg) {
@@ -513,6 +1296,13 @@ static int  config_line(const struct music_module *restrict m,
 		{ "logfile" , 1, 1 },
 		{ "loglevel", 2, 2 },
 		{ "requirecache", 0, 3 },
+		{ "capture" , 1, 4 },
+		{ "logbuffer", 2, 5 },
+		{ "logoverflow", 1, 6 },
+		{ "stats"   , 1, 7 },
+		{ "pidfile" , 1, 8 },
+		{ "starttimeout", 2, 9 },
+		{ "dedupwindow", 2, 10 },
 		{ 0, 0, 0 }
 	};
 	struct config *const cfg = m->data;
@@ -534,6 +1324,35 @@ static int  config_line(const struct music_module *restrict m,
 	case 3:
 		cfg->requireCache = 1;
 		break;
+	case 4:
+		cfg->capture = music_strdup_realloc(cfg->capture, arg);
+		break;
+	case 5:
+		cfg->logbuffer = atoi(arg) < 0 ? 0 : atoi(arg);
+		break;
+	case 6:
+		if (!strcmp(arg, "block")) {
+			cfg->logdrop = 0;
+		} else if (!strcmp(arg, "drop")) {
+			cfg->logdrop = 1;
+		} else {
+			music_log(m, LOG_FATAL, "logoverflow: %s: block or drop expected",
+			          arg);
+			return 0;
+		}
+		break;
+	case 7:
+		cfg->stats = music_strdup_realloc(cfg->stats, arg);
+		break;
+	case 8:
+		cfg->pidfile = music_strdup_realloc(cfg->pidfile, arg);
+		break;
+	case 9:
+		cfg->startTimeout = atoi(arg) < 0 ? 0 : atoi(arg);
+		break;
+	case 10:
+		cfg->dedupWindow = atoi(arg) < 0 ? 0 : atoi(arg);
+		break;
 	}
 	return 1;
 }
@@ -542,13 +1361,24 @@ static int  config_line(const struct music_module *restrict m,
 
 /****************************** Signals ******************************/
 static void got_sig(int signum) {
+	const int saved = errno;
 	music_running = 0;
 	if (!sig) {
 		sig = signum;
 	} else {
 		abort();
 	}
+	write(signal_pipe[1], "S", 1);
 	signal(signum, got_sig);
+	errno = saved;
+}
+
+static void got_hup(int signum) {
+	const int saved = errno;
+	reload = 1;
+	write(signal_pipe[1], "H", 1);
+	signal(signum, got_hup);
+	errno = saved;
 }
 
 static void ignore_sig(int signum) {
@@ -37,6 +37,12 @@ struct music_song {
 	time_t time;         /**< The time song was reported. */
 	time_t endTime;      /**< The time song (will) end(ed). */
 	unsigned length;     /**< Song's length in seconds. */
+	/**
+	 * Moment core received the song as returned by music_time_us().
+	 * Set by core; input modules need not initialise it.  Output and
+	 * cache modules may use it to measure latency.
+	 */
+	unsigned long long ingest;
 };
 
 
@@ -148,6 +154,14 @@ struct music_module {
 		 * raport is as failure since resubmitting the song won't make
 		 * it magically be accepted.
 		 *
+		 * Songs are immutable and owned by core.  Module which needs
+		 * a song after this method returns (ie. to retry it later)
+		 * should take a reference with music_song_ref() rather then
+		 * copy it.
+		 *
+		 * Array may be empty if module implements nowPlaying method
+		 * (see below).
+		 *
 		 * @param m output module.
 		 * @param songs a NULL terminated array of pointers to songs.
 		 * @param errorPositions array to fill with indexes of songs
@@ -165,6 +179,12 @@ struct music_module {
 		 * This way, songs may be later resubmitted if given module'll
 		 * become operational again.
 		 *
+		 * The song is immutable and owned by core.  To keep it module
+		 * should take a reference with music_song_ref() and release
+		 * it with music_song_release() once the song is resubmitted
+		 * (it may pass the very same pointer to song.send).  There is
+		 * no need to copy it.
+		 *
 		 * \internal This is also method used by song dispatcher
 		 * however it ignores modules argument.
 		 *
@@ -194,15 +214,39 @@ struct music_module {
 	                    const struct music_module *restrict const *restrict modules);
 
 
+	/**
+	 * Method called by song dispatcher with song some input module
+	 * is now playing.  Module should remember the latest one (taking
+	 * a reference with music_song_ref()) and submit it together with
+	 * songs on next song.send call.  If there are no songs to send,
+	 * song.send is called with an empty array right after this
+	 * method and module should submit the song then.  Song may be
+	 * NULL which means input module stopped playing.  This is
+	 * optional and may be set by output modules only.
+	 *
+	 * @param m output module.
+	 * @param song song being played or NULL.
+	 */
+	void (*nowPlaying)(const struct music_module *restrict m,
+	                   const struct music_song *restrict song);
+
 
-	/* Those two are for internal use by core.  init() (or module in
-	   any other place) should not touch them. */
+
+	/* Those are for internal use by core.  init() (or module in any
+	   other place) should not touch them. */
 #ifdef MUSIC_INTERNAL_H
 	struct music_module *next;  /**< Next module.  For internal use! */
 	struct music_module *core;  /**< The core module.  For internal use! */
+	int stopPipe[2];            /**< Pipe core writes to when stopping
+	                                 this module alone or -1s.  For
+	                                 internal use! */
+	volatile sig_atomic_t stopping; /**< Whether module is being
+	                                     stopped.  For internal use! */
 #else
 	/** Internal data for use by core.  Modules must not touch it! */
-	char internal[sizeof(struct music_module*[2])];
+	char internal[sizeof(struct {
+		struct music_module *p[2]; int fd[2]; sig_atomic_t s;
+	})];
 #endif
 
 
@@ -216,6 +260,18 @@ struct music_module {
 	const char *restrict const name;
 #endif
 
+	/**
+	 * Module's log level.  Messages with greater level won't be
+	 * logged.  It may be set by user using loglevel configuration
+	 * option and defaults to core's log level.  Module must not touch
+	 * it; use music_log_enabled() to check it.
+	 */
+#ifdef MUSIC_INTERNAL_H
+	unsigned loglevel;
+#else
+	const unsigned loglevel;
+#endif
+
 	/**
 	 * Data pointer for use by module.  Core will never touch this.
 	 */
@@ -236,6 +292,38 @@ extern const volatile sig_atomic_t music_running;
 #endif
 
 
+/**
+ * Tells whether given module should keep running.  It is zero once
+ * core begins terminating (ie. music_running is zero) but also when
+ * only the given module is being stopped, which happens when its
+ * configuration has changed and core is reloading configuration.
+ * Modules running threads should check it rather then music_running.
+ *
+ * @param m module.
+ * @return whether module should keep running.
+ */
+int music_module_running(const struct music_module *restrict m)
+	__attribute__((nonnull, visibility("default")));
+
+
+/**
+ * Returns a file descriptor on which core sends dummy data when
+ * stopping given module alone or -1 if there is no such descriptor.
+ * Output modules get the data also while core pauses song dispatcher
+ * to reload configuration; music_module_running() is non-zero then.
+ * Modules which select() or poll() on sleep_pipe_fd should include
+ * this descriptor as well (music_sleep() does it already).
+ *
+ * Modules <strong>MUST NOT</strong> read any data from this file
+ * descriptor.
+ *
+ * @param m module.
+ * @return file descriptor or -1.
+ */
+int music_stop_fd(const struct music_module *restrict m)
+	__attribute__((nonnull, visibility("default")));
+
+
 /**
  * Specifies a file description for a pipe on which core sends dummy
  * data when finishing.  Modules should use this pipe as an argument
@@ -302,6 +390,48 @@ void  music_log_errno(const struct music_module *restrict m, unsigned level,
 
 
 
+/**
+ * Checks whether message with given level reported by given module
+ * would be logged.  If level is a constant greater then
+ * MUSIC_LOG_MAX_LEVEL this evaluates to a constant zero.  Useful if
+ * preparing message's arguments is expensive.
+ *
+ * @param m module raporting message.
+ * @param level message's level.
+ * @return whether message would be logged.
+ */
+#define music_log_enabled(m, level)              \
+	((unsigned)(level) <= MUSIC_LOG_MAX_LEVEL && \
+	 (unsigned)(level) <= (m)->loglevel)
+
+
+/**
+ * music_log() and music_log_errno() are wrapped by macros which check
+ * message's level before evaluating the rest of the arguments so
+ * messages which won't be logged cost a single comparison and
+ * messages above MUSIC_LOG_MAX_LEVEL are compiled out entirely.
+ */
+#define music_log(m, level, ...)                               \
+	do {                                                       \
+		const struct music_module *const music_log_m_ = (m);   \
+		const unsigned music_log_level_ = (level);             \
+		if (music_log_enabled(music_log_m_, music_log_level_)) { \
+			(music_log)(music_log_m_, music_log_level_, __VA_ARGS__); \
+		}                                                      \
+	} while (0)
+
+/** See music_log(). */
+#define music_log_errno(m, level, ...)                         \
+	do {                                                       \
+		const struct music_module *const music_log_m_ = (m);   \
+		const unsigned music_log_level_ = (level);             \
+		if (music_log_enabled(music_log_m_, music_log_level_)) { \
+			(music_log_errno)(music_log_m_, music_log_level_, __VA_ARGS__); \
+		}                                                      \
+	} while (0)
+
+
+
 /**
  * Searches for an option in specified options list and then validates
  * its argument.  If option was not found then if req is zero function
@@ -339,6 +469,54 @@ void  music_song  (const struct music_module *restrict m,
 
 
 
+/**
+ * Puts given songs on song queue.  This is the same as calling
+ * music_song() for each song but should be preferred by modules which
+ * raport many songs at once since all songs are put on the queue at
+ * once waking song dispatcher only once.
+ *
+ * @param m input module that raports songs.
+ * @param songs array of songs it raports.
+ * @param count number of songs in the array.
+ */
+void  music_songs (const struct music_module *restrict m,
+                   const struct music_song *restrict songs, size_t count)
+	__attribute__((nonnull, visibility("default")));
+
+
+
+/**
+ * Tells core which song input module is playing right now.  Unlike
+ * music_song() this should be called as soon as song starts playing.
+ * Updates go through a separate channel than songs: they are never
+ * cached and only the latest update from each input module is kept
+ * so updates superseded before song dispatcher got to them are
+ * dropped.
+ *
+ * @param m input module that raports song.
+ * @param song song being played or NULL if nothing is played.
+ */
+void  music_now_playing(const struct music_module *restrict m,
+                        const struct music_song *restrict song)
+	__attribute__((nonnull(1), visibility("default")));
+
+
+
+/**
+ * Returns number of songs reported by input modules which wait on
+ * song dispatcher's queue, ie. which output modules have not yet
+ * started submitting.  Input modules accepting songs from other
+ * programs may use it to stop accepting songs when output modules
+ * cannot keep up.
+ *
+ * @param m module asking.
+ * @return number of songs.
+ */
+size_t music_queue_length(const struct music_module *restrict m)
+	__attribute__((nonnull, visibility("default")));
+
+
+
 /**
  * Allocates memory and duplicates given string.  This function uses
  * realloc() on ginve old pointer which can be NULL.  The returned
@@ -363,22 +541,95 @@ char *music_strdup_realloc(char *restrict old, const char *restrict str)
 
 
 
+/**
+ * Takes a reference to a song.  This may only be called on songs
+ * core passed to output module's song.send or cache module's
+ * song.cache methods (or songs obtained from this function).  Each
+ * reference must be dropped with music_song_release().
+ *
+ * @param song song to reference.
+ * @return song.
+ */
+const struct music_song *music_song_ref(const struct music_song *restrict song)
+	__attribute__((nonnull, visibility("default")));
+
+
+/**
+ * Drops a reference to a song taken with music_song_ref(), freeing
+ * the song if it was the last one.  Does nothing if song is NULL.
+ *
+ * @param song song to release or NULL.
+ */
+void music_song_release(const struct music_song *restrict song)
+	__attribute__((visibility("default")));
+
+
+
+/**
+ * Interns a string.  Returns an immutable copy of the string shared
+ * by all callers that interned equal strings so two interned strings
+ * are equal if and only if pointers are equal.  Each call takes
+ * a reference which must be dropped with music_intern_release().
+ * This function is thread safe.
+ *
+ * @param str string to intern.
+ * @return interned string or NULL on error.
+ */
+const char *music_intern(const char *restrict str)
+	__attribute__((nonnull, visibility("default"), warn_unused_result));
+
+
+/**
+ * Takes another reference to an interned string.
+ *
+ * @param str string returned by music_intern().
+ * @return str.
+ */
+const char *music_intern_ref(const char *restrict str)
+	__attribute__((nonnull, visibility("default")));
+
+
+/**
+ * Drops a reference to an interned string, freeing it if it was the
+ * last one.  Does nothing if str is NULL.
+ *
+ * @param str string returned by music_intern() or NULL.
+ */
+void music_intern_release(const char *restrict str)
+	__attribute__((visibility("default")));
+
+
+
 /**
  * Sleeps at least given number miliseconds.  This function does
- * select()ing or poll()ing on a sleep_pipe_fd and therefore will be
- * interrupted when core decides to terminate.  If so happens it will
- * return 1. It will also return -1 on error.  Otherwise it will return
- * 0.
+ * select()ing or poll()ing on a sleep_pipe_fd and module's stop
+ * descriptor (see music_stop_fd()) and therefore will be interrupted
+ * when core decides to terminate or to stop the module (or, for
+ * output modules, to reload configuration).  If so happens it will
+ * return 0. It will also return -1 on error.
+ * Otherwise it will return 1.
  *
  * @param m module that wants to sleep.
  * @param mili number of miliseconds it wants to sleep.
- * @return -1 on error, 0 when core begins terminating, 1 otherwise.
+ * @return -1 on error, 0 when core begins terminating or stopping
+ *         the module, 1 otherwise.
  */
 int music_sleep(const struct music_module *restrict m, unsigned long mili)
 	__attribute__((nonnull, visibility("default")));
 
 
 
+/**
+ * Returns number of microseconds since some unspecified point in
+ * time.  Unlike time() it is monotonic.
+ *
+ * @return monotonic time in microseconds.
+ */
+unsigned long long music_time_us(void)
+	__attribute__((visibility("default")));
+
+
+
 /**
  * Instructs cache that given module is ready to send songs if there
  * are any pending to send for that module.  This may called by output
@@ -443,6 +694,73 @@ struct music_module *music_init(enum music_module_type type,
 
 
 
+/**
+ * Metric types.
+ */
+enum music_metric_type {
+	MUSIC_COUNTER   = 0,  /**< Monotonically increasing value. */
+	MUSIC_GAUGE     = 1,  /**< Value which may go up and down. */
+	MUSIC_HISTOGRAM = 2   /**< Distribution of observed values in
+	                           power of two buckets. */
+};
+
+
+/** An opaque metric object. */
+struct music_metric;
+
+
+/**
+ * Registers a metric.  Metrics are exported by core on stats socket
+ * (if configured) labeled with given module's name.  Registering the
+ * same metric for the same module twice returns the same object.
+ * Metrics are never freed.
+ *
+ * Module may register metrics on behalf of other modules (ie. song
+ * dispatcher counts songs each output module failed to submit).
+ *
+ * @param m module metric is about.
+ * @param name metric's name; should match [a-z_][a-z0-9_]*.
+ * @param type metric's type.
+ * @return metric; never NULL (on error a dummy object is returned).
+ */
+struct music_metric *music_metric(const struct music_module *restrict m,
+                                  const char *restrict name,
+                                  enum music_metric_type type)
+	__attribute__((nonnull, visibility("default"), warn_unused_result));
+
+
+/**
+ * Adds value to a counter or a gauge.  Safe to call from any thread.
+ *
+ * @param metric counter or gauge.
+ * @param value value to add; for counters must not be negative.
+ */
+void music_metric_add(struct music_metric *restrict metric, long long value)
+	__attribute__((nonnull, visibility("default")));
+
+
+/**
+ * Sets gauge's value.  Safe to call from any thread.
+ *
+ * @param metric gauge.
+ * @param value new value.
+ */
+void music_metric_set(struct music_metric *restrict metric, long long value)
+	__attribute__((nonnull, visibility("default")));
+
+
+/**
+ * Records value in a histogram.  Safe to call from any thread.
+ *
+ * @param metric histogram.
+ * @param value observed value.
+ */
+void music_metric_observe(struct music_metric *restrict metric,
+                          unsigned long long value)
+	__attribute__((nonnull, visibility("default")));
+
+
+
 #ifndef MUSIC_INTERNAL_H
 /**
  * Initialises module.  This function must be exported by all modules.
@@ -11,6 +11,7 @@ here anyway. ;)');
 
 
 header('Content-Type: text/x-music');
+header('X-Music-Batch: dict');
 
 
 if (empty($_POST['auth'])) {
@@ -49,10 +50,29 @@ if ($auth[0]==='open') {
 }
 
 
-$songs = empty($_POST['song']) ? array() : $_POST['song'];
-$count = count($songs);
-for ($i = 0; $i < $count; ++$i) {
-	echo('SONG ' . $i . " OK\n");
+if (!empty($_POST['c'])) {
+	/* Compact batch; check dictionary indexes.  Dictionary is read
+	   from raw POST data since PHP decodes escaped colons. */
+	$dict = preg_match('/(?:^|&)d=([^&]+)/', file_get_contents('php://input'), $m)
+		? count(explode(':', $m[1])) : 0;
+	$count = count($_POST['c']);
+	for ($i = 0; $i < $count; ++$i) {
+		$f = explode(':', $_POST['c'][$i]);
+		$ok = count($f) === 6;
+		for ($j = 0; $ok && $j < 4; ++$j) {
+			$ok = $f[$j]==='' || hexdec($f[$j]) < $dict;
+		}
+		echo('SONG ' . $i . ($ok ? " OK\n" : " REJ Bad dictionary index\n"));
+	}
+} else {
+	$songs = empty($_POST['song']) ? array() : $_POST['song'];
+	$count = count($songs);
+	for ($i = 0; $i < $count; ++$i) {
+		echo('SONG ' . $i . " OK\n");
+	}
+}
+if (!empty($_POST['now'])) {
+	echo("SONG -1 OK\n");
 }
 
 
@@ -23,13 +23,26 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
 
+#include <pthread.h>
+
 #include <curl/curl.h>
 
 
+/**
+ * Starts module.  See music_module::start.
+ *
+ * @param m out_http module to start.
+ * @return whether starting succeed.
+ */
+static int   module_start(const struct music_module *restrict m)
+	__attribute__((nonnull));
+
+
 /**
  * Frees memory allocated by module.  See music_module::free.
  *
@@ -68,20 +81,222 @@ static int   module_send (const struct music_module *restrict m,
 	__attribute__((nonnull(1, 2)));
 
 
+/**
+ * Remembers song being played so it is submitted with next request.
+ * See music_module::nowPlaying.
+ *
+ * @param m out_http module.
+ * @param song song being played or NULL.
+ */
+static void  module_now  (const struct music_module *restrict m,
+                          const struct music_song *restrict song)
+	__attribute__((nonnull(1)));
+
+
+/**
+ * Callback function for libcurl.  Called when library wants to access
+ * data in module's share handle.
+ *
+ * @param curl CURL easy interface handler.
+ * @param data kind of data accessed.
+ * @param access kind of access (ignored).
+ * @param arg module's configuration.
+ */
+static void   share_lock(CURL *curl, curl_lock_data data,
+                         curl_lock_access access, void *arg);
+
+
+/**
+ * Callback function for libcurl.  Called when library no longer
+ * accesses data in module's share handle.
+ *
+ * @param curl CURL easy interface handler.
+ * @param data kind of data accessed.
+ * @param arg module's configuration.
+ */
+static void   share_unlock(CURL *curl, curl_lock_data data, void *arg);
+
+
+
+/**
+ * Authentication token shared by all out_http modules using the same
+ * credentials.  Token depends only on credentials and current time
+ * (with one second resolution) so it is computed at most once per
+ * second and copied into every request.
+ */
+struct auth {
+	struct auth *next;       /**< Next token in auth_list. */
+	unsigned refs;           /**< Number of modules using it. */
+	pthread_mutex_t mutex;   /**< Protects time, length and token. */
+	char password[20];       /**< SHA1 of password. */
+	unsigned long time;      /**< Time token was computed for. */
+	size_t prefixLength;     /**< Length of "auth=pass:<user>:" prefix. */
+	size_t length;           /**< Length of token. */
+	char token[1];           /**< "auth=pass:<user>:<time>:<pass>" where
+	                              user is escaped. */
+};
+
+
+/**
+ * Returns token for given credentials creating it if needed.
+ *
+ * @param user escaped user name.
+ * @param pass SHA1 of password.
+ * @return token or NULL on error.
+ */
+static struct auth *auth_get(const char *restrict user,
+                             const char *restrict pass)
+	__attribute__((nonnull));
+
+
+/**
+ * Releases token returned by auth_get().
+ *
+ * @param auth token.
+ */
+static void  auth_put(struct auth *restrict auth) __attribute__((nonnull));
+
+
+
+/**
+ * Token bucket limiting rate of requests or songs.  Bucket holds at
+ * most burst tokens and is refilled at rate tokens per second.  Taking
+ * more tokens than there are leaves bucket in debt (of at most burst
+ * tokens) which has to be paid off by waiting.
+ */
+struct rate_limit {
+	double rate;              /**< Tokens per second or zero if there is
+	                               no limit. */
+	double burst;             /**< Bucket's capacity. */
+	double tokens;            /**< Tokens in bucket; may be negative. */
+	unsigned long long last;  /**< When bucket was last refilled as
+	                               returned by music_time_us(). */
+};
+
+
+/**
+ * Fills bucket with tokens.  Called when module starts.
+ *
+ * @param rl bucket to fill.
+ * @param now current time as returned by music_time_us().
+ */
+static void rate_init(struct rate_limit *restrict rl, unsigned long long now) {
+	if (rl->rate && !rl->burst) {
+		rl->burst = rl->rate < 1 ? 1 : rl->rate;
+	}
+	rl->tokens = rl->burst;
+	rl->last   = now;
+}
+
+
+/**
+ * Adds tokens for time passed since bucket was last refilled.
+ *
+ * @param rl bucket to refill.
+ * @param now current time as returned by music_time_us().
+ */
+static void rate_refill(struct rate_limit *restrict rl,
+                        unsigned long long now) {
+	rl->tokens += (now - rl->last) * rl->rate / 1e6;
+	if (rl->tokens > rl->burst) {
+		rl->tokens = rl->burst;
+	}
+	rl->last = now;
+}
+
+
+/**
+ * Tells how many tokens may be taken without waiting longer then it
+ * takes to refill a single token.
+ *
+ * @param rl bucket to check.
+ * @param now current time as returned by music_time_us().
+ * @return number of tokens in bucket but at least one or SIZE_MAX if
+ *         there is no limit.
+ */
+static size_t rate_room(struct rate_limit *restrict rl,
+                        unsigned long long now) {
+	if (!rl->rate) {
+		return SIZE_MAX;
+	}
+	rate_refill(rl, now);
+	return rl->tokens >= 2 ? (size_t)rl->tokens : 1;
+}
+
+
+/**
+ * Takes tokens from the bucket.
+ *
+ * @param rl bucket to take tokens from.
+ * @param n number of tokens to take.
+ * @param now current time as returned by music_time_us().
+ * @return number of microseconds caller must wait before it may use
+ *         the tokens.
+ */
+static unsigned long long rate_take(struct rate_limit *restrict rl, double n,
+                                    unsigned long long now) {
+	if (!rl->rate) {
+		return 0;
+	}
+
+	rate_refill(rl, now);
+	rl->tokens -= n;
+	if (rl->tokens < -rl->burst) {
+		rl->tokens = -rl->burst;
+	}
+	return rl->tokens < 0 ? (unsigned long long)(-rl->tokens / rl->rate * 1e6)
+	                      : 0;
+}
+
+
 
 /**
  * Module's configuration.
  */
 struct module_config {
 	char *url;               /**< Request's URL. */
-	char *username;          /**< User name. */
+	char *unixSocket;        /**< Unix socket to connect to instead of
+	                              URL's host or NULL. */
+	char *proxy;             /**< Proxy to use, empty string for no
+	                              proxy or NULL to let CURL pick one
+	                              from environment. */
+	long keepAlive;          /**< How many seconds idle connection is
+	                              kept for reuse; zero to close it after
+	                              each request and -1 for CURL's
+	                              default. */
+	CURLSH *share;           /**< Connection cache shared by all
+	                              requests or NULL. */
+	/** Mutexes protecting data in share. */
+	pthread_mutex_t shareMutex[CURL_LOCK_DATA_LAST];
+	char *username;          /**< Escaped user name. */
+	struct auth *auth;       /**< Authentication token or NULL. */
 	char password[20];       /**< SHA1 of password. */
 	time_t waitTill;         /**< Wait with submitting songs till that
 	                              moment. */
 	unsigned short lastWait; /**< How much time did we wait last time. */
 	char gotPassword;        /**< Whether password was given in
                                    configuration file. */
+	signed char compact;     /**< Whether server accepts compact
+	                              batches: zero if unknown, one when
+	                              server sent X-Music-Batch header, -1
+	                              if it then rejected a batch. */
 	char verbose;            /**< Whether CURL should be verbose. */
+
+	/** Song being played waiting to be submitted (a reference taken
+	    with music_song_ref()) or NULL.  Accessed atomically. */
+	const struct music_song *now;
+
+	struct rate_limit requestRate; /**< Limit of requests per second. */
+	struct rate_limit songRate;    /**< Limit of songs per second. */
+
+	struct music_metric *requests;        /**< HTTP requests made. */
+	struct music_metric *requestErrors;   /**< Requests which failed. */
+	struct music_metric *requestDuration; /**< Requests' durations in
+	                                           microseconds. */
+	struct music_metric *ackLatency;      /**< Time from song's ingest to
+	                                           server's acknowledgement. */
+	struct music_metric *rateWait;        /**< Time spent waiting because
+	                                           of rate limits. */
 };
 
 
@@ -128,10 +343,15 @@ static char userAgent[64] = "";
 
 
 
+/**
+ * Header announcing that module can send compact batches.
+ */
+static struct curl_slist batchHeader = { (char*)"X-Music-Batch: dict", 0 };
+
 /**
  * Headers sent while making request.
  */
-struct curl_slist headers = { (char*)"Accept: text/x-music", 0 };
+struct curl_slist headers = { (char*)"Accept: text/x-music", &batchHeader };
 
 
 
@@ -139,19 +359,34 @@ struct music_module *init(const char *restrict name,
                           const char *restrict arg) {
 	struct module_config *cfg;
 	struct music_module *const m = music_init(MUSIC_OUT, sizeof *cfg);
+	int i;
 	(void)name; /* supress warning */
 	(void)arg;  /* supress warning */
 
+	m->start         = module_start;
 	m->free          = module_free;
 	m->config        = module_conf;
 	m->song.send     = module_send;
+	m->nowPlaying    = module_now;
 	cfg              = m->data;
 	cfg->username    = 0;
+	cfg->auth        = 0;
 	cfg->url         = 0;
+	cfg->unixSocket  = 0;
+	cfg->proxy       = 0;
+	cfg->keepAlive   = -1;
+	cfg->share       = 0;
 	cfg->gotPassword = 0;
 	cfg->verbose     = 0;
 	cfg->waitTill    = 0;
 	cfg->lastWait    = 0;
+	cfg->now         = 0;
+	cfg->compact     = 0;
+	memset(&cfg->requestRate, 0, sizeof cfg->requestRate);
+	memset(&cfg->songRate, 0, sizeof cfg->songRate);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+		pthread_mutex_init(cfg->shareMutex + i, 0);
+	}
 
 	if (music_run_once_check((void(*)(void))curl_global_init, 0)) {
 		curl_global_init(CURL_GLOBAL_ALL);
@@ -169,9 +404,50 @@ struct music_module *init(const char *restrict name,
 
 
 
+static int   module_start(const struct music_module *restrict m) {
+	struct module_config *const cfg = m->data;
+
+	/* Share connections between requests so they are reused across
+	   module_send() calls and threads. */
+	if (!cfg->share && (cfg->share = curl_share_init())) {
+		curl_share_setopt(cfg->share, CURLSHOPT_LOCKFUNC, share_lock);
+		curl_share_setopt(cfg->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+		curl_share_setopt(cfg->share, CURLSHOPT_USERDATA, (void*)cfg);
+		curl_share_setopt(cfg->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		if (curl_share_setopt(cfg->share, CURLSHOPT_SHARE,
+		                      CURL_LOCK_DATA_CONNECT) != CURLSHE_OK) {
+			music_log(m, LOG_WARNING,
+			          "CURL cannot share connections; they won't be reused");
+		}
+	}
+
+	cfg->requests        = music_metric(m, "requests", MUSIC_COUNTER);
+	cfg->requestErrors   = music_metric(m, "request_errors", MUSIC_COUNTER);
+	cfg->requestDuration = music_metric(m, "request_duration_us",
+	                                    MUSIC_HISTOGRAM);
+	cfg->ackLatency      = music_metric(m, "latency_ack_us", MUSIC_HISTOGRAM);
+	cfg->rateWait        = music_metric(m, "rate_limit_wait_us",
+	                                    MUSIC_COUNTER);
+
+	rate_init(&cfg->requestRate, music_time_us());
+	rate_init(&cfg->songRate, music_time_us());
+	return 1;
+}
+
+
+
 static void  module_free (struct music_module *restrict m) {
 	struct module_config *const cfg = m->data;
+	int i;
+	if (cfg->share) curl_share_cleanup(cfg->share);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+		pthread_mutex_destroy(cfg->shareMutex + i);
+	}
+	if (cfg->auth) auth_put(cfg->auth);
+	music_song_release(cfg->now);
 	free(cfg->username);
+	free(cfg->unixSocket);
+	free(cfg->proxy);
 	free(cfg->url);
 }
 
@@ -181,13 +457,21 @@ static int   module_conf (const struct music_module *restrict m,
                           const char *restrict opt,
                           const char *restrict arg) {
 	static const struct music_option options[] = {
-		{ "url",      1, 1 },
-		{ "username", 1, 2 },
-		{ "password", 1, 3 },
-		{ "verbose",  0, 4 },
+		{ "url",          1, 1 },
+		{ "username",     1, 2 },
+		{ "password",     1, 3 },
+		{ "verbose",      0, 4 },
+		{ "requestrate",  1, 5 },
+		{ "requestburst", 2, 6 },
+		{ "songrate",     1, 7 },
+		{ "songburst",    2, 8 },
+		{ "unix_socket",  1, 9 },
+		{ "proxy",        1, 10 },
+		{ "keepalive",    2, 11 },
 		{ 0, 0, 0 }
 	};
 	struct module_config *const cfg = m->data;
+	int option;
 
 	/* Check configuration */
 	if (!opt) {
@@ -205,11 +489,16 @@ static int   module_conf (const struct music_module *restrict m,
 			music_log(m, LOG_FATAL, "username set but password not");
 			ret = 0;
 		}
+		if (ret && cfg->username && !cfg->auth &&
+		    !(cfg->auth = auth_get(cfg->username, cfg->password))) {
+			music_log(m, LOG_FATAL, "not enough memory");
+			ret = 0;
+		}
 		return ret;
 	}
 
 	/* Accept options */
-	switch (music_config(m, options, opt, arg, 1)) {
+	switch (option = music_config(m, options, opt, arg, 1)) {
 	case 1:
 		cfg->url = music_strdup_realloc(cfg->url, arg);
 		break;
@@ -221,19 +510,61 @@ static int   module_conf (const struct music_module *restrict m,
 		}
 		{
 			size_t l = escapeLength(arg);
-			cfg->username = realloc(cfg->username, l);
+			cfg->username = realloc(cfg->username, l + 1);
 			escape(cfg->username, arg, l);
+			cfg->username[l] = 0;
 		}
 		break;
 
 	case 3:
 		sha1((uint8_t*)cfg->password, (uint8_t*)arg, strlen(arg));
+		cfg->gotPassword = 1;
 		break;
 
 	case 4:
 		cfg->verbose = 1;
 		break;
 
+	case 5:
+	case 7: {
+		struct rate_limit *const rl =
+			option == 5 ? &cfg->requestRate : &cfg->songRate;
+		char *end;
+		rl->rate = strtod(arg, &end);
+		if (*end || !(rl->rate >= 0)) {
+			music_log(m, LOG_FATAL, "%s: %s: non-negative number expected",
+			          opt, arg);
+			return 0;
+		}
+		break;
+	}
+
+	case 6:
+	case 8:
+		if (atol(arg) < 0) {
+			music_log(m, LOG_FATAL, "%s: %s: must not be negative", opt, arg);
+			return 0;
+		}
+		(option == 6 ? &cfg->requestRate : &cfg->songRate)->burst = atol(arg);
+		break;
+
+	case 9:
+		cfg->unixSocket = music_strdup_realloc(cfg->unixSocket, arg);
+		break;
+
+	case 10:
+		cfg->proxy = music_strdup_realloc(cfg->proxy,
+		                                  strcmp(arg, "none") ? arg : "");
+		break;
+
+	case 11:
+		if (atol(arg) < 0) {
+			music_log(m, LOG_FATAL, "%s: %s: must not be negative", opt, arg);
+			return 0;
+		}
+		cfg->keepAlive = atol(arg);
+		break;
+
 	default:
 		return 0;
 	}
@@ -244,6 +575,14 @@ static int   module_conf (const struct music_module *restrict m,
 
 
 
+/**
+ * Number of slots in compact batch's dictionary hash table.  There
+ * cannot be more strings in a request then half of it as each takes
+ * at least eight bytes of POST data.
+ */
+#define REQUEST_DICT_SLOTS 4096
+
+
 /**
  * Structure holding data for given request.
  */
@@ -255,6 +594,8 @@ struct request {
 
 	/** Array of songs to submit. */
 	const struct music_song *restrict const *songs;
+	/** Now playing song added to current request or NULL. */
+	const struct music_song *now;
 	/** Number of handled songs. */
 	size_t handled;
 
@@ -278,10 +619,39 @@ struct request {
 		char data[10240];
 	} post;
 
+	/** Whether songs are sent as a compact batch. */
+	int compact;
+
+	/**
+	 * Compact batch's string dictionary.  Strings are looked up in
+	 * a hash table with linear probing.
+	 */
+	struct request_dict {
+		/** Hash table of dictionary indexes plus one; zero means
+		 *  empty slot. */
+		unsigned short slots[REQUEST_DICT_SLOTS];
+		/** Dictionary's strings. */
+		struct request_dict_entry {
+			const char *str;      /**< The string. */
+			unsigned short slot;  /**< Its slot in hash table. */
+		} entries[REQUEST_DICT_SLOTS / 2];
+		/** Number of strings. */
+		size_t count;
+		/** Finish time of last song in the batch. */
+		long lastEnd;
+		/** Length of escaped strings joined with colons. */
+		size_t length;
+		/** Escaped strings joined with colons.  Not zero terminated. */
+		char data[10240];
+	} dict;
+
 	/** State of particular request. */
 	struct request_request {
 		/** Number of songs in single request. */
 		size_t count;
+		/** Maximal number of songs in single request so that it
+		 *  does not leave song rate limit in debt for long. */
+		size_t limit;
 		/** Number of handled songs in single request. */
 		size_t handled;
 	} request;
@@ -339,18 +709,61 @@ struct request {
  * aproprietly.
  *
  * @param r request data.
- * @param user user name.
- * @param pass password.
+ * @param auth authentication token.
+ */
+void request_addAuth (struct request *restrict r, struct auth *restrict auth)
+	__attribute__((nonnull));
+
+
+
+/**
+ * Adds an argument with a song to the request.  If there is not
+ * enough space in POST data buffer to add the song function will
+ * return 0.
+ *
+ * @param r request data.
+ * @param name argument's name followed by an equal sign.
+ * @param length length of name.
+ * @param song song to add.
+ * @return whether song was succesfully added.
+ */
+static int request_addArg(struct request *restrict r,
+                          const char *restrict name, size_t length,
+                          const struct music_song *restrict song)
+	__attribute__((nonnull));
+
+
+/**
+ * Looks string up in compact batch's dictionary adding it if it is
+ * not there yet.
+ *
+ * @param r request data.
+ * @param str string to look up.
+ * @return string's index or -1 if there is no room for it.
+ */
+static long request_dictIndex(struct request *restrict r,
+                              const char *restrict str)
+	__attribute__((nonnull));
+
+
+/**
+ * Writes number in hexadecimal without leading zeros.  Destination
+ * must have room for 2 * sizeof(unsigned long) characters.  This
+ * method does not terminate the string with a NUL byte.
+ *
+ * @param dest destination.
+ * @param value number to write.
+ * @return number of characters written.
  */
-void request_addAuth (struct request *restrict r,
-                      const char *restrict user, const char *restrict pass)
+static size_t hex(char *restrict dest, unsigned long value)
 	__attribute__((nonnull));
 
 
 
 /**
  * Adds a song to the request.  If there is not enough space in POST
- * data buffer to add the song function will return 0.
+ * data buffer to add the song function will return 0.  If request is
+ * a compact batch calls request_addCompact().
  *
  * @param r request data.
  * @param song song to add.
@@ -361,6 +774,30 @@ int  request_addSong (struct request *restrict r,
 	__attribute__((nonnull));
 
 
+/**
+ * Adds a song to the request as compact batch entry.  Song's strings
+ * are replaced with indexes to request's dictionary and finish time
+ * with difference from previous song's.  If there is not enough space
+ * for the entry and new dictionary strings request is left unchanged
+ * and function returns 0.
+ *
+ * @param r request data.
+ * @param song song to add.
+ * @return whether song was succesfully added.
+ */
+int  request_addCompact(struct request *restrict r,
+                        const struct music_song *restrict song)
+	__attribute__((nonnull));
+
+
+/**
+ * Clears request's compact batch dictionary.
+ *
+ * @param r request data.
+ */
+void request_dictClear(struct request *restrict r) __attribute__((nonnull));
+
+
 
 /**
  * Initialises CURL easy handler.
@@ -424,7 +861,6 @@ static int    got_debug (CURL *restrict curl, curl_infotype type,
                          void *restrict arg)       __attribute__((nonnull));
 
 
-
 /**
  * Called by request_gotHead() and request_gotBody().  Extracts single
  * line from data and handles it (calls request_handleLine()).
@@ -491,48 +927,66 @@ static int    module_send (const struct music_module *restrict m,
 	size_t handled;
 	int ret;
 
-	if (!*songs) {
+	if (!*songs && !__atomic_load_n(&cfg->now, __ATOMIC_RELAXED)) {
 		return 0;
 	}
 
 	if (cfg->waitTill && cfg->waitTill>time(0)) {
-		return -1;
+		return *songs ? -1 : 0;
 	}
 
 	if (!(r = malloc(sizeof *r))) {
-		return -1;
+		return *songs ? -1 : 0;
 	}
 	r->m = m;
 	r->songs = s = songs;
+	r->now = __atomic_exchange_n(&cfg->now, 0, __ATOMIC_ACQ_REL);
+	r->compact = cfg->compact > 0;
+	if (r->compact) {
+		request_dictClear(r);
+	}
 	r->error.positions = errorPositions;
 	r->handled = r->error.count = r->request.count = r->request.handled = 0;
+	r->request.limit = rate_room(&cfg->songRate, music_time_us());
 	r->buffer.length = r->buffer.capacity = 0;
 	r->buffer.data = 0;
 	r->curl = 0;
 
-	if (cfg->username) {
-		request_addAuth(r, cfg->username, cfg->password);
+	if (cfg->auth) {
+		request_addAuth(r, cfg->auth);
 	} else {
 		r->post.length = r->post.start = 0;
 	}
 
-	do {
-		if (request_addSong(r, *s)) {
+	/* Now playing song goes with the first request */
+	if (r->now && !request_addArg(r, "now=", 4, r->now)) {
+		music_log(r->m, LOG_WARNING, "Song name too long '%s <%s> %s'",
+		          r->now->artist ? r->now->artist : "(empty)",
+		          r->now->album  ? r->now->album  : "(empty)",
+		          r->now->title);
+		music_song_release(r->now);
+		r->now = 0;
+	}
+
+	for (;;) {
+		if (*s && request_addSong(r, *s)) {
 			++s;
-		} else if (!r->request.count) {
+		} else if (*s && !r->request.count && !r->now) {
 			music_log(r->m, LOG_WARNING,
 			          "Song name too long '%s <%s> %s'",
 			          (*s)->artist ? (*s)->artist : "(empty)",
 			          (*s)->album  ? (*s)->album  : "(empty)",
 			          (*s)->title  ? (*s)->title  : "(empty)");
 			++s;
-		} else if (!request_perform(r)) {
+			++r->handled;
+		} else if (!r->request.count && !r->now) {
+			break;
+		} else if (request_perform(r)) {
+			/* Songs of rejected compact batch are sent again */
+			s = r->songs + r->handled;
+		} else {
 			break;
 		}
-	} while (*s);
-
-	if (r->request.count) {
-		request_perform(r);
 	}
 
 	if (r->curl) {
@@ -550,7 +1004,7 @@ static int    module_send (const struct music_module *restrict m,
 		if (errorPositions) {
 			do errorPositions[ret++] = handled++; while (*++s);
 		} else {
-			while (*++s) ++ret;
+			do ++ret; while (*++s);
 		}
 	}
 
@@ -559,34 +1013,137 @@ static int    module_send (const struct music_module *restrict m,
 
 
 
-void request_addAuth(struct request *restrict r,
-                     const char *restrict user, const char *restrict pass) {
-	char *const data = r->post.data;
-	unsigned long t = time(0);
-	size_t pos, len;
+static void  module_now  (const struct music_module *restrict m,
+                          const struct music_song *restrict song) {
+	struct module_config *const cfg = m->data;
+	music_song_release(__atomic_exchange_n(&cfg->now,
+	                                       song ? music_song_ref(song) : 0,
+	                                       __ATOMIC_ACQ_REL));
+}
+
+
+
+/** List of authentication tokens. */
+static struct auth *auth_list = 0;
+
+/** Protects auth_list and tokens' reference counters. */
+static pthread_mutex_t auth_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-	pos = sprintf(data, "auth=pass:%s:%lx:", user, t);
-	memcpy(data + pos + 30, pass, 20);
-	len = 20 + sprintf(data + pos + 50, "%lx", t);
-	sha1_b64(data + pos, (unsigned char *)data + pos + 30, len);
-	r->post.start = r->post.length = pos + 27;
+
+
+static struct auth *auth_get(const char *restrict user,
+                             const char *restrict pass) {
+	const size_t len = strlen(user);
+	struct auth *auth;
+
+	pthread_mutex_lock(&auth_mutex);
+
+	for (auth = auth_list; auth; auth = auth->next) {
+		if (auth->prefixLength == len + 11 &&
+		    !memcmp(auth->token + 10, user, len) &&
+		    !memcmp(auth->password, pass, 20)) {
+			++auth->refs;
+			goto done;
+		}
+	}
+
+	/* Room for time, colon and 27 characters of base64 encoded hash */
+	if (!(auth = malloc(sizeof *auth + len + 11 + 64))) {
+		goto done;
+	}
+	auth->refs = 1;
+	auth->time = 0;
+	pthread_mutex_init(&auth->mutex, 0);
+	memcpy(auth->password, pass, 20);
+	auth->prefixLength = auth->length = sprintf(auth->token, "auth=pass:%s:",
+	                                            user);
+	auth->next = auth_list;
+	auth_list = auth;
+
+ done:
+	pthread_mutex_unlock(&auth_mutex);
+	return auth;
+}
+
+
+
+static void  auth_put(struct auth *restrict auth) {
+	struct auth **p;
+
+	pthread_mutex_lock(&auth_mutex);
+	if (--auth->refs) {
+		pthread_mutex_unlock(&auth_mutex);
+		return;
+	}
+	for (p = &auth_list; *p != auth; p = &(*p)->next);
+	*p = auth->next;
+	pthread_mutex_unlock(&auth_mutex);
+
+	pthread_mutex_destroy(&auth->mutex);
+	free(auth);
+}
+
+
+
+void request_addAuth(struct request *restrict r, struct auth *restrict auth) {
+	const unsigned long t = time(0);
+
+	pthread_mutex_lock(&auth->mutex);
+	if (auth->time != t) {
+		char buf[40], hash[29];
+		size_t len;
+
+		memcpy(buf, auth->password, 20);
+		len = 20 + sprintf(buf + 20, "%lx", t);
+		sha1_b64(hash, (unsigned char *)buf, len);
+
+		len = auth->prefixLength;
+		len += sprintf(auth->token + len, "%lx:", t);
+		memcpy(auth->token + len, hash, 27);
+		auth->length = len + 27;
+		auth->time   = t;
+	}
+	memcpy(r->post.data, auth->token, auth->length);
+	r->post.start = r->post.length = auth->length;
+	pthread_mutex_unlock(&auth->mutex);
 }
 
 
 
 int  request_addSong(struct request *restrict r,
                      const struct music_song *restrict song) {
+	if (r->request.count >= r->request.limit) {
+		return 0;
+	}
+	if (r->compact) {
+		return request_addCompact(r, song);
+	}
+	if (!request_addArg(r, "song[]=", 7, song)) {
+		return 0;
+	}
+	++r->request.count;
+	return 1;
+}
+
+
+
+static int request_addArg(struct request *restrict r,
+                          const char *restrict name, size_t length,
+                          const struct music_song *restrict song) {
 	size_t i = r->post.length, capacity = sizeof(r->post.data) - i;
 	char *data = r->post.data + i;
 
-	if (capacity < 13) {
+	if (capacity < length + 6) {
 		return 0;
 	}
 
 	/* Field name */
-	i = i ? 8 : 7;
-	memcpy(data, "&song[]=" + 8 - i, i);
-	data += i; capacity -= i;
+	if (i) {
+		*data++ = '&';
+		--capacity;
+	}
+	memcpy(data, name, length);
+	data += length; capacity -= length;
 
 	/* String arguments */
 	{
@@ -601,7 +1158,7 @@ int  request_addSong(struct request *restrict r,
 			const size_t add = arr[i] ? escape(data, arr[i], capacity) : 0;
 			if (add+1>=capacity) return 0;
 			data[add] = ':';
-			data += add + 1; capacity -= add - 1;
+			data += add + 1; capacity -= add + 1;
 		} while (++i<4);
 	}
 
@@ -609,15 +1166,154 @@ int  request_addSong(struct request *restrict r,
 	{
 		int ret = snprintf(data, capacity, "%x:%lx", song->length,
 		                   (unsigned long)song->endTime);
-		if (ret<0 || (size_t)ret>capacity) {
+		if (ret<0 || (size_t)ret>=capacity) {
 			return 0;
 		}
 		data += (size_t)ret;
 	}
 
 	r->post.length = data - r->post.data;
+	return 1;
+}
+
+
+
+int  request_addCompact(struct request *restrict r,
+                        const struct music_song *restrict song) {
+	struct request_dict *const d = &r->dict;
+	const size_t count = d->count, dictLength = d->length;
+	size_t i = r->post.length, capacity = sizeof(r->post.data) - i;
+	char *data = r->post.data + i;
+	const long end = (long)song->endTime;
+	const long delta = r->request.count ? end - d->lastEnd : end;
+	size_t n;
+
+	if (capacity < 12) {
+		return 0;
+	}
+
+	/* Field name */
+	if (i) {
+		*data++ = '&';
+		--capacity;
+	}
+	memcpy(data, "c[]=", 4);
+	data += 4; capacity -= 4;
+
+	/* Dictionary indexes */
+	{
+		const char *arr[4];
+		arr[0] = song->title;
+		arr[1] = song->artist;
+		arr[2] = song->album;
+		arr[3] = song->genre;
+
+		i = 0;
+		do {
+			const long index = arr[i] ? request_dictIndex(r, arr[i]) : -2;
+			if (index == -1 || capacity < 5) goto fail;
+			n = index < 0 ? 0 : hex(data, index);
+			data[n] = ':';
+			data += n + 1; capacity -= n + 1;
+		} while (++i<4);
+	}
+
+	/* Length and finish time delta */
+	if (capacity < 2 * sizeof(unsigned long) * 2 + 3) goto fail;
+	data += hex(data, song->length);
+	*data++ = ':';
+	if (delta < 0) {
+		*data++ = '-';
+		data += hex(data, -(unsigned long)delta);
+	} else {
+		data += hex(data, delta);
+	}
+
+	/* Dictionary has to fit as well */
+	if ((size_t)(data - r->post.data) + 3 + d->length > sizeof r->post.data) {
+		goto fail;
+	}
+
+	r->post.length = data - r->post.data;
+	d->lastEnd = end;
 	++r->request.count;
 	return 1;
+
+ fail:
+	/* Strings added last do not lie on probe sequences of earlier
+	   ones so they can be simply removed. */
+	for (i = count; i < d->count; ++i) {
+		d->slots[d->entries[i].slot] = 0;
+	}
+	d->count  = count;
+	d->length = dictLength;
+	return 0;
+}
+
+
+
+static long request_dictIndex(struct request *restrict r,
+                              const char *restrict str) {
+	struct request_dict *const d = &r->dict;
+	const size_t sep = d->count ? 1 : 0;
+	uint_least32_t hash = 2166136261u;
+	const unsigned char *ch;
+	unsigned slot;
+	size_t n;
+
+	for (ch = (const unsigned char *)str; *ch; ++ch) {
+		hash = (hash ^ *ch) * 16777619u;
+	}
+
+	for (slot = hash & (REQUEST_DICT_SLOTS - 1); d->slots[slot];
+	     slot = (slot + 1) & (REQUEST_DICT_SLOTS - 1)) {
+		const char *const s = d->entries[d->slots[slot] - 1].str;
+		/* Songs from dispatcher are interned so pointers usually match */
+		if (s == str || !strcmp(s, str)) {
+			return d->slots[slot] - 1;
+		}
+	}
+
+	if (d->count >= REQUEST_DICT_SLOTS / 2 ||
+	    d->length + sep >= sizeof d->data) {
+		return -1;
+	}
+	n = escape(d->data + d->length + sep, str,
+	           sizeof d->data - d->length - sep);
+	if (d->length + sep + n > sizeof d->data) {
+		return -1;
+	}
+
+	if (sep) {
+		d->data[d->length] = ':';
+	}
+	d->length += sep + n;
+	d->entries[d->count].str  = str;
+	d->entries[d->count].slot = slot;
+	d->slots[slot] = ++d->count;
+	return d->count - 1;
+}
+
+
+
+static size_t hex(char *restrict dest, unsigned long value) {
+	char buf[2 * sizeof(unsigned long)], *p = buf + sizeof buf;
+	size_t n;
+	do {
+		*--p = "0123456789abcdef"[value & 15];
+	} while (value >>= 4);
+	n = buf + sizeof buf - p;
+	memcpy(dest, p, n);
+	return n;
+}
+
+
+
+void request_dictClear(struct request *restrict r) {
+	memset(r->dict.slots, 0, sizeof r->dict.slots);
+	r->dict.count   = 0;
+	r->dict.length  = 0;
+	r->dict.lastEnd = 0;
 }
 
 
@@ -632,6 +1328,25 @@ void request_curlInit(struct request *restrict r) {
 	curl_easy_setopt(curl, CURLOPT_WRITEHEADER   , (void*)r);
 	curl_easy_setopt(curl, CURLOPT_URL           , cfg->url);
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER    , (void*)&headers);
+	if (cfg->share) {
+		curl_easy_setopt(curl, CURLOPT_SHARE     , cfg->share);
+	}
+	if (cfg->unixSocket) {
+		curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, cfg->unixSocket);
+	}
+	if (cfg->proxy) {
+		curl_easy_setopt(curl, CURLOPT_PROXY     , cfg->proxy);
+	}
+	if (!cfg->keepAlive) {
+		curl_easy_setopt(curl, CURLOPT_FORBID_REUSE  , 1L);
+	} else if (cfg->keepAlive > 0) {
+		/* Probe idle connection so a dead one is noticed before
+		   it is reused. */
+		curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN   , cfg->keepAlive);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE , 1L);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE  , cfg->keepAlive / 2 + 1);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL , cfg->keepAlive / 2 + 1);
+	}
 	if (cfg->verbose) {
 		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION , got_debug);
 		curl_easy_setopt(curl, CURLOPT_DEBUGDATA     , (void*)r->m);
@@ -663,8 +1378,10 @@ int  request_perform(struct request *restrict r) {
 	};
 
 	struct module_config *const cfg = r->m->data;
+	struct timespec start, end;
 	unsigned wait;
 	CURLcode code;
+	int interrupted = 0, rejected;
 
 	/* Intialise CURL */
 	if (!r->curl) {
@@ -677,19 +1394,62 @@ int  request_perform(struct request *restrict r) {
 	r->request.handled = 0;
 	r->buffer.length   = 0;
 
-	/* Set POST data */
-	curl_easy_setopt(r->curl, CURLOPT_POSTFIELDS   , r->post.data);
-	curl_easy_setopt(r->curl, CURLOPT_POSTFIELDSIZE, (long)r->post.length);
+	/* Wait if we would exceed rate limits rather then let server
+	   throttle us */
+	{
+		const unsigned long long now = music_time_us();
+		unsigned long long w1 = rate_take(&cfg->requestRate, 1, now);
+		unsigned long long w2 = rate_take(&cfg->songRate, r->request.count,
+		                                  now);
+		w1 = w1 > w2 ? w1 : w2;
+		/* When woken up because core reloads configuration send
+		   anyway; tokens were taken so later requests pay the debt */
+		if (w1) {
+			music_metric_add(cfg->rateWait, w1);
+			interrupted = music_sleep(r->m, (w1 + 999) / 1000) <= 0 &&
+				!music_module_running(r->m);
+		}
+	}
+
+	if (!interrupted) {
+		/* Compact batch's dictionary goes last; request_addCompact()
+		   made sure it fits */
+		if (r->compact && r->request.count) {
+			memcpy(r->post.data + r->post.length, "&d=", 3);
+			memcpy(r->post.data + r->post.length + 3, r->dict.data,
+			       r->dict.length);
+			r->post.length += 3 + r->dict.length;
+		}
+
+		/* Set POST data */
+		curl_easy_setopt(r->curl, CURLOPT_POSTFIELDS   , r->post.data);
+		curl_easy_setopt(r->curl, CURLOPT_POSTFIELDSIZE, (long)r->post.length);
+
+		/* Perform */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		code = curl_easy_perform(r->curl);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (code!=CURLE_OK) {
+			music_log(r->m, LOG_ERROR, "CURL: %s", curl_easy_strerror(code));
+			r->exitCode = RT_CURL_ERROR;
+		}
 
-	/* Perform */
-	code = curl_easy_perform(r->curl);
-	if (code!=CURLE_OK) {
-		music_log(r->m, LOG_ERROR, "CURL: %s", curl_easy_strerror(code));
-		r->exitCode = RT_CURL_ERROR;
+		music_metric_add(cfg->requests, 1);
+		music_metric_observe(cfg->requestDuration,
+		                     (end.tv_sec - start.tv_sec) * 1000000ll +
+		                     (end.tv_nsec - start.tv_nsec) / 1000);
+		if (r->exitCode!=RT_OK) {
+			music_metric_add(cfg->requestErrors, 1);
+		}
 	}
 
+	/* Server announced compact batches but does not take them; songs
+	   are not errors as they will be sent again in a plain batch */
+	rejected = !interrupted && r->compact && r->exitCode==RT_HTTP_400 &&
+		!r->request.handled;
+
 	/* Handle unhandled */
-	if (r->request.count == r->request.handled) {
+	if (rejected || r->request.count == r->request.handled) {
 		/* do nothing */
 	} else if (!r->error.positions) {
 		r->error.count += r->request.count - r->request.handled;
@@ -704,14 +1464,46 @@ int  request_perform(struct request *restrict r) {
 		r->error.count = pos;
 	}
 
+	/* Now playing song is sent once; on failure it is kept unless
+	   a newer one arrived meanwhile */
+	if (r->now) {
+		const struct music_song *expected = 0;
+		if (interrupted || r->exitCode!=RT_OK) {
+			if (__atomic_compare_exchange_n(&cfg->now, &expected, r->now, 0,
+			                                __ATOMIC_ACQ_REL,
+			                                __ATOMIC_RELAXED)) {
+				r->now = 0;
+			}
+		}
+		music_song_release(r->now);
+		r->now = 0;
+	}
+
 	/* Finalize */
-	r->handled        += r->request.count;
+	if (r->compact) {
+		request_dictClear(r);
+	}
+	if (!rejected) {
+		r->handled    += r->request.count;
+	}
+	r->post.length     = r->post.start;
 	r->request.count   = 0;
 	r->request.handled = 0;
+	r->request.limit   = rate_room(&cfg->songRate, music_time_us());
 	r->buffer.length   = 0;
 
 	/* Analise exit code */
-	if (r->exitCode==RT_OK) {
+	if (interrupted) {
+		/* Core is terminating; don't back off but give up */
+		return 0;
+	} else if (rejected) {
+		/* No need to back off, caller resends songs as plain batch */
+		music_log(r->m, LOG_WARNING,
+		          "Compact batch rejected; resending as plain one.");
+		cfg->compact = -1;
+		r->compact = 0;
+		return 1;
+	} else if (r->exitCode==RT_OK) {
 		cfg->lastWait = 0;
 		cfg->waitTill = 0;
 		return 1;
@@ -735,8 +1527,20 @@ int  request_perform(struct request *restrict r) {
 size_t request_gotHead(const char *restrict data, size_t size, size_t n,
                        void *restrict arg) {
 	struct request *const r = arg;
+	struct module_config *const cfg = r->m->data;
 
 	size *= n;
+
+	/* Server accepts compact batches */
+	if (!cfg->compact && size > 14 &&
+	    !strncasecmp(data, "x-music-batch:", 14)) {
+		for (n = 14; n + 4 <= size && strncasecmp(data + n, "dict", 4); ++n);
+		if (n + 4 <= size) {
+			music_log(r->m, LOG_DEBUG, "Server accepts compact batches.");
+			cfg->compact = 1;
+		}
+	}
+
 	switch (r->state) {
 	case ST_IGNORE:
 	case ST_HEADER_END:
@@ -828,7 +1632,7 @@ void   request_appendBuffer(struct request *restrict r,
 	size_t len  = r->buffer.length + size + 1;
 	size_t need = ((len + 16 + 127) & ~(size_t)127) - 16;
 
-	if (need < r->buffer.capacity) {
+	if (need > r->buffer.capacity) {
 		r->buffer.data = realloc(r->buffer.data, need);
 		r->buffer.capacity = need;
 	}
@@ -1003,8 +1807,24 @@ int    request_handleLine(struct request *restrict r,
 
 
 
+/**
+ * Tells whether song's status is given word.  Status may be followed
+ * by a message separated with a space.
+ *
+ * @param data status and optional message.
+ * @param word status to compare with.
+ * @param len word's length.
+ * @return non-zero if status is word.
+ */
+static int   request_isStatus(const char *restrict data,
+                              const char *restrict word, size_t len) {
+	return !strncmp(data, word, len) && (!data[len] || data[len]==' ');
+}
+
+
 int    request_handleBodyCont(struct request *restrict r,
                               const char *restrict data) {
+	struct module_config *const cfg = r->m->data;
 	const struct music_song *restrict const *s;
 	size_t base, handled;
 	unsigned num;
@@ -1016,6 +1836,11 @@ int    request_handleBodyCont(struct request *restrict r,
 		return 1;
 	}
 
+	if (!strncmp(data, "SONG -1 ", 8)) {
+		music_log(r->m, LOG_DEBUG, "Now playing song: %s", data + 8);
+		return 1;
+	}
+
 	if (sscanf(data, "SONG %u %n", &num, &pos)<1) {
 		music_log(r->m, LOG_DEBUG, "ignoring line: %s", data);
 		return 1;
@@ -1023,14 +1848,14 @@ int    request_handleBodyCont(struct request *restrict r,
 	data += pos;
 
 	handled = r->request.handled;
-	if (num < handled || num > r->request.count) {
+	if (num < handled || num >= r->request.count) {
 		music_log(r->m, LOG_DEBUG, "ignoring line: %s", data);
 		return 1;
 	}
 
 
 	base = r->handled;
-	s = r->songs + base;
+	s = r->songs + base + handled;
 	do {
 		const char *msg;
 		int log, err;
@@ -1040,17 +1865,17 @@ int    request_handleBodyCont(struct request *restrict r,
 			msg   = "Missing status line for '%s <%s> %s'";
 			log   = LOG_WARNING;
 			err   = 1;
-		} else if (!strcmp(data, "OK")) {
-			data += 0;
+		} else if (request_isStatus(data, "OK", 2)) {
+			data += 2;
 			msg   = "Song '%s <%s> %s' added.";
 			log   = LOG_DEBUG;
 			err   = 0;
-		} else if (!strcmp(data, "REJ")) {
+		} else if (request_isStatus(data, "REJ", 3)) {
 			data += 3;
 			msg   = "Song '%s <%s> %s' rejected:%s";
 			log   = LOG_WARNING;
 			err   = 0;
-		} else if (!strcmp(data, "FAIL")) {
+		} else if (request_isStatus(data, "FAIL", 4)) {
 			data += 4;
 			msg   = "Error when adding '%s <%s> %s':%s";
 			log   = LOG_NOTICE;
@@ -1068,9 +1893,9 @@ int    request_handleBodyCont(struct request *restrict r,
 		          (*s)->title  ? (*s)->title  : "(empty)", data);
 
 		if (!err) {
-			/* do nothing */
+			music_metric_observe(cfg->ackLatency, music_time_us() - (*s)->ingest);
 		} else if (r->error.positions) {
-			r->error.positions[r->error.count++] = base + num;
+			r->error.positions[r->error.count++] = base + handled;
 		} else {
 			++r->error.count;
 		}
@@ -1085,6 +1910,7 @@ int    request_handleBodyCont(struct request *restrict r,
 
 
 
+
 /**
  * Tells whether character needs to be escaped.
  *
@@ -1170,6 +1996,10 @@ static int    got_debug (CURL *restrict curl, curl_infotype type,
 
 	(void)curl;
 
+	if (!music_log_enabled((const struct music_module *)arg, LOG_DEBUG)) {
+		return 0;
+	}
+
 	ch = data;
 	do {
 		for (data = ch; ch!=end && *ch!='\n' && *ch!='\r'; ++ch);
@@ -1187,3 +2017,19 @@ static int    got_debug (CURL *restrict curl, curl_infotype type,
 	free(str);
 	return 0;
 }
+
+
+
+static void   share_lock(CURL *curl, curl_lock_data data,
+                         curl_lock_access access, void *arg) {
+	(void)curl;
+	(void)access;
+	pthread_mutex_lock(((struct module_config *)arg)->shareMutex + data);
+}
+
+
+
+static void   share_unlock(CURL *curl, curl_lock_data data, void *arg) {
+	(void)curl;
+	pthread_mutex_unlock(((struct module_config *)arg)->shareMutex + data);
+}
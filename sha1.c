@@ -162,7 +162,8 @@ char    *sha1_b64(char hash[29], const unsigned char *message,
  * @return value rotatt n bits left.
  */
 #if 1
-#  define ROL(value, n) ((uint32_t)(value) << (n)) | ((uint32_t)(value) >> (32 - (n)));
+#  define ROL(value, n) \
+	(((uint32_t)(value) << (n)) | ((uint32_t)(value) >> (32 - (n))))
 #else
 static inline uint32_t ROL(const uint32_t value, const unsigned n) __attribute__((always_inline));
 static inline uint32_t ROL(const uint32_t value, const unsigned n) {
@@ -171,97 +172,265 @@ static inline uint32_t ROL(const uint32_t value, const unsigned n) {
 #endif
 
 
+/**
+ * Performs single SHA1 round.  Reads and modifies a, b, c, d and e
+ * variables.
+ *
+ * @param f value of round's function plus round's constant.
+ * @param w round's message word.
+ */
+#define SHA1_ROUND(f, w) do {							\
+		const uint32_t t = ROL(a, 5) + (f) + e + (w);	\
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;		\
+	} while (0)
+
+
+/** Defined as 1 when x86 SIMD implementations are compiled in. */
+#if (defined __x86_64__ || defined __i386__) && defined __GNUC__ && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define SHA1_X86 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+#else
+#  define SHA1_X86 0
+#endif
+
 
 
 /**
- * Handles single 512-bit long (64-byte long) block.
+ * Handles 512-bit long (64-byte long) blocks.
  *
- * @param block 512-bit long block to handle.
  * @param state SHA1 state.
+ * @param block blocks to handle.
+ * @param n number of blocks.
  */
-static void sha1_block(const unsigned char *restrict block,
-                       uint32_t *restrict state)
-	__attribute__((nonnull));
-static void sha1_block(const unsigned char *restrict block,
-                       uint32_t *restrict state) {
-	uint32_t w[16], a = state[0], b = state[1], c = state[2], d = state[3],
-		e = state[4];
-	unsigned i;
+typedef void sha1_blocks_func(uint32_t *restrict state,
+                              const unsigned char *restrict block,
+                              unsigned long n);
+
+
+/** Portable implementation.  See sha1_blocks_func. */
+static sha1_blocks_func sha1_blocks_generic __attribute__((nonnull));
+
+#if SHA1_X86
+/** Implementation using SHA extensions.  See sha1_blocks_func. */
+static sha1_blocks_func sha1_blocks_shani __attribute__((nonnull));
+#endif
+
+
+/**
+ * Available implementations in order of preference.
+ */
+static const struct sha1_impl {
+	const char *name;           /**< Implementation's name. */
+	sha1_blocks_func *blocks;   /**< Block function. */
+	unsigned features;          /**< Required CPU features. */
+} sha1_impls[] = {
+#if SHA1_X86
+	{ "shani",   sha1_blocks_shani,   7 },
+#endif
+	{ "generic", sha1_blocks_generic, 0 },
+};
+
+
+/**
+ * Returns CPU features the implementations care about: bit 0 is
+ * SSSE3, bit 1 is SSE4.1 and bit 2 is SHA extensions.
+ *
+ * @return bitmask of CPU features.
+ */
+static unsigned sha1_cpu_features(void);
 
-	/*  0 <= i < 16 */
-	for (i = 0; i < 16; ++i) {
-		uint32_t f = 0x5A827999 + (d ^ (b & (c ^ d)));
-		w[i] = BE2INT(block);
-		block += 4;
-		f += ROL(a, 5) + e + w[i];
-		e = d; d = c; c = ROL(b, 30); b = a; a = f;
-	}
 
-	/* 16 <= i < 20 */
-	for (; i < 20; ++i) {
-		uint32_t f = 0x5A827999 + (d ^ (b & (c ^ d)));
-		unsigned j = i & 15;
-		w[j] = ROL(w[(j+13)&15] ^ w[(j+8)&15] ^ w[(j+2)&15] ^ w[j], 1);
-		f += ROL(a, 5) + e + w[j];
-		e = d; d = c; c = ROL(b, 30); b = a; a = f;
+/**
+ * Returns block function to use.  Implementation is chosen on first
+ * call.
+ *
+ * @return block function.
+ */
+static sha1_blocks_func *sha1_blocks(void);
+
+
+
+static unsigned sha1_cpu_features(void) {
+	unsigned features = 0;
+#if SHA1_X86
+	unsigned a, b, c, d;
+	if (__get_cpuid(1, &a, &b, &c, &d)) {
+		features |= (c & (1u << 9)) ? 1 : 0;
+		features |= (c & (1u << 19)) ? 2 : 0;
+	}
+	if (__get_cpuid_max(0, 0) >= 7) {
+		__cpuid_count(7, 0, a, b, c, d);
+		features |= (b & (1u << 29)) ? 4 : 0;
 	}
+#endif
+	return features;
+}
+
 
-	/* 20 <= i < 40 */
-	for (; i < 40; ++i) {
-		uint32_t f = 0x6ED9EBA1 + (b ^ c ^ d);
-		unsigned j = i & 15;
-		w[j] = ROL(w[(j+13)&15] ^ w[(j+8)&15] ^ w[(j+2)&15] ^ w[j], 1);
-		f += ROL(a, 5) + e + w[j];
-		e = d; d = c; c = ROL(b, 30); b = a; a = f;
+
+/** Block function in use or NULL if not chosen yet. */
+static sha1_blocks_func *sha1_blocks_chosen = 0;
+
+static sha1_blocks_func *sha1_blocks(void) {
+	sha1_blocks_func *blocks =
+		__atomic_load_n(&sha1_blocks_chosen, __ATOMIC_RELAXED);
+	if (!blocks) {
+		const unsigned features = sha1_cpu_features();
+		const struct sha1_impl *impl = sha1_impls;
+		while ((impl->features & features) != impl->features) ++impl;
+		blocks = impl->blocks;
+		__atomic_store_n(&sha1_blocks_chosen, blocks, __ATOMIC_RELAXED);
 	}
+	return blocks;
+}
+
+
+
+static void sha1_blocks_generic(uint32_t *restrict state,
+                                const unsigned char *restrict block,
+                                unsigned long n) {
+	for (; n; --n) {
+		uint32_t w[16], a = state[0], b = state[1], c = state[2],
+			d = state[3], e = state[4];
+		unsigned i;
+
+#define W(j) (w[(j) & 15] = ROL(w[((j)+13)&15] ^ w[((j)+8)&15] ^	\
+                                w[((j)+2)&15] ^ w[(j)&15], 1))
+
+		/*  0 <= i < 16 */
+		for (i = 0; i < 16; ++i) {
+			w[i] = BE2INT(block);
+			block += 4;
+			SHA1_ROUND(0x5A827999 + (d ^ (b & (c ^ d))), w[i]);
+		}
+
+		/* 16 <= i < 20 */
+		for (; i < 20; ++i) {
+			SHA1_ROUND(0x5A827999 + (d ^ (b & (c ^ d))), W(i));
+		}
+
+		/* 20 <= i < 40 */
+		for (; i < 40; ++i) {
+			SHA1_ROUND(0x6ED9EBA1 + (b ^ c ^ d), W(i));
+		}
+
+		/* 40 <= i < 60 */
+		for (; i < 60; ++i) {
+			SHA1_ROUND(0x8F1BBCDC + ((b & c) | (d & (b | c))), W(i));
+		}
 
-	/* 40 <= i < 60 */
-	for (; i < 60; ++i) {
-		uint32_t f = 0x8F1BBCDC + ((b & c) | (d & (b | c)));
-		unsigned j = i & 15;
-		w[j] = ROL(w[(j+13)&15] ^ w[(j+8)&15] ^ w[(j+2)&15] ^ w[j], 1);
-		f += ROL(a, 5) + e + w[j];
-		e = d; d = c; c = ROL(b, 30); b = a; a = f;
+		/* 60 <= i < 80 */
+		for (; i < 80; ++i) {
+			SHA1_ROUND(0xCA62C1D6 + (b ^ c ^ d), W(i));
+		}
+
+#undef W
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e;
 	}
+}
+
+
+
+#if SHA1_X86
+/**
+ * Performs four SHA1 rounds using SHA extensions.  Message words are
+ * kept in m[0..3] and next message words are computed as we go.
+ * Arguments must be constants.
+ *
+ * @param g number of four-round group from 0 to 19.
+ * @param cur e register used by this group.
+ * @param next e register which will be used by next group.
+ */
+#define SHA1_ROUNDS4(g, cur, next) do {									\
+		if ((g) == 0) {													\
+			cur = _mm_add_epi32(cur, m[0]);								\
+		} else {														\
+			cur = _mm_sha1nexte_epu32(cur, m[(g) & 3]);					\
+		}																\
+		next = abcd;													\
+		if ((g) >= 3 && (g) <= 18) {									\
+			m[((g)+1) & 3] = _mm_sha1msg2_epu32(m[((g)+1) & 3], m[(g) & 3]); \
+		}																\
+		abcd = _mm_sha1rnds4_epu32(abcd, cur, (g) / 5);					\
+		if ((g) >= 1 && (g) <= 16) {									\
+			m[((g)+3) & 3] = _mm_sha1msg1_epu32(m[((g)+3) & 3], m[(g) & 3]); \
+		}																\
+		if ((g) >= 2 && (g) <= 17) {									\
+			m[((g)+2) & 3] = _mm_xor_si128(m[((g)+2) & 3], m[(g) & 3]); \
+		}																\
+	} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_blocks_shani(uint32_t *restrict state,
+                              const unsigned char *restrict block,
+                              unsigned long n) {
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+	                                   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i abcd = _mm_shuffle_epi32(
+		_mm_loadu_si128((const __m128i *)state), 0x1B);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0), e1;
+
+	for (; n; --n, block += 64) {
+		const __m128i abcdSave = abcd, eSave = e0;
+		__m128i m[4];
+		unsigned i;
+
+		for (i = 0; i < 4; ++i) {
+			m[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(block + 16 * i)), bswap);
+		}
 
-	/* 60 <= i < 80 */
-	for (; i < 80; ++i) {
-		uint32_t f = 0xCA62C1D6 + (b ^ c ^ d);
-		unsigned j = i & 15;
-		w[j] = ROL(w[(j+13)&15] ^ w[(j+8)&15] ^ w[(j+2)&15] ^ w[j], 1);
-		f += ROL(a, 5) + e + w[j];
-		e = d; d = c; c = ROL(b, 30); b = a; a = f;
+		SHA1_ROUNDS4( 0, e0, e1); SHA1_ROUNDS4( 1, e1, e0);
+		SHA1_ROUNDS4( 2, e0, e1); SHA1_ROUNDS4( 3, e1, e0);
+		SHA1_ROUNDS4( 4, e0, e1); SHA1_ROUNDS4( 5, e1, e0);
+		SHA1_ROUNDS4( 6, e0, e1); SHA1_ROUNDS4( 7, e1, e0);
+		SHA1_ROUNDS4( 8, e0, e1); SHA1_ROUNDS4( 9, e1, e0);
+		SHA1_ROUNDS4(10, e0, e1); SHA1_ROUNDS4(11, e1, e0);
+		SHA1_ROUNDS4(12, e0, e1); SHA1_ROUNDS4(13, e1, e0);
+		SHA1_ROUNDS4(14, e0, e1); SHA1_ROUNDS4(15, e1, e0);
+		SHA1_ROUNDS4(16, e0, e1); SHA1_ROUNDS4(17, e1, e0);
+		SHA1_ROUNDS4(18, e0, e1); SHA1_ROUNDS4(19, e1, e0);
+
+		e0   = _mm_sha1nexte_epu32(e0, eSave);
+		abcd = _mm_add_epi32(abcd, abcdSave);
 	}
 
-	state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
 }
 
+#undef SHA1_ROUNDS4
+#endif
+
 
 
-unsigned char *sha1(unsigned char *hash, const unsigned char *message,
+unsigned char *sha1(unsigned char hash[20], const unsigned char *message,
                     unsigned long len) {
 	uint32_t state[5] = {
 		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
 	}, i;
-	uint8_t block[64];
+	sha1_blocks_func *const blocks = sha1_blocks();
+	uint8_t block[128];
 
-	for (i = len; i>=64; i -= 64) {
-		sha1_block(message, state);
-		message += 64;
+	if (len >= 64) {
+		blocks(state, message, len / 64);
+		message += len & ~63ul;
 	}
 
+	i = len & 63;
 	memcpy(block, message, i);
 	block[i] = 0x80;
-	memset(block+i+1, 0, 63 - i);
+	memset(block+i+1, 0, 127 - i);
 
-	if (i+9>64) {
-		sha1_block(block, state);
-		memset(block, 0, i+1);
-	}
-
-	INT2BE(block+56, len>>29);
-	INT2BE(block+60, len<<3);
-	sha1_block(block, state);
+	/* One or two final blocks */
+	i = i+9>64 ? 64 : 0;
+	INT2BE(block+i+56, len>>29);
+	INT2BE(block+i+60, len<<3);
+	blocks(state, block, i ? 2 : 1);
 
 	for (i = 0; i < 5; ++i) {
 		INT2BE(hash + (i<<2), state[i]);
@@ -275,9 +444,15 @@ unsigned char *sha1(unsigned char *hash, const unsigned char *message,
 /******************** Tests ********************/
 #ifdef SHA1_COMPILE_TEST
 #include <stdlib.h>
+#include <time.h>
 
 
-int main(void) {
+/**
+ * Runs test vectors using currently chosen implementation.
+ *
+ * @return whether all tests passed.
+ */
+static int sha1_test(void) {
 	static const struct test {
 		const char *const text;
 		const unsigned repeat;
@@ -305,7 +480,7 @@ int main(void) {
 	unsigned char *buffer = 0;
 	char hash[41];
 	size_t capacity = 0;
-	int result = EXIT_SUCCESS, cmp;
+	int result = 1, cmp;
 
 	for (test = tests; test->text; ++test) {
 		const size_t slen = strlen(test->text), rep = test->repeat;
@@ -315,8 +490,8 @@ int main(void) {
 		if (capacity < len) {
 			unsigned char *tmp = realloc(buffer, len);
 			if (!tmp) {
-				printf("%02d: ERR not enough memory\n", test - tests);
-				result = EXIT_FAILURE;
+				printf("%02d: ERR not enough memory\n", (int)(test - tests));
+				result = 0;
 				continue;
 			}
 			buffer = tmp;
@@ -329,14 +504,89 @@ int main(void) {
 
 		sha1_hex(hash, buffer, len);
 		cmp = memcmp(hash, test->result, 40);
-		printf("%02d: %s %s ", test - tests, cmp ? "ERR" : "OK ", hash);
+		printf("%02d: %s %s ", (int)(test - tests), cmp ? "ERR" : "OK ", hash);
 		sha1_b64(hash, buffer, len);
 		puts(hash);
 		if (cmp) {
+			result = 0;
+		}
+	}
+
+	free(buffer);
+	return result;
+}
+
+
+/**
+ * Measures throughput of currently chosen implementation and prints
+ * it.
+ *
+ * @param name implementation's name.
+ */
+static void sha1_bench(const char *name) {
+	static const unsigned long sizes[] = { 64, 1024, 65536 };
+	static unsigned char buffer[65536];
+	unsigned char hash[20];
+	unsigned i;
+
+	for (i = 0; i < sizeof sizes / sizeof *sizes; ++i) {
+		const unsigned long n = (64ul << 20) / (sizes[i] + 64);
+		struct timespec start, end;
+		unsigned long j;
+		double sec;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < n; ++j) {
+			buffer[0] = j;
+			sha1(hash, buffer, sizes[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-8s %6lu bytes: %9.1f ns/hash %8.1f MB/s\n", name, sizes[i],
+		       sec * 1e9 / n, n * sizes[i] / sec / 1e6);
+	}
+}
+
+
+int main(void) {
+#if !HAVE_OPENSSL_H
+	const unsigned features = sha1_cpu_features();
+	const struct sha1_impl *impl = sha1_impls;
+	const struct sha1_impl *const end =
+		sha1_impls + sizeof sha1_impls / sizeof *sha1_impls;
+	int result = EXIT_SUCCESS;
+
+	printf("default implementation: ");
+	for (; impl != end && impl->blocks != sha1_blocks(); ++impl);
+	puts(impl != end ? impl->name : "?");
+
+	for (impl = sha1_impls; impl != end; ++impl) {
+		if ((impl->features & features) != impl->features) {
+			printf("%s: not supported by CPU\n", impl->name);
+			continue;
+		}
+		sha1_blocks_chosen = impl->blocks;
+		printf("%s:\n", impl->name);
+		if (!sha1_test()) {
 			result = EXIT_FAILURE;
 		}
 	}
 
+	for (impl = sha1_impls; impl != end; ++impl) {
+		if ((impl->features & features) == impl->features) {
+			sha1_blocks_chosen = impl->blocks;
+			sha1_bench(impl->name);
+		}
+	}
+
 	return result;
+#else
+	if (!sha1_test()) {
+		return EXIT_FAILURE;
+	}
+	sha1_bench("openssl");
+	return EXIT_SUCCESS;
+#endif
 }
 #endif
@@ -0,0 +1,158 @@
+/**
+ * "Listening to" daemon out_http and in_http round-trip test.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs music daemon with in_http relay listening on a unix socket and
+ * sends it a batch of songs with out_http included directly.  Relay
+ * accepts at most two songs and rejects a song which is too short so
+ * its reply contains OK, REJ and FAIL statuses with messages.  Only
+ * songs answered with FAIL must be reported as failed.  Must be run
+ * from directory containing music and modules.
+ */
+
+#include "bench.h"
+#include "out_http.c"
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+
+/** Number of songs sent to the relay. */
+#define SONGS 5
+
+
+int main(int argc, char **argv) {
+	static const size_t expected[] = { 3, 4 };
+	struct music_module *const core = bench_init(argc, argv);
+	struct music_module *const m = init("out_http", "");
+	struct music_song songs[SONGS];
+	const struct music_song *list[SONGS + 1];
+	char dir[] = "/tmp/music-relay.XXXXXX";
+	char path[4][64];
+	size_t positions[SONGS], failed = 0, i;
+	pid_t daemon = 0;
+	int status, ret = 1;
+	struct stat st;
+	FILE *fp;
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return 1;
+	}
+	sprintf(path[0], "%s/config", dir);
+	sprintf(path[1], "%s/log", dir);
+	sprintf(path[2], "%s/relay", dir);
+	sprintf(path[3], "%s/pid", dir);
+
+
+	/***** Start relay *****/
+	if (!(fp = fopen(path[0], "w"))) {
+		perror(path[0]);
+		goto cleanDir;
+	}
+	fprintf(fp, "logfile %s\nloglevel 8\npidfile %s\n"
+	        "module in_http\nsocket %s\nqueue 2\n"
+	        "module out_http\nurl http://127.0.0.1:1/\n",
+	        path[1], path[3], path[2]);
+	fclose(fp);
+
+	switch ((daemon = fork())) {
+	case -1:
+		perror("fork");
+		goto cleanDir;
+	case 0:
+		execl("./music", "music", path[0], (char*)0);
+		perror("./music");
+		_exit(1);
+	}
+	if (waitpid(daemon, &status, 0) != daemon || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		printf("FAIL: music did not start; see %s\n", path[1]);
+		daemon = 0;
+		goto cleanDir;
+	}
+	for (daemon = 0, i = 0; i < 100 && (stat(path[2], &st) ||
+	                                    !(fp = fopen(path[3], "r"))); ++i) {
+		usleep(50000);
+	}
+	if (i == 100 || fscanf(fp, "%d", &status) != 1) {
+		printf("FAIL: relay did not start; see %s\n", path[1]);
+		goto cleanDir;
+	}
+	fclose(fp);
+	daemon = status;
+
+
+	/***** Send songs *****/
+	m->core = core;
+	m->name = (char*)"out_http";
+	m->loglevel = core->loglevel;
+	m->config(m, "url", "http://relay/");
+	m->config(m, "unix_socket", path[2]);
+	m->config(m, "proxy", "none");
+	if (!m->config(m, 0, 0) || !m->start(m)) {
+		puts("FAIL: could not start out_http");
+		goto killDaemon;
+	}
+
+	for (i = 0; i < SONGS; ++i) {
+		songs[i].title   = "Song Title";
+		songs[i].artist  = "Artist Name";
+		songs[i].album   = "Album Name";
+		songs[i].genre   = "Genre";
+		songs[i].time    = 0;
+		songs[i].endTime = 1190000000 + i * 240;
+		songs[i].length  = i == 1 ? 10 : 240;  /* REJ Song too short */
+		songs[i].ingest  = 0;
+		list[i] = songs + i;
+	}
+	list[SONGS] = 0;
+
+	failed = m->song.send(m, list, positions);
+	m->free(m);
+
+	if (failed != sizeof expected / sizeof *expected ||
+	    memcmp(positions, expected, sizeof expected)) {
+		printf("FAIL: %lu song(s) failed:", (unsigned long)failed);
+		for (i = 0; i < failed && i < SONGS; ++i) {
+			printf(" %lu", (unsigned long)positions[i]);
+		}
+		puts("; expected 3 4");
+	} else {
+		puts("PASS: relay's REJ and FAIL statuses");
+		ret = 0;
+	}
+
+
+	/***** Clean up *****/
+ killDaemon:
+	kill(daemon, SIGINT);
+	for (i = 0; i < 200 && !kill(daemon, 0); ++i) {
+		usleep(50000);
+	}
+
+ cleanDir:
+	if (ret) {
+		printf("files left in %s\n", dir);
+	} else {
+		for (i = 0; i < 4; ++i) unlink(path[i]);
+		rmdir(dir);
+	}
+	return ret;
+}
@@ -0,0 +1,180 @@
+/**
+ * "Listening to" daemon song trace format.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+
+/**
+ * Saves an unsigned LEB128 encoded integer.
+ *
+ * @param dest buffer to save to (at least 10 bytes).
+ * @param val value to save.
+ * @return number of bytes written.
+ */
+static size_t put_uint(unsigned char *restrict dest, unsigned long long val)
+	__attribute__((nonnull));
+static size_t put_uint(unsigned char *restrict dest, unsigned long long val) {
+	size_t n = 0;
+	while (val > 0x7f) {
+		dest[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	dest[n++] = val;
+	return n;
+}
+
+
+/**
+ * Reads an unsigned LEB128 encoded integer.
+ *
+ * @param fp file to read from.
+ * @param val where to save value.
+ * @return 1 on success, 0 at end of file before first byte, -1 on
+ *         error.
+ */
+static int    get_uint(FILE *restrict fp, unsigned long long *restrict val)
+	__attribute__((nonnull));
+static int    get_uint(FILE *restrict fp, unsigned long long *restrict val) {
+	unsigned long long v = 0;
+	unsigned shift = 0;
+	int ch;
+
+	while ((ch = getc(fp)) != EOF) {
+		if (shift > 63) return -1;
+		v |= (unsigned long long)(ch & 0x7f) << shift;
+		shift += 7;
+		if (!(ch & 0x80)) {
+			*val = v;
+			return 1;
+		}
+	}
+	return shift ? -1 : 0;
+}
+
+
+/** Zig-zag encodes a signed value. */
+#define ZIGZAG(x) ((x) < 0 ? ((unsigned long long)-((x) + 1) << 1) | 1 \
+                           : (unsigned long long)(x) << 1)
+
+/** Decodes a zig-zag encoded value. */
+#define UNZIGZAG(x) ((x) & 1 ? -(long long)((x) >> 1) - 1 : (long long)((x) >> 1))
+
+
+
+int  trace_write_header(FILE *restrict fp) {
+	return fwrite(TRACE_MAGIC, sizeof TRACE_MAGIC - 1, 1, fp) == 1;
+}
+
+
+
+int  trace_write(FILE *restrict fp, const struct music_song *restrict song,
+                 unsigned long long arrival, unsigned long long *restrict last) {
+	const char *const strs[4] = {
+		song->title, song->artist, song->album, song->genre
+	};
+	const long long sec = arrival / 1000000;
+	unsigned char head[50];
+	size_t n = 0, i;
+
+	n += put_uint(head + n, arrival > *last ? arrival - *last : 0);
+	n += put_uint(head + n, song->length);
+	n += put_uint(head + n, ZIGZAG((long long)song->time - sec));
+	n += put_uint(head + n, ZIGZAG((long long)song->endTime -
+	                               (long long)song->time));
+	if (arrival > *last) *last = arrival;
+
+	if (fwrite(head, n, 1, fp) != 1) return 0;
+
+	for (i = 0; i < 4; ++i) {
+		const size_t len = strs[i] ? strlen(strs[i]) : 0;
+		n = put_uint(head, strs[i] ? len + 1 : 0);
+		if (fwrite(head, n, 1, fp) != 1 ||
+		    (len && fwrite(strs[i], len, 1, fp) != 1)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+
+
+int  trace_read_header(FILE *restrict fp) {
+	char buf[sizeof TRACE_MAGIC - 1];
+	return fread(buf, sizeof buf, 1, fp) == 1 &&
+		!memcmp(buf, TRACE_MAGIC, sizeof buf);
+}
+
+
+
+int  trace_read(FILE *restrict fp, struct trace_record *restrict rec) {
+	unsigned long long v[4], lens[4];
+	size_t used = 0, i;
+	int ret;
+
+	if ((ret = get_uint(fp, v)) != 1) return ret;
+	for (i = 1; i < 4; ++i) {
+		if (get_uint(fp, v + i) != 1) return -1;
+	}
+
+	for (i = 0; i < 4; ++i) {
+		if (get_uint(fp, lens + i) != 1 || lens[i] > 1u << 20) return -1;
+		if (!lens[i]) continue;
+
+		if (rec->capacity < used + lens[i]) {
+			size_t cap = ((used + lens[i]) + 255) & ~(size_t)255;
+			char *tmp = realloc(rec->buf, cap);
+			if (!tmp) return -1;
+			rec->buf = tmp;
+			rec->capacity = cap;
+		}
+		if (lens[i] > 1 && fread(rec->buf + used, lens[i] - 1, 1, fp) != 1) {
+			return -1;
+		}
+		rec->buf[used + lens[i] - 1] = 0;
+		used += lens[i];
+	}
+
+	rec->arrival += v[0];
+	rec->song.length  = v[1];
+	rec->song.time    = UNZIGZAG(v[2]);
+	rec->song.endTime = rec->song.time + UNZIGZAG(v[3]);
+
+	/* Buffer may have been reallocated so set pointers at the end */
+#define STR(n) (lens[n] ? rec->buf + (used += lens[n]) - lens[n] : 0)
+	used = 0;
+	rec->song.title  = STR(0);
+	rec->song.artist = STR(1);
+	rec->song.album  = STR(2);
+	rec->song.genre  = STR(3);
+#undef STR
+
+	return 1;
+}
+
+
+
+void trace_record_free(struct trace_record *restrict rec) {
+	free(rec->buf);
+	rec->buf = 0;
+	rec->capacity = 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * "Listening to" daemon song trace format.
+ * Copyright (c) 2007 by Michal Nazarewicz (mina86/AT/mina86.com)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MUSIC_TRACE_H
+#define MUSIC_TRACE_H
+
+#include "music.h"
+
+#include <stdio.h>
+
+
+/**
+ * Magic string trace files start with.
+ *
+ * A trace file consists of TRACE_MAGIC followed by records.  Each
+ * record is a sequence of unsigned LEB128 encoded integers:
+ *
+ * - microseconds since previous record (or since the Epoch for the
+ *   first record),
+ * - song's length,
+ * - zig-zag encoded difference between song's time and arrival time
+ *   (in seconds),
+ * - zig-zag encoded difference between song's end time and song's
+ *   time,
+ * - for title, artist, album and genre: zero if value is NULL or
+ *   string's length plus one followed by the string itself.
+ */
+#define TRACE_MAGIC "MUSICTR1"
+
+
+/**
+ * A single record read from trace file.
+ */
+struct trace_record {
+	unsigned long long arrival;  /**< Arrival time in microseconds
+	                                  since the Epoch. */
+	struct music_song song;      /**< The song.  Strings point to
+	                                  buf. */
+	char *buf;                   /**< Buffer for song's strings. */
+	size_t capacity;             /**< Buffer's capacity. */
+};
+
+
+/**
+ * Writes trace file's header.
+ *
+ * @param fp file to write to.
+ * @return zero on error, non-zero on success.
+ */
+int  trace_write_header(FILE *restrict fp) __attribute__((nonnull));
+
+
+/**
+ * Writes a single record to trace file.  The last argument holds
+ * arrival time of previously written record and is updated.  It must
+ * be zero before first record is written.
+ *
+ * @param fp file to write to.
+ * @param song song to write.
+ * @param arrival song's arrival time in microseconds since the Epoch.
+ * @param last arrival time of previous record.
+ * @return zero on error, non-zero on success.
+ */
+int  trace_write(FILE *restrict fp, const struct music_song *restrict song,
+                 unsigned long long arrival, unsigned long long *restrict last)
+	__attribute__((nonnull));
+
+
+/**
+ * Reads and checks trace file's header.
+ *
+ * @param fp file to read from.
+ * @return zero if file is not a trace file, non-zero otherwise.
+ */
+int  trace_read_header(FILE *restrict fp) __attribute__((nonnull));
+
+
+/**
+ * Reads a single record from trace file.  Record must be zeroed
+ * before first call and freed with trace_record_free() after last
+ * call.  Song's time and end time are relative to arrival time (ie. as
+ * if arrival was at 0).
+ *
+ * @param fp file to read from.
+ * @param rec record to fill.
+ * @return 1 if record was read, 0 at end of file, -1 on error.
+ */
+int  trace_read(FILE *restrict fp, struct trace_record *restrict rec)
+	__attribute__((nonnull));
+
+
+/**
+ * Frees memory allocated by trace_read().
+ *
+ * @param rec record to free.
+ */
+void trace_record_free(struct trace_record *restrict rec)
+	__attribute__((nonnull));
+
+
+#endif